@@ -0,0 +1,97 @@
+//
+//  CoBufferPool.h
+//  Copyright (c) 2014 Yang Yubo <yang@codinn.com>
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+//
+
+#import <Foundation/Foundation.h>
+
+/**
+ * A pool of fixed size buffers, kept per NUMA node.
+ *
+ * A buffer is taken from the pool of the node the calling thread runs on, and goes back to the pool
+ * it came from. New buffers are bound to that node (mbind on Linux) and touched by the calling thread,
+ * so their pages are local to the CPUs that use them. Where there is no NUMA, there is a single pool.
+ *
+ * All methods are thread safe. Threads on different nodes never share a lock.
+ *
+ * The memory of all pools counts against one process-wide limit. Past the limit no buffer is mapped,
+ * and close to it (memoryUnderPressure) released buffers are unmapped instead of kept, and sockets
+ * stop reading ahead and give their buffers back whenever they are empty.
+ **/
+@interface CoBufferPool : NSObject
+
+/**
+ * Process-wide limit on the bytes mapped by all pools, zero (the default) for no limit.
+ **/
++ (void)setMemoryLimit:(size_t)limit;
++ (size_t)memoryLimit;
+
+/**
+ * Returns the bytes mapped by all pools, in use or free for reuse.
+ **/
++ (size_t)memoryInUse;
+
+/**
+ * Returns whether memory in use is past 7/8 of the limit.
+ **/
++ (BOOL)isMemoryUnderPressure;
+
+/**
+ * Returns the pool of 64 KiB buffers CoSocket reads into.
+ **/
++ (CoBufferPool *)sharedPool;
+
+/**
+ * Returns the NUMA node the calling thread runs on, 0 without NUMA.
+ **/
++ (NSUInteger)currentNode;
+
+/**
+ * @param size         The size of every buffer.
+ * @param maxFreeCount Buffers kept for reuse per node, further released buffers are unmapped.
+ **/
+- (instancetype)initWithBufferSize:(size_t)size maxFreeCount:(NSUInteger)maxFreeCount;
+
+@property (atomic, readonly) size_t bufferSize;
+@property (atomic, readonly) NSUInteger nodeCount;
+
+/**
+ * Returns a buffer of bufferSize bytes, local to the calling thread's node, or NULL with errno set.
+ * Fails with ENOBUFS when a new buffer would exceed the memory limit even after unmapping all free buffers.
+ **/
+- (void *)allocateBuffer;
+
+/**
+ * Gives a buffer returned by allocateBuffer back to its node's pool.
+ **/
+- (void)releaseBuffer:(void *)buffer;
+
+/**
+ * Returns the number of buffers ready for reuse on a node.
+ **/
+- (NSUInteger)freeCountOnNode:(NSUInteger)node;
+
+/**
+ * Unmaps the buffers kept for reuse on all nodes.
+ **/
+- (void)trim;
+
+@end
@@ -0,0 +1,315 @@
+//
+//  CoBufferPool.m
+//  Copyright (c) 2014 Yang Yubo <yang@codinn.com>
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+//
+
+#import "CoBufferPool.h"
+#import <dirent.h>
+#import <errno.h>
+#import <pthread.h>
+#import <stdatomic.h>
+#import <stdio.h>
+#import <stdlib.h>
+#import <string.h>
+#import <unistd.h>
+#import <sys/mman.h>
+
+#if defined(__linux__)
+#import <sys/syscall.h>
+#endif
+
+#define CoBufferPoolMaxNodes    64
+#define CoBufferHeaderSize      64      // Keeps the buffer cache line aligned
+#define CoBufferPoolMaxFree     256     // 16 MiB of 64 KiB buffers per node
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+// Sits in front of every buffer
+typedef struct CoBufferHeader {
+    struct CoBufferHeader *next;
+    size_t mappedSize;
+    unsigned node;
+} CoBufferHeader;
+
+typedef struct {
+    pthread_mutex_t lock;
+    CoBufferHeader *free;
+    NSUInteger freeCount;
+} __attribute__((aligned(64))) CoBufferNode;   // Nodes don't share cache lines
+
+static NSUInteger count_nodes(void);
+
+static _Atomic(size_t) memoryLimit = 0;
+static _Atomic(size_t) memoryInUse = 0;
+
+@implementation CoBufferPool {
+    CoBufferNode *_nodes;
+    NSUInteger _maxFreeCount;
+}
+
++ (CoBufferPool *)sharedPool
+{
+    static CoBufferPool *sharedPool = nil;
+    
+    @synchronized(self) {
+        if (!sharedPool) {
+            sharedPool = [[CoBufferPool alloc] initWithBufferSize:65536 maxFreeCount:CoBufferPoolMaxFree];
+        }
+    }
+    
+    return sharedPool;
+}
+
++ (void)setMemoryLimit:(size_t)limit
+{
+    atomic_store(&memoryLimit, limit);
+}
+
++ (size_t)memoryLimit
+{
+    return atomic_load(&memoryLimit);
+}
+
++ (size_t)memoryInUse
+{
+    return atomic_load(&memoryInUse);
+}
+
++ (BOOL)isMemoryUnderPressure
+{
+    size_t limit = atomic_load(&memoryLimit);
+    
+    return limit > 0 && atomic_load(&memoryInUse) > limit - limit / 8;
+}
+
+/**
+ Counts size bytes against the memory limit, unless they would exceed it.
+ */
++ (BOOL)reserveMemory:(size_t)size
+{
+    size_t limit = atomic_load(&memoryLimit);
+    size_t inUse = atomic_fetch_add(&memoryInUse, size) + size;
+    
+    if (limit > 0 && inUse > limit) {
+        atomic_fetch_sub(&memoryInUse, size);
+        return NO;
+    }
+    
+    return YES;
+}
+
++ (NSUInteger)currentNode
+{
+#if defined(__linux__) && defined(SYS_getcpu)
+    unsigned cpu = 0, node = 0;
+    
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0) {
+        return node;
+    }
+#endif
+    
+    return 0;
+}
+
+- (instancetype)init
+{
+    return [self initWithBufferSize:65536 maxFreeCount:CoBufferPoolMaxFree];
+}
+
+- (instancetype)initWithBufferSize:(size_t)size maxFreeCount:(NSUInteger)maxFreeCount
+{
+    if ((self = [super init])) {
+        _bufferSize = size;
+        _maxFreeCount = maxFreeCount;
+        _nodeCount = count_nodes();
+        
+        if (posix_memalign((void **)&_nodes, 64, _nodeCount * sizeof(CoBufferNode)) != 0) {
+            return nil;
+        }
+        
+        for (NSUInteger node = 0; node < _nodeCount; node++) {
+            pthread_mutex_init(&_nodes[node].lock, NULL);
+            _nodes[node].free = NULL;
+            _nodes[node].freeCount = 0;
+        }
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    for (NSUInteger node = 0; node < _nodeCount; node++) {
+        [self unmapList:_nodes[node].free];
+        pthread_mutex_destroy(&_nodes[node].lock);
+    }
+    
+    free(_nodes);
+}
+
+- (void *)allocateBuffer
+{
+    NSUInteger node = MIN([self.class currentNode], _nodeCount - 1);
+    CoBufferNode *pool = &_nodes[node];
+    
+    pthread_mutex_lock(&pool->lock);
+    CoBufferHeader *header = pool->free;
+    if (header) {
+        pool->free = header->next;
+        pool->freeCount--;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    
+    if (header) {
+        return (char *)header + CoBufferHeaderSize;
+    }
+    
+    size_t mappedSize = _bufferSize + CoBufferHeaderSize;
+    
+    if (![self.class reserveMemory:mappedSize]) {
+        // Free buffers of other nodes are memory nobody uses
+        [self trim];
+        
+        if (![self.class reserveMemory:mappedSize]) {
+            errno = ENOBUFS;
+            return NULL;
+        }
+    }
+    
+    header = mmap(NULL, mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    
+    if (header == MAP_FAILED) {
+        atomic_fetch_sub(&memoryInUse, mappedSize);
+        return NULL;
+    }
+    
+#if defined(__linux__) && defined(SYS_mbind)
+    if (_nodeCount > 1) {
+        // Best effort, first touch below places the pages anyway unless the thread migrates meanwhile
+        unsigned long nodemask = 1UL << node;
+        syscall(SYS_mbind, header, mappedSize, MPOL_PREFERRED, &nodemask, sizeof(nodemask) * 8, 0);
+    }
+#endif
+    
+    // First touch, from the thread that is going to use the buffer
+    memset(header, 0, mappedSize);
+    
+    header->mappedSize = mappedSize;
+    header->node = (unsigned)node;
+    
+    return (char *)header + CoBufferHeaderSize;
+}
+
+- (void)releaseBuffer:(void *)buffer
+{
+    if (!buffer) {
+        return;
+    }
+    
+    CoBufferHeader *header = (CoBufferHeader *)((char *)buffer - CoBufferHeaderSize);
+    CoBufferNode *pool = &_nodes[header->node];
+    
+    // Close to the limit, memory is worth more to whoever needs a buffer next than a warm buffer here
+    BOOL underPressure = [self.class isMemoryUnderPressure];
+    
+    pthread_mutex_lock(&pool->lock);
+    BOOL keep = !underPressure && pool->freeCount < _maxFreeCount;
+    if (keep) {
+        header->next = pool->free;
+        pool->free = header;
+        pool->freeCount++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    
+    if (!keep) {
+        header->next = NULL;
+        [self unmapList:header];
+    }
+}
+
+- (void)trim
+{
+    for (NSUInteger node = 0; node < _nodeCount; node++) {
+        pthread_mutex_lock(&_nodes[node].lock);
+        CoBufferHeader *list = _nodes[node].free;
+        _nodes[node].free = NULL;
+        _nodes[node].freeCount = 0;
+        pthread_mutex_unlock(&_nodes[node].lock);
+        
+        [self unmapList:list];
+    }
+}
+
+- (void)unmapList:(CoBufferHeader *)header
+{
+    while (header) {
+        CoBufferHeader *next = header->next;
+        size_t mappedSize = header->mappedSize;
+        
+        munmap(header, mappedSize);
+        atomic_fetch_sub(&memoryInUse, mappedSize);
+        header = next;
+    }
+}
+
+- (NSUInteger)freeCountOnNode:(NSUInteger)node
+{
+    if (node >= _nodeCount) {
+        return 0;
+    }
+    
+    pthread_mutex_lock(&_nodes[node].lock);
+    NSUInteger count = _nodes[node].freeCount;
+    pthread_mutex_unlock(&_nodes[node].lock);
+    
+    return count;
+}
+
+@end
+
+/**
+ Returns one more than the highest NUMA node id, 1 without NUMA.
+ */
+static NSUInteger count_nodes(void)
+{
+    NSUInteger count = 1;
+    
+#if defined(__linux__)
+    DIR *dir = opendir("/sys/devices/system/node");
+    
+    if (dir) {
+        struct dirent *entry;
+        
+        while ((entry = readdir(dir)) != NULL) {
+            unsigned node;
+            
+            if (sscanf(entry->d_name, "node%u", &node) == 1) {
+                count = MAX(count, (NSUInteger)node + 1);
+            }
+        }
+        
+        closedir(dir);
+    }
+#endif
+    
+    return MIN(count, CoBufferPoolMaxNodes);
+}
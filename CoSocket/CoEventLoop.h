@@ -0,0 +1,121 @@
+//
+//  CoEventLoop.h
+//  Copyright (c) 2014 Yang Yubo <yang@codinn.com>
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+//
+
+#import <Foundation/Foundation.h>
+#import "CoTimingWheel.h"
+
+@class CoSocket;
+
+typedef NS_OPTIONS(NSUInteger, CoEventMask) {
+    CoEventRead     = 1 << 0,   // Also reported on hang up and error, so the next read sees it
+    CoEventWrite    = 1 << 1,
+};
+
+typedef void (^ CoEventHandler)(CoEventMask events);
+typedef void (^ CoEventLoopBlock)(void);
+
+/**
+ * An event loop on a single thread: readiness of file descriptors (epoll on Linux, kqueue on Darwin),
+ * timers on a timing wheel of its own, and a queue of blocks posted from other threads.
+ *
+ * Everything a loop owns (its watchers, its sockets and its timers' handlers) is only touched on the loop's
+ * thread. Other threads talk to it by posting blocks, which is the only point where threads synchronize.
+ **/
+@interface CoEventLoop : NSObject
+
+/**
+ * Returns the loop running on the calling thread, or nil.
+ **/
++ (CoEventLoop *)currentLoop;
+
+/**
+ * Creates a loop. Start it with start, or run it on a thread of your own with run.
+ *
+ * @param cpu The CPU to pin the loop's thread to, or -1 to let the scheduler place it.
+ **/
+- (instancetype)initWithName:(NSString *)name cpu:(int)cpu;
+
+@property (atomic, readonly) NSString *name;
+/**
+ * The CPU the loop's thread is pinned to, or -1 if it isn't (or pinning failed).
+ **/
+@property (atomic, readonly) int cpu;
+
+/**
+ * Timers of the loop, run on the loop's thread.
+ * CoSocket schedules the idle timeouts and heartbeats of the sockets added to the loop here.
+ **/
+@property (atomic, readonly) CoTimingWheel *timingWheel;
+
+/**
+ * Returns whether the calling thread is the loop's thread.
+ **/
+@property (atomic, readonly, getter=isCurrent) BOOL current;
+
+/**
+ * Starts a thread running the loop.
+ **/
+- (void)start;
+
+/**
+ * Runs the loop on the calling thread until stop is called.
+ **/
+- (void)run;
+
+/**
+ * Makes the loop return after the current iteration. May be called from any thread.
+ **/
+- (void)stop;
+
+/**
+ * Queues a block to run on the loop's thread, in posting order. May be called from any thread.
+ **/
+- (void)post:(CoEventLoopBlock)block;
+
+#pragma mark Loop thread only
+
+/**
+ * Calls handler on the loop's thread whenever fd is ready for any of events (level triggered).
+ * Watching a watched descriptor again replaces its events and handler.
+ **/
+- (BOOL)watchFileDescriptor:(int)fd events:(CoEventMask)events handler:(CoEventHandler)handler error:(NSError **)errPtr;
+
+/**
+ * Stops watching fd. Must be called before fd is closed.
+ **/
+- (void)unwatchFileDescriptor:(int)fd;
+
+/**
+ * Connections served by this loop. A socket belongs to one loop at a time, whose timers it then uses.
+ * May be called from any thread, the set itself changes on the loop's thread.
+ * A socket leaves its loop when it disconnects and has no asynchronous operation left.
+ **/
+- (void)addSocket:(CoSocket *)socket;
+- (void)removeSocket:(CoSocket *)socket;
+
+/**
+ * A snapshot of the connections, safe to take from any thread.
+ **/
+@property (atomic, readonly) NSSet *sockets;
+
+@end
@@ -0,0 +1,411 @@
+//
+//  CoEventLoop.m
+//  Copyright (c) 2014 Yang Yubo <yang@codinn.com>
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+//
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE     // CPU_SET and friends
+#endif
+
+#import "CoEventLoop.h"
+#import "CoSocket.h"
+#import <errno.h>
+#import <math.h>
+#import <pthread.h>
+#import <sched.h>
+#import <stdatomic.h>
+#import <string.h>
+#import <unistd.h>
+
+#if defined(__linux__)
+#import <sys/epoll.h>
+#import <sys/eventfd.h>
+#else
+#import <sys/event.h>
+#import <mach/mach.h>
+#import <mach/thread_policy.h>
+#endif
+
+#define CoEventLoopBatch 64     // Events taken per wait
+
+static _Thread_local __unsafe_unretained CoEventLoop *currentLoop = nil;
+
+static BOOL pin_current_thread(int cpu);
+
+@interface CoSocket (CoEventLoop)
+- (void)setEventLoop:(CoEventLoop *)eventLoop;
+@end
+
+@interface CoEventWatcher : NSObject {
+@public
+    CoEventMask _events;
+    CoEventHandler _handler;
+}
+@end
+
+@implementation CoEventWatcher
+@end
+
+@implementation CoEventLoop {
+    int _pollFD;                        // epoll or kqueue
+    int _wakeFD;                        // eventfd, kqueue wakes up through EVFILT_USER instead
+    
+    pthread_mutex_t _postLock;
+    NSMutableArray *_posted;
+    
+    atomic_bool _stopped;
+    
+    NSMutableDictionary *_watchers;     // Loop thread only, fd => CoEventWatcher
+    pthread_mutex_t _socketsLock;       // Changed on the loop thread, read by sockets from any thread
+    NSMutableSet *_sockets;
+}
+
++ (CoEventLoop *)currentLoop
+{
+    return currentLoop;
+}
+
+- (instancetype)init
+{
+    return [self initWithName:@"com.codinn.CoSocket.loop" cpu:-1];
+}
+
+- (instancetype)initWithName:(NSString *)name cpu:(int)cpu
+{
+    if ((self = [super init])) {
+        _name = [name copy];
+        _cpu = cpu;
+        _timingWheel = [[CoTimingWheel alloc] initWithResolution:0.001];
+        _posted = [NSMutableArray array];
+        _watchers = [NSMutableDictionary dictionary];
+        _sockets = [NSMutableSet set];
+        pthread_mutex_init(&_postLock, NULL);
+        pthread_mutex_init(&_socketsLock, NULL);
+        
+#if defined(__linux__)
+        _pollFD = epoll_create1(EPOLL_CLOEXEC);
+        _wakeFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        
+        struct epoll_event event = { .events = EPOLLIN, .data.fd = _wakeFD };
+        if (_pollFD < 0 || _wakeFD < 0 || epoll_ctl(_pollFD, EPOLL_CTL_ADD, _wakeFD, &event) != 0) {
+            return nil;
+        }
+#else
+        _pollFD = kqueue();
+        _wakeFD = -1;
+        
+        struct kevent event;
+        EV_SET(&event, 0, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+        if (_pollFD < 0 || kevent(_pollFD, &event, 1, NULL, 0, NULL) != 0) {
+            return nil;
+        }
+#endif
+        
+        // A timer scheduled from another thread may be due before the loop would wake up
+        __weak CoEventLoop *weakSelf = self;
+        _timingWheel.wakeupHandler = ^{
+            CoEventLoop *loop = weakSelf;
+            if (loop && !loop.isCurrent) [loop wakeup];
+        };
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    if (_pollFD >= 0) close(_pollFD);
+    if (_wakeFD >= 0) close(_wakeFD);
+    pthread_mutex_destroy(&_postLock);
+    pthread_mutex_destroy(&_socketsLock);
+}
+
+- (BOOL)isCurrent
+{
+    return currentLoop == self;
+}
+
+- (NSSet *)sockets
+{
+    pthread_mutex_lock(&_socketsLock);
+    NSSet *sockets = [_sockets copy];
+    pthread_mutex_unlock(&_socketsLock);
+    return sockets;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Running
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (void)start
+{
+    NSThread *thread = [[NSThread alloc] initWithTarget:self selector:@selector(run) object:nil];
+    thread.name = _name;
+    [thread start];
+}
+
+- (void)run
+{
+    currentLoop = self;
+    
+    if (_cpu >= 0 && !pin_current_thread(_cpu)) {
+        _cpu = -1;
+    }
+    
+    while (!atomic_load(&_stopped)) {
+        @autoreleasepool {
+            NSTimeInterval timeout = [_timingWheel nextTimeout];
+            
+            [self pollWithTimeout:timeout < 0 ? -1 : (int)ceil(timeout * 1000)];
+            [self runPosted];
+            [_timingWheel advanceToTime:[CoTimingWheel now]];
+        }
+    }
+    
+    currentLoop = nil;
+}
+
+- (void)stop
+{
+    atomic_store(&_stopped, true);
+    [self wakeup];
+}
+
+- (void)post:(CoEventLoopBlock)block
+{
+    pthread_mutex_lock(&_postLock);
+    BOOL wasEmpty = (_posted.count == 0);
+    [_posted addObject:[block copy]];
+    pthread_mutex_unlock(&_postLock);
+    
+    // The first block posted since the loop last drained the queue wakes it up, the rest ride along
+    if (wasEmpty) {
+        [self wakeup];
+    }
+}
+
+- (void)runPosted
+{
+    pthread_mutex_lock(&_postLock);
+    NSArray *posted = _posted;
+    _posted = [NSMutableArray array];
+    pthread_mutex_unlock(&_postLock);
+    
+    for (CoEventLoopBlock block in posted) {
+        block();
+    }
+}
+
+- (void)wakeup
+{
+#if defined(__linux__)
+    uint64_t one = 1;
+    ssize_t __unused written = write(_wakeFD, &one, sizeof(one));
+#else
+    struct kevent event;
+    EV_SET(&event, 0, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+    kevent(_pollFD, &event, 1, NULL, 0, NULL);
+#endif
+}
+
+- (void)dispatchEvents:(CoEventMask)events toFileDescriptor:(int)fd
+{
+    // Looked up per event, a handler earlier in the batch may have unwatched fd
+    CoEventWatcher *watcher = _watchers[@(fd)];
+    
+    if (watcher && (events & watcher->_events)) {
+        CoEventHandler handler = watcher->_handler;
+        handler(events & watcher->_events);
+    }
+}
+
+#if defined(__linux__)
+
+- (void)pollWithTimeout:(int)timeout_ms
+{
+    struct epoll_event events[CoEventLoopBatch];
+    int count = epoll_wait(_pollFD, events, CoEventLoopBatch, timeout_ms);
+    
+    for (int i = 0; i < count; i++) {
+        int fd = events[i].data.fd;
+        
+        if (fd == _wakeFD) {
+            uint64_t value;
+            ssize_t __unused justRead = read(_wakeFD, &value, sizeof(value));
+            continue;
+        }
+        
+        CoEventMask mask = 0;
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) mask |= CoEventRead;
+        if (events[i].events & (EPOLLOUT | EPOLLERR)) mask |= CoEventWrite;
+        
+        [self dispatchEvents:mask toFileDescriptor:fd];
+    }
+}
+
+- (BOOL)watchFileDescriptor:(int)fd events:(CoEventMask)events handler:(CoEventHandler)handler error:(NSError **)errPtr
+{
+    BOOL watched = (_watchers[@(fd)] != nil);
+    
+    struct epoll_event event = { .events = 0, .data.fd = fd };
+    if (events & CoEventRead) event.events |= EPOLLIN | EPOLLRDHUP;
+    if (events & CoEventWrite) event.events |= EPOLLOUT;
+    
+    if (epoll_ctl(_pollFD, watched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &event) != 0) {
+        if (errPtr) *errPtr = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno
+                                              userInfo:@{ NSLocalizedDescriptionKey : [NSString stringWithUTF8String:strerror(errno)] }];
+        return NO;
+    }
+    
+    CoEventWatcher *watcher = [[CoEventWatcher alloc] init];
+    watcher->_events = events;
+    watcher->_handler = [handler copy];
+    _watchers[@(fd)] = watcher;
+    
+    return YES;
+}
+
+- (void)unwatchFileDescriptor:(int)fd
+{
+    if (_watchers[@(fd)]) {
+        epoll_ctl(_pollFD, EPOLL_CTL_DEL, fd, NULL);
+        [_watchers removeObjectForKey:@(fd)];
+    }
+}
+
+#else
+
+- (void)pollWithTimeout:(int)timeout_ms
+{
+    struct kevent events[CoEventLoopBatch];
+    struct timespec timeout = { .tv_sec = timeout_ms / 1000, .tv_nsec = (timeout_ms % 1000) * 1000000L };
+    int count = kevent(_pollFD, NULL, 0, events, CoEventLoopBatch, timeout_ms < 0 ? NULL : &timeout);
+    
+    for (int i = 0; i < count; i++) {
+        if (events[i].filter == EVFILT_USER) {
+            continue;
+        }
+        
+        CoEventMask mask = 0;
+        if (events[i].filter == EVFILT_READ || (events[i].flags & (EV_EOF | EV_ERROR))) mask |= CoEventRead;
+        if (events[i].filter == EVFILT_WRITE) mask |= CoEventWrite;
+        
+        [self dispatchEvents:mask toFileDescriptor:(int)events[i].ident];
+    }
+}
+
+- (BOOL)watchFileDescriptor:(int)fd events:(CoEventMask)events handler:(CoEventHandler)handler error:(NSError **)errPtr
+{
+    struct kevent changes[2];
+    EV_SET(&changes[0], fd, EVFILT_READ, (events & CoEventRead) ? EV_ADD : EV_DELETE, 0, 0, NULL);
+    EV_SET(&changes[1], fd, EVFILT_WRITE, (events & CoEventWrite) ? EV_ADD : EV_DELETE, 0, 0, NULL);
+    
+    for (int i = 0; i < 2; i++) {
+        // Deleting a filter that was never added fails with ENOENT, which is fine
+        if (kevent(_pollFD, &changes[i], 1, NULL, 0, NULL) != 0 && !(changes[i].flags & EV_DELETE)) {
+            if (errPtr) *errPtr = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno
+                                                  userInfo:@{ NSLocalizedDescriptionKey : [NSString stringWithUTF8String:strerror(errno)] }];
+            return NO;
+        }
+    }
+    
+    CoEventWatcher *watcher = [[CoEventWatcher alloc] init];
+    watcher->_events = events;
+    watcher->_handler = [handler copy];
+    _watchers[@(fd)] = watcher;
+    
+    return YES;
+}
+
+- (void)unwatchFileDescriptor:(int)fd
+{
+    if (_watchers[@(fd)]) {
+        struct kevent changes[2];
+        EV_SET(&changes[0], fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+        EV_SET(&changes[1], fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+        kevent(_pollFD, &changes[0], 1, NULL, 0, NULL);
+        kevent(_pollFD, &changes[1], 1, NULL, 0, NULL);
+        [_watchers removeObjectForKey:@(fd)];
+    }
+}
+
+#endif
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Connections
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (void)addSocket:(CoSocket *)socket
+{
+    if (!self.isCurrent) {
+        [self post:^{ [self addSocket:socket]; }];
+        return;
+    }
+    
+    CoEventLoop *previous = socket.eventLoop;
+    
+    if (previous && previous != self) {
+        [previous removeSocket:socket];
+    }
+    
+    pthread_mutex_lock(&_socketsLock);
+    [_sockets addObject:socket];
+    pthread_mutex_unlock(&_socketsLock);
+    
+    [socket setEventLoop:self];
+}
+
+- (void)removeSocket:(CoSocket *)socket
+{
+    if (!self.isCurrent) {
+        [self post:^{ [self removeSocket:socket]; }];
+        return;
+    }
+    
+    if (socket.eventLoop == self) {
+        [socket setEventLoop:nil];
+    }
+    
+    pthread_mutex_lock(&_socketsLock);
+    [_sockets removeObject:socket];
+    pthread_mutex_unlock(&_socketsLock);
+}
+
+@end
+
+/**
+ Pins the calling thread to the given CPU.
+ */
+static BOOL pin_current_thread(int cpu)
+{
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    
+    // Zero is the calling thread, not the whole process
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+    // Darwin has no hard affinity, threads with different tags are only kept apart
+    thread_affinity_policy_data_t policy = { .affinity_tag = cpu + 1 };
+    return thread_policy_set(pthread_mach_thread_np(pthread_self()), THREAD_AFFINITY_POLICY,
+                             (thread_policy_t)&policy, THREAD_AFFINITY_POLICY_COUNT) == KERN_SUCCESS;
+#endif
+}
@@ -0,0 +1,86 @@
+//
+//  CoExecutor.h
+//  Copyright (c) 2014 Yang Yubo <yang@codinn.com>
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+//
+
+#import <Foundation/Foundation.h>
+#import "CoEventLoop.h"
+
+typedef void (^ CoExecutorTask)(void);
+
+/**
+ * A work-stealing executor for per-connection protocol handlers.
+ *
+ * Every worker thread has a Chase-Lev deque. Tasks submitted by a worker go to the bottom of its own
+ * deque, where it takes them back without contention, newest first. An idle worker steals the oldest
+ * task from the top of a busy worker's deque, so a burst of work on a few hot connections spreads
+ * over all workers instead of saturating the threads those connections were born on.
+ * Tasks submitted from other threads go through a shared queue.
+ *
+ * Tasks may run on any worker. Nothing is guaranteed about their order, except that a worker
+ * runs its own tasks last in first out.
+ **/
+@interface CoExecutor : NSObject
+
+/**
+ * Returns an executor with one worker per CPU the process may run on.
+ **/
++ (CoExecutor *)sharedExecutor;
+
+/**
+ * Returns the index of the worker running the calling thread, or NSNotFound.
+ **/
++ (NSUInteger)currentWorkerIndex;
+
+/**
+ * Creates and starts an executor.
+ *
+ * @param count The number of workers, zero for one per CPU the process may run on.
+ **/
+- (instancetype)initWithWorkerCount:(NSUInteger)count;
+
+@property (atomic, readonly) NSUInteger workerCount;
+
+/**
+ * Returns the number of tasks idle workers stole from busy ones so far.
+ **/
+@property (atomic, readonly) NSUInteger stolenCount;
+
+/**
+ * Runs the task on one of the workers. May be called from any thread.
+ **/
+- (void)submit:(CoExecutorTask)task;
+
+/**
+ * Runs handler once on one of the workers, as soon as fd is ready for any of events on loop.
+ *
+ * The descriptor isn't watched while the handler runs, so a connection's handler never runs twice at
+ * the same time. The handler arms it again, by calling this method, once it wants more events.
+ * May be called from any thread.
+ **/
+- (void)runHandler:(CoEventHandler)handler whenFileDescriptor:(int)fd isReadyFor:(CoEventMask)events onLoop:(CoEventLoop *)loop;
+
+/**
+ * Makes the workers exit once there are no more tasks to run.
+ **/
+- (void)stop;
+
+@end
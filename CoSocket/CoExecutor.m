@@ -0,0 +1,430 @@
+//
+//  CoExecutor.m
+//  Copyright (c) 2014 Yang Yubo <yang@codinn.com>
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+//
+
+//
+//  The deques follow "Correct and Efficient Work-Stealing for Weak Memory Models"
+//  by Lê, Pop, Cohen and Zappa Nardelli (PPoPP 2013), which adapts the Chase-Lev deque to C11 atomics.
+//
+
+#import "CoExecutor.h"
+#import "CoRuntime.h"
+#import <pthread.h>
+#import <stdatomic.h>
+#import <stdlib.h>
+#import <time.h>
+
+#define CoDequeInitialSize  256     // Power of two, grows by doubling
+#define CoWorkerParkTimeout 0.05    // Safety net for a wakeup racing with a worker going to sleep
+
+typedef struct CoDequeArray {
+    int64_t size;
+    struct CoDequeArray *previous;  // Thieves may still read an outgrown array, freed with the deque
+    _Atomic(void *) items[];
+} CoDequeArray;
+
+typedef struct {
+    _Atomic(int64_t) top;
+    _Atomic(int64_t) bottom;
+    _Atomic(CoDequeArray *) array;
+    uint32_t seed;                  // Picks the first victim to steal from
+} __attribute__((aligned(64))) CoWorker;  // Workers don't share cache lines
+
+static _Thread_local CoWorker *currentWorker = NULL;
+static _Thread_local __unsafe_unretained CoExecutor *currentExecutor = nil;
+static _Thread_local NSUInteger currentWorkerIndex = NSNotFound;
+
+static CoDequeArray *deque_array_create(int64_t size)
+{
+    CoDequeArray *array = calloc(1, sizeof(CoDequeArray) + size * sizeof(_Atomic(void *)));
+    array->size = size;
+    return array;
+}
+
+/**
+ Owner only. Pushes a task to the bottom.
+ */
+static void deque_push(CoWorker *worker, void *task)
+{
+    int64_t b = atomic_load_explicit(&worker->bottom, memory_order_relaxed);
+    int64_t t = atomic_load_explicit(&worker->top, memory_order_acquire);
+    CoDequeArray *a = atomic_load_explicit(&worker->array, memory_order_relaxed);
+    
+    if (b - t > a->size - 1) {
+        CoDequeArray *grown = deque_array_create(a->size * 2);
+        
+        for (int64_t i = t; i < b; i++) {
+            void *item = atomic_load_explicit(&a->items[i & (a->size - 1)], memory_order_relaxed);
+            atomic_store_explicit(&grown->items[i & (grown->size - 1)], item, memory_order_relaxed);
+        }
+        
+        grown->previous = a;
+        atomic_store_explicit(&worker->array, grown, memory_order_release);
+        a = grown;
+    }
+    
+    atomic_store_explicit(&a->items[b & (a->size - 1)], task, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&worker->bottom, b + 1, memory_order_relaxed);
+}
+
+/**
+ Owner only. Takes the task at the bottom, or NULL.
+ */
+static void *deque_take(CoWorker *worker)
+{
+    int64_t b = atomic_load_explicit(&worker->bottom, memory_order_relaxed) - 1;
+    CoDequeArray *a = atomic_load_explicit(&worker->array, memory_order_relaxed);
+    atomic_store_explicit(&worker->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t t = atomic_load_explicit(&worker->top, memory_order_relaxed);
+    
+    if (t > b) {
+        // Empty
+        atomic_store_explicit(&worker->bottom, b + 1, memory_order_relaxed);
+        return NULL;
+    }
+    
+    void *task = atomic_load_explicit(&a->items[b & (a->size - 1)], memory_order_relaxed);
+    
+    if (t == b) {
+        // Last task, race the thieves for it
+        if (!atomic_compare_exchange_strong_explicit(&worker->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed)) {
+            task = NULL;
+        }
+        atomic_store_explicit(&worker->bottom, b + 1, memory_order_relaxed);
+    }
+    
+    return task;
+}
+
+/**
+ Any thread. Steals the task at the top, or returns NULL if there is none or another thief won it.
+ */
+static void *deque_steal(CoWorker *worker)
+{
+    int64_t t = atomic_load_explicit(&worker->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t b = atomic_load_explicit(&worker->bottom, memory_order_acquire);
+    
+    if (t >= b) {
+        return NULL;
+    }
+    
+    CoDequeArray *a = atomic_load_explicit(&worker->array, memory_order_acquire);
+    void *task = atomic_load_explicit(&a->items[t & (a->size - 1)], memory_order_relaxed);
+    
+    if (!atomic_compare_exchange_strong_explicit(&worker->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed)) {
+        return NULL;
+    }
+    
+    return task;
+}
+
+static BOOL deque_is_empty(CoWorker *worker)
+{
+    int64_t t = atomic_load_explicit(&worker->top, memory_order_acquire);
+    int64_t b = atomic_load_explicit(&worker->bottom, memory_order_acquire);
+    return t >= b;
+}
+
+@implementation CoExecutor {
+    CoWorker *_workers;
+    
+    pthread_mutex_t _lock;              // Guards the injection queue and parking
+    pthread_cond_t _wakeup;
+    NSMutableArray *_injected;
+    NSUInteger _injectedHead;           // Next task to take, the taken ones are dropped in batches
+    _Atomic(NSUInteger) _injectedCount;
+    _Atomic(NSUInteger) _sleepers;
+    _Atomic(NSUInteger) _stolen;
+    atomic_bool _stopped;
+}
+
++ (CoExecutor *)sharedExecutor
+{
+    static CoExecutor *sharedExecutor = nil;
+    
+    @synchronized(self) {
+        if (!sharedExecutor) {
+            sharedExecutor = [[CoExecutor alloc] initWithWorkerCount:0];
+        }
+    }
+    
+    return sharedExecutor;
+}
+
++ (NSUInteger)currentWorkerIndex
+{
+    return currentWorkerIndex;
+}
+
+- (instancetype)init
+{
+    return [self initWithWorkerCount:0];
+}
+
+- (instancetype)initWithWorkerCount:(NSUInteger)count
+{
+    if ((self = [super init])) {
+        _workerCount = count ?: MAX([CoRuntime availableCPUs].count, 1);
+        _injected = [NSMutableArray array];
+        pthread_mutex_init(&_lock, NULL);
+        pthread_cond_init(&_wakeup, NULL);
+        
+        if (posix_memalign((void **)&_workers, 64, _workerCount * sizeof(CoWorker)) != 0) {
+            return nil;
+        }
+        
+        for (NSUInteger i = 0; i < _workerCount; i++) {
+            atomic_init(&_workers[i].top, 0);
+            atomic_init(&_workers[i].bottom, 0);
+            atomic_init(&_workers[i].array, deque_array_create(CoDequeInitialSize));
+            _workers[i].seed = (uint32_t)(i * 2654435761u) | 1;
+        }
+        
+        for (NSUInteger i = 0; i < _workerCount; i++) {
+            NSThread *thread = [[NSThread alloc] initWithTarget:self selector:@selector(runWorker:) object:@(i)];
+            thread.name = [NSString stringWithFormat:@"com.codinn.CoSocket.worker.%lu", (unsigned long)i];
+            [thread start];
+        }
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    // Workers keep the executor alive while they run, so they are gone by now
+    for (NSUInteger i = 0; i < _workerCount; i++) {
+        void *task;
+        while ((task = deque_take(&_workers[i]))) {
+            CoExecutorTask __unused dropped = (__bridge_transfer CoExecutorTask)task;
+        }
+        
+        CoDequeArray *array = atomic_load(&_workers[i].array);
+        while (array) {
+            CoDequeArray *previous = array->previous;
+            free(array);
+            array = previous;
+        }
+    }
+    
+    free(_workers);
+    pthread_cond_destroy(&_wakeup);
+    pthread_mutex_destroy(&_lock);
+}
+
+- (NSUInteger)stolenCount
+{
+    return atomic_load(&_stolen);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Submitting
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (void)submit:(CoExecutorTask)task
+{
+    if (currentExecutor == self) {
+        deque_push(currentWorker, (__bridge_retained void *)[task copy]);
+    } else {
+        pthread_mutex_lock(&_lock);
+        [_injected addObject:[task copy]];
+        atomic_fetch_add(&_injectedCount, 1);
+        pthread_mutex_unlock(&_lock);
+    }
+    
+    // Pairs with the fence in park, either the worker sees the task or we see the sleeper
+    atomic_thread_fence(memory_order_seq_cst);
+    
+    if (atomic_load(&_sleepers) > 0) {
+        pthread_mutex_lock(&_lock);
+        pthread_cond_signal(&_wakeup);
+        pthread_mutex_unlock(&_lock);
+    }
+}
+
+- (void)runHandler:(CoEventHandler)handler whenFileDescriptor:(int)fd isReadyFor:(CoEventMask)events onLoop:(CoEventLoop *)loop
+{
+    if (!loop.isCurrent) {
+        [loop post:^{
+            [self runHandler:handler whenFileDescriptor:fd isReadyFor:events onLoop:loop];
+        }];
+        return;
+    }
+    
+    CoEventHandler connectionHandler = [handler copy];
+    __weak CoEventLoop *weakLoop = loop;
+    
+    BOOL watched = [loop watchFileDescriptor:fd events:events handler:^(CoEventMask ready) {
+        // One shot, so the handler doesn't run again before it's done
+        [weakLoop unwatchFileDescriptor:fd];
+        [self submit:^{ connectionHandler(ready); }];
+    } error:NULL];
+    
+    if (!watched) {
+        // E.g. fd was closed. Run the handler anyway, its I/O fails with the actual error.
+        [self submit:^{ connectionHandler(events); }];
+    }
+}
+
+- (void)stop
+{
+    atomic_store(&_stopped, true);
+    
+    pthread_mutex_lock(&_lock);
+    pthread_cond_broadcast(&_wakeup);
+    pthread_mutex_unlock(&_lock);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Workers
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (void)runWorker:(NSNumber *)index
+{
+    CoWorker *worker = &_workers[index.unsignedIntegerValue];
+    
+    currentWorker = worker;
+    currentExecutor = self;
+    currentWorkerIndex = index.unsignedIntegerValue;
+    
+    for (;;) {
+        @autoreleasepool {
+            void *task = [self findTaskForWorker:worker];
+            
+            if (task) {
+                CoExecutorTask block = (__bridge_transfer CoExecutorTask)task;
+                block();
+                continue;
+            }
+            
+            if (atomic_load(&_stopped)) {
+                break;
+            }
+            
+            [self park];
+        }
+    }
+    
+    currentWorker = NULL;
+    currentExecutor = nil;
+    currentWorkerIndex = NSNotFound;
+}
+
+/**
+ Own deque first, then the injection queue, then the other workers' deques.
+ Returns a retained task, or NULL.
+ */
+- (void *)findTaskForWorker:(CoWorker *)worker
+{
+    void *task = deque_take(worker);
+    
+    if (task) {
+        return task;
+    }
+    
+    if (atomic_load(&_injectedCount) > 0) {
+        CoExecutorTask injected = nil;
+        
+        pthread_mutex_lock(&_lock);
+        if (_injectedHead < _injected.count) {
+            // Taking from the front of the array would move all the others, leave a hole instead
+            injected = _injected[_injectedHead];
+            _injected[_injectedHead] = [NSNull null];
+            _injectedHead++;
+            atomic_fetch_sub(&_injectedCount, 1);
+            
+            if (_injectedHead == _injected.count) {
+                [_injected removeAllObjects];
+                _injectedHead = 0;
+            } else if (_injectedHead >= 1024 && _injectedHead * 2 >= _injected.count) {
+                [_injected removeObjectsInRange:NSMakeRange(0, _injectedHead)];
+                _injectedHead = 0;
+            }
+        }
+        pthread_mutex_unlock(&_lock);
+        
+        if (injected) {
+            return (__bridge_retained void *)injected;
+        }
+    }
+    
+    // xorshift, so thieves don't all queue up on the same victim
+    worker->seed ^= worker->seed << 13;
+    worker->seed ^= worker->seed >> 17;
+    worker->seed ^= worker->seed << 5;
+    
+    NSUInteger start = worker->seed % _workerCount;
+    
+    for (NSUInteger i = 0; i < _workerCount; i++) {
+        CoWorker *victim = &_workers[(start + i) % _workerCount];
+        
+        if (victim == worker) {
+            continue;
+        }
+        
+        if ((task = deque_steal(victim))) {
+            atomic_fetch_add(&_stolen, 1);
+            return task;
+        }
+    }
+    
+    return NULL;
+}
+
+- (BOOL)hasWork
+{
+    if (atomic_load(&_injectedCount) > 0) {
+        return YES;
+    }
+    
+    for (NSUInteger i = 0; i < _workerCount; i++) {
+        if (!deque_is_empty(&_workers[i])) {
+            return YES;
+        }
+    }
+    
+    return NO;
+}
+
+- (void)park
+{
+    pthread_mutex_lock(&_lock);
+    atomic_fetch_add(&_sleepers, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    
+    if (![self hasWork] && !atomic_load(&_stopped)) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long)(CoWorkerParkTimeout * 1e9);
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        
+        pthread_cond_timedwait(&_wakeup, &_lock, &deadline);
+    }
+    
+    atomic_fetch_sub(&_sleepers, 1);
+    pthread_mutex_unlock(&_lock);
+}
+
+@end
@@ -0,0 +1,109 @@
+//
+//  CoOperationContext.h
+//  Copyright (c) 2014 Yang Yubo <yang@codinn.com>
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+//
+
+#import <Foundation/Foundation.h>
+
+typedef void (^ CoCancellationHandler)(void);
+
+/**
+ * The budget of a whole request, e.g. resolve + connect + write + read the response, rather than of a single call.
+ *
+ * A context carries an absolute deadline, a cancellation token and a trace tag. While a context is set on
+ * a CoSocket, every connect, read and write waits no longer than the context's deadline, on top of its own timeout,
+ * and fails with ETIMEDOUT once the deadline has passed. Cancelling the context shuts the connection down, waking up
+ * blocked and asynchronous operations, which then fail with ECANCELED.
+ *
+ * A context may be shared by several sockets, e.g. one per backend a request fans out to.
+ * All methods are thread safe.
+ **/
+@interface CoOperationContext : NSObject
+
+/**
+ * Creates a context whose deadline is timeout seconds from now. To not time out use a negative time interval.
+ **/
++ (instancetype)contextWithTimeout:(NSTimeInterval)timeout;
+
++ (instancetype)contextWithTimeout:(NSTimeInterval)timeout traceTag:(NSString *)traceTag;
+
+/**
+ * @param deadline A time on the clock of +[CoTimingWheel now], zero for no deadline.
+ * @param parent   Optional. The context is cancelled with its parent, and never outlives the parent's deadline.
+ * @param traceTag Optional. Added to the userInfo of errors, so they can be told apart per request.
+ *                 Inherited from the parent if nil.
+ **/
+- (instancetype)initWithDeadline:(NSTimeInterval)deadline parent:(CoOperationContext *)parent traceTag:(NSString *)traceTag;
+
+/**
+ * Returns a context for part of this one, e.g. for the connect of a request, with a budget of its own.
+ * It ends with timeout or with this context, whichever comes first.
+ **/
+- (CoOperationContext *)childContextWithTimeout:(NSTimeInterval)timeout;
+
+/**
+ * Absolute deadline on the clock of +[CoTimingWheel now], zero for none.
+ **/
+@property (atomic, readonly) NSTimeInterval deadline;
+
+/**
+ * Time left until the deadline, zero once it has passed, or negative if there is no deadline.
+ **/
+@property (atomic, readonly) NSTimeInterval remainingTime;
+
+@property (atomic, readonly, getter=isExpired) BOOL expired;
+
+@property (atomic, readonly, copy) NSString *traceTag;
+
+#pragma mark Cancellation
+
+/**
+ * Cancels the context and its children, running the cancellation handlers once.
+ **/
+- (void)cancel;
+
+@property (atomic, readonly, getter=isCancelled) BOOL cancelled;
+
+/**
+ * Runs handler on the thread that cancels the context, or right away if it is cancelled already.
+ *
+ * @return A token for removeCancellationHandler:.
+ **/
+- (id)addCancellationHandler:(CoCancellationHandler)handler;
+
+- (void)removeCancellationHandler:(id)token;
+
+/**
+ * Returns the earlier of the context's deadline and the one of a timeout starting now, zero for none.
+ **/
+- (NSTimeInterval)deadlineWithTimeout:(NSTimeInterval)timeout;
+
+/**
+ * The error an operation fails with once the context is cancelled or expired, or nil if it is neither.
+ **/
+- (NSError *)error;
+
+@end
+
+/**
+ * The key of the trace tag in the userInfo of errors.
+ **/
+extern NSString *const CoOperationTraceTagKey;
@@ -0,0 +1,189 @@
+//
+//  CoOperationContext.m
+//  Copyright (c) 2014 Yang Yubo <yang@codinn.com>
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+//
+
+#import "CoOperationContext.h"
+#import "CoTimingWheel.h"
+#import <errno.h>
+#import <string.h>
+
+NSString *const CoOperationTraceTagKey = @"CoOperationTraceTag";
+
+@implementation CoOperationContext {
+    NSMutableArray *_handlers;  // Handler tokens, nil once cancelled
+    id _parentToken;
+    __weak CoOperationContext *_parent;
+}
+
++ (instancetype)contextWithTimeout:(NSTimeInterval)timeout
+{
+    return [self contextWithTimeout:timeout traceTag:nil];
+}
+
++ (instancetype)contextWithTimeout:(NSTimeInterval)timeout traceTag:(NSString *)traceTag
+{
+    NSTimeInterval deadline = timeout > 0 ? [CoTimingWheel now] + timeout : 0;
+    
+    return [[self alloc] initWithDeadline:deadline parent:nil traceTag:traceTag];
+}
+
+- (instancetype)init
+{
+    return [self initWithDeadline:0 parent:nil traceTag:nil];
+}
+
+- (instancetype)initWithDeadline:(NSTimeInterval)deadline parent:(CoOperationContext *)parent traceTag:(NSString *)traceTag
+{
+    if ((self = [super init])) {
+        if (parent.deadline > 0 && (deadline <= 0 || parent.deadline < deadline)) {
+            deadline = parent.deadline;
+        }
+        
+        _deadline = deadline;
+        _traceTag = [traceTag ?: parent.traceTag copy];
+        _handlers = [NSMutableArray array];
+        
+        if (parent) {
+            // The parent holds the child weakly, a request's contexts go away with the request
+            __weak CoOperationContext *weakSelf = self;
+            _parent = parent;
+            _parentToken = [parent addCancellationHandler:^{
+                [weakSelf cancel];
+            }];
+        }
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [_parent removeCancellationHandler:_parentToken];
+}
+
+- (CoOperationContext *)childContextWithTimeout:(NSTimeInterval)timeout
+{
+    NSTimeInterval deadline = timeout > 0 ? [CoTimingWheel now] + timeout : 0;
+    
+    return [[CoOperationContext alloc] initWithDeadline:deadline parent:self traceTag:nil];
+}
+
+- (NSTimeInterval)remainingTime
+{
+    if (_deadline <= 0) {
+        return -1;
+    }
+    
+    return MAX(_deadline - [CoTimingWheel now], 0);
+}
+
+- (BOOL)isExpired
+{
+    return _deadline > 0 && [CoTimingWheel now] >= _deadline;
+}
+
+- (NSTimeInterval)deadlineWithTimeout:(NSTimeInterval)timeout
+{
+    NSTimeInterval deadline = timeout > 0 ? [CoTimingWheel now] + timeout : 0;
+    
+    if (_deadline > 0 && (deadline == 0 || _deadline < deadline)) {
+        return _deadline;
+    }
+    
+    return deadline;
+}
+
+#pragma mark Cancellation
+
+- (BOOL)isCancelled
+{
+    @synchronized(self) {
+        return _handlers == nil;
+    }
+}
+
+- (void)cancel
+{
+    NSArray *handlers;
+    
+    @synchronized(self) {
+        handlers = _handlers;
+        _handlers = nil;
+    }
+    
+    // Outside the lock, handlers may well look at the context
+    for (NSArray *token in handlers) {
+        CoCancellationHandler handler = token.firstObject;
+        handler();
+    }
+}
+
+- (id)addCancellationHandler:(CoCancellationHandler)handler
+{
+    // The token is a fresh array, so it is removed by identity
+    NSArray *token = @[ [handler copy] ];
+    
+    @synchronized(self) {
+        if (_handlers) {
+            [_handlers addObject:token];
+            return token;
+        }
+    }
+    
+    handler();
+    return token;
+}
+
+- (void)removeCancellationHandler:(id)token
+{
+    if (!token) {
+        return;
+    }
+    
+    @synchronized(self) {
+        [_handlers removeObjectIdenticalTo:token];
+    }
+}
+
+- (NSError *)error
+{
+    NSString *reason;
+    int code;
+    
+    if (self.isCancelled) {
+        code = ECANCELED;
+        reason = @"The operation context was cancelled";
+    } else if (self.isExpired) {
+        code = ETIMEDOUT;
+        reason = @"The operation context ran out of time";
+    } else {
+        return nil;
+    }
+    
+    NSMutableDictionary *userInfo = [NSMutableDictionary dictionary];
+    userInfo[NSLocalizedDescriptionKey] = [NSString stringWithUTF8String:strerror(code)];
+    userInfo[NSLocalizedFailureReasonErrorKey] = reason;
+    userInfo[CoOperationTraceTagKey] = _traceTag;
+    
+    return [NSError errorWithDomain:NSPOSIXErrorDomain code:code userInfo:userInfo];
+}
+
+@end
@@ -0,0 +1,72 @@
+//
+//  CoPattern.h
+//  Copyright (c) 2014 Yang Yubo <yang@codinn.com>
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+//
+
+#import <Foundation/Foundation.h>
+
+/**
+ * A regular expression compiled into a DFA, for finding prompts and other delimiters in a socket stream
+ * with readDataToPattern:maxLength:error:.
+ *
+ * The DFA runs over the received bytes once, one table lookup per byte, and keeps its state while waiting
+ * for more data, so nothing is ever scanned twice. A read ends where the first match ends.
+ *
+ * The syntax is a subset of NSRegularExpression, matched against bytes:
+ *   literals, .  (any byte but \n), [abc] [^a-z], \d \D \s \S \w \W \n \r \t \xHH, escaped metacharacters,
+ *   * + ? (greedy or not makes no difference, the shortest match wins), | and ( ) or (?: ).
+ *   $ matches the end of the data received so far, so "\$ $|# $" waits for a prompt nothing has followed yet.
+ *   Where the data received so far ends depends on how the peer's output was split into packets: "$ " in the
+ *   middle of the output matches too if a packet happens to end right after it. Use $ only for text that
+ *   can't appear before the end, or anchor it with what comes before, e.g. "~\$ $".
+ * Non-ASCII characters match as their UTF-8 bytes; put them in a group to repeat them.
+ * Backreferences, lookaround, ^, \b and counted repetition are not supported.
+ *
+ * Patterns are immutable and can be shared between threads and sockets.
+ **/
+@interface CoPattern : NSObject
+
++ (instancetype)patternWithString:(NSString *)pattern error:(NSError **)errPtr;
+
+/**
+ * Compiles the pattern. Fails with EINVAL for a syntax error, a pattern that matches the empty string,
+ * or one whose DFA would be too large (more than 2048 states).
+ **/
+- (instancetype)initWithString:(NSString *)pattern error:(NSError **)errPtr;
+
+@property (atomic, readonly, copy) NSString *pattern;
+
+@property (atomic, readonly) NSUInteger stateCount;
+
+/**
+ * The state to start matching from.
+ **/
+@property (atomic, readonly) NSUInteger initialState;
+
+/**
+ * Runs the DFA over bytes from *state, and leaves the state it ends up in there.
+ *
+ * @param atEnd Whether bytes end at the end of the data received so far, for $.
+ * @return The length of bytes up to and including the end of the first match, or NSNotFound.
+ **/
+- (NSUInteger)matchBytes:(const void *)bytes length:(NSUInteger)length atEnd:(BOOL)atEnd state:(NSUInteger *)state;
+
+@end
@@ -0,0 +1,600 @@
+//
+//  CoPattern.m
+//  Copyright (c) 2014 Yang Yubo <yang@codinn.com>
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+//
+
+#import "CoPattern.h"
+#import <errno.h>
+#import <stdlib.h>
+#import <string.h>
+
+#define CoPatternMaxStates 2048     // DFA states, the table takes 512 bytes each
+#define CoPatternMaxNFAStates 4096
+
+typedef NS_ENUM(uint8_t, CoNFAKind) {
+    CoNFAEpsilon,   // Goes on to out, and to out1 too if it is a split
+    CoNFABytes,     // Takes a byte in set, then goes on to out
+    CoNFAEnd,       // $, goes on to out only at the end of the data
+    CoNFAAccept,
+};
+
+typedef struct {
+    CoNFAKind kind;
+    int out;
+    int out1;
+    uint64_t set[4];
+} CoNFAState;
+
+/**
+ A piece of the NFA under construction. Its end is an epsilon state whose out is still open.
+ */
+typedef struct {
+    int start;
+    int end;
+} CoNFAFragment;
+
+typedef struct {
+    CoNFAState *states;
+    int count;
+    int capacity;
+    const uint8_t *cursor;  // Parser position in the pattern
+    const uint8_t *limit;
+    const char *error;      // First syntax error, parsing stops there
+} CoNFA;
+
+enum {
+    CoPatternAccept = 1,
+    CoPatternAcceptAtEnd = 2,
+};
+
+#pragma mark NFA
+
+static int nfa_add(CoNFA *nfa, CoNFAKind kind, int out, int out1)
+{
+    if (nfa->count >= CoPatternMaxNFAStates) {
+        nfa->error = nfa->error ?: "Pattern is too long";
+        return 0;
+    }
+    
+    if (nfa->count == nfa->capacity) {
+        nfa->capacity = nfa->capacity ? nfa->capacity * 2 : 64;
+        nfa->states = realloc(nfa->states, sizeof(CoNFAState) * nfa->capacity);
+    }
+    
+    CoNFAState *state = &nfa->states[nfa->count];
+    memset(state, 0, sizeof(*state));
+    state->kind = kind;
+    state->out = out;
+    state->out1 = out1;
+    
+    return nfa->count++;
+}
+
+static CoNFAFragment nfa_empty(CoNFA *nfa)
+{
+    int state = nfa_add(nfa, CoNFAEpsilon, -1, -1);
+    return (CoNFAFragment){ state, state };
+}
+
+static CoNFAFragment nfa_step(CoNFA *nfa, CoNFAKind kind, const uint64_t set[4])
+{
+    int end = nfa_add(nfa, CoNFAEpsilon, -1, -1);
+    int start = nfa_add(nfa, kind, end, -1);
+    
+    if (set) {
+        memcpy(nfa->states[start].set, set, sizeof(nfa->states[start].set));
+    }
+    
+    return (CoNFAFragment){ start, end };
+}
+
+static CoNFAFragment nfa_concat(CoNFA *nfa, CoNFAFragment a, CoNFAFragment b)
+{
+    nfa->states[a.end].out = b.start;
+    return (CoNFAFragment){ a.start, b.end };
+}
+
+static CoNFAFragment nfa_alternate(CoNFA *nfa, CoNFAFragment a, CoNFAFragment b)
+{
+    int end = nfa_add(nfa, CoNFAEpsilon, -1, -1);
+    int start = nfa_add(nfa, CoNFAEpsilon, a.start, b.start);
+    nfa->states[a.end].out = end;
+    nfa->states[b.end].out = end;
+    return (CoNFAFragment){ start, end };
+}
+
+/**
+ Applies *, + or ? to the fragment.
+ */
+static CoNFAFragment nfa_repeat(CoNFA *nfa, CoNFAFragment a, uint8_t quantifier)
+{
+    int end = nfa_add(nfa, CoNFAEpsilon, -1, -1);
+    int split = nfa_add(nfa, CoNFAEpsilon, a.start, end);
+    
+    switch (quantifier) {
+        case '*':
+            nfa->states[a.end].out = split;
+            return (CoNFAFragment){ split, end };
+        case '+':
+            nfa->states[a.end].out = split;
+            return (CoNFAFragment){ a.start, end };
+        default:    // ?
+            nfa->states[a.end].out = end;
+            return (CoNFAFragment){ split, end };
+    }
+}
+
+#pragma mark Parsing
+
+static void set_add_range(uint64_t set[4], uint8_t from, uint8_t to)
+{
+    for (int byte = from; byte <= to; byte++) {
+        set[byte >> 6] |= 1ULL << (byte & 63);
+    }
+}
+
+static void set_add_class(uint64_t set[4], uint8_t class)
+{
+    uint64_t members[4] = { 0 };
+    
+    switch (class | 0x20) {     // Lower case
+        case 'd':
+            set_add_range(members, '0', '9');
+            break;
+        case 's':
+            set_add_range(members, '\t', '\r');
+            set_add_range(members, ' ', ' ');
+            break;
+        default:    // w
+            set_add_range(members, '0', '9');
+            set_add_range(members, 'A', 'Z');
+            set_add_range(members, 'a', 'z');
+            set_add_range(members, '_', '_');
+            break;
+    }
+    
+    BOOL negated = (class >= 'A' && class <= 'Z');
+    
+    for (int i = 0; i < 4; i++) {
+        set[i] |= negated ? ~members[i] : members[i];
+    }
+}
+
+static int hex_value(uint8_t c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/**
+ Parses the escape after a backslash into set. Returns the byte if it stands for a single one, or -1.
+ */
+static int parse_escape(CoNFA *nfa, uint64_t set[4])
+{
+    if (nfa->cursor == nfa->limit) {
+        nfa->error = "Trailing backslash";
+        return -1;
+    }
+    
+    uint8_t c = *nfa->cursor++;
+    int byte = c;
+    
+    switch (c) {
+        case 'd': case 'D': case 's': case 'S': case 'w': case 'W':
+            set_add_class(set, c);
+            return -1;
+        case 'n': byte = '\n'; break;
+        case 'r': byte = '\r'; break;
+        case 't': byte = '\t'; break;
+        case 'f': byte = '\f'; break;
+        case 'v': byte = '\v'; break;
+        case 'e': byte = 0x1B; break;
+        case '0': byte = 0; break;
+        case 'x': {
+            int high = nfa->limit - nfa->cursor >= 2 ? hex_value(nfa->cursor[0]) : -1;
+            int low = high >= 0 ? hex_value(nfa->cursor[1]) : -1;
+            
+            if (low < 0) {
+                nfa->error = "\\x must be followed by two hex digits";
+                return -1;
+            }
+            
+            nfa->cursor += 2;
+            byte = (high << 4) | low;
+            break;
+        }
+        default:
+            if ((c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z')) {
+                nfa->error = "Unsupported escape sequence";
+                return -1;
+            }
+            break;
+    }
+    
+    set_add_range(set, byte, byte);
+    return byte;
+}
+
+static CoNFAFragment parse_class(CoNFA *nfa)
+{
+    uint64_t set[4] = { 0 };
+    BOOL negated = NO;
+    BOOL first = YES;
+    
+    if (nfa->cursor < nfa->limit && *nfa->cursor == '^') {
+        negated = YES;
+        nfa->cursor++;
+    }
+    
+    for (;;) {
+        if (nfa->cursor == nfa->limit) {
+            nfa->error = "Missing ]";
+            return nfa_empty(nfa);
+        }
+        
+        uint8_t c = *nfa->cursor++;
+        
+        if (c == ']' && !first) {
+            break;
+        }
+        
+        first = NO;
+        
+        int from = c;
+        
+        if (c == '\\') {
+            from = parse_escape(nfa, set);
+            
+            if (nfa->error) {
+                return nfa_empty(nfa);
+            }
+            
+            if (from < 0) {     // A class like \d, can't start a range
+                continue;
+            }
+        } else {
+            set_add_range(set, c, c);
+        }
+        
+        if (nfa->limit - nfa->cursor >= 2 && nfa->cursor[0] == '-' && nfa->cursor[1] != ']') {
+            uint8_t to = nfa->cursor[1];
+            nfa->cursor += 2;
+            
+            if (to == '\\') {
+                uint64_t ignored[4] = { 0 };
+                int escaped = parse_escape(nfa, ignored);
+                
+                if (escaped < 0) {
+                    nfa->error = nfa->error ?: "Invalid range in character class";
+                    return nfa_empty(nfa);
+                }
+                
+                to = escaped;
+            }
+            
+            if (to < from) {
+                nfa->error = "Invalid range in character class";
+                return nfa_empty(nfa);
+            }
+            
+            set_add_range(set, from, to);
+        }
+    }
+    
+    if (negated) {
+        for (int i = 0; i < 4; i++) {
+            set[i] = ~set[i];
+        }
+    }
+    
+    return nfa_step(nfa, CoNFABytes, set);
+}
+
+static CoNFAFragment parse_alternation(CoNFA *nfa);
+
+static CoNFAFragment parse_atom(CoNFA *nfa)
+{
+    uint8_t c = *nfa->cursor++;
+    uint64_t set[4] = { 0 };
+    
+    switch (c) {
+        case '(': {
+            if (nfa->limit - nfa->cursor >= 2 && nfa->cursor[0] == '?' && nfa->cursor[1] == ':') {
+                nfa->cursor += 2;
+            }
+            
+            CoNFAFragment group = parse_alternation(nfa);
+            
+            if (nfa->cursor == nfa->limit || *nfa->cursor != ')') {
+                nfa->error = nfa->error ?: "Missing )";
+                return group;
+            }
+            
+            nfa->cursor++;
+            return group;
+        }
+        case '[':
+            return parse_class(nfa);
+        case '.':
+            set_add_range(set, 0, 255);
+            set['\n' >> 6] &= ~(1ULL << ('\n' & 63));
+            return nfa_step(nfa, CoNFABytes, set);
+        case '\\':
+            parse_escape(nfa, set);
+            return nfa_step(nfa, CoNFABytes, set);
+        case '$':
+            return nfa_step(nfa, CoNFAEnd, NULL);
+        case '*': case '+': case '?':
+            nfa->error = "Nothing to repeat";
+            return nfa_empty(nfa);
+        case '^': case '{':
+            nfa->error = "^ and counted repetition are not supported";
+            return nfa_empty(nfa);
+        default:
+            set_add_range(set, c, c);
+            return nfa_step(nfa, CoNFABytes, set);
+    }
+}
+
+static CoNFAFragment parse_concatenation(CoNFA *nfa)
+{
+    CoNFAFragment fragment = nfa_empty(nfa);
+    
+    while (!nfa->error && nfa->cursor < nfa->limit && *nfa->cursor != '|' && *nfa->cursor != ')') {
+        CoNFAFragment atom = parse_atom(nfa);
+        
+        while (!nfa->error && nfa->cursor < nfa->limit
+               && (*nfa->cursor == '*' || *nfa->cursor == '+' || *nfa->cursor == '?')) {
+            atom = nfa_repeat(nfa, atom, *nfa->cursor++);
+        }
+        
+        fragment = nfa_concat(nfa, fragment, atom);
+    }
+    
+    return fragment;
+}
+
+static CoNFAFragment parse_alternation(CoNFA *nfa)
+{
+    CoNFAFragment fragment = parse_concatenation(nfa);
+    
+    while (!nfa->error && nfa->cursor < nfa->limit && *nfa->cursor == '|') {
+        nfa->cursor++;
+        fragment = nfa_alternate(nfa, fragment, parse_concatenation(nfa));
+    }
+    
+    return fragment;
+}
+
+#pragma mark DFA
+
+/**
+ Adds every state reachable from the set without taking a byte. $ is only crossed if crossEnd.
+ */
+static void nfa_closure(const CoNFA *nfa, uint64_t *set, BOOL crossEnd, int *stack)
+{
+    int depth = 0;
+    
+    for (int state = 0; state < nfa->count; state++) {
+        if (set[state >> 6] & (1ULL << (state & 63))) {
+            stack[depth++] = state;
+        }
+    }
+    
+    while (depth > 0) {
+        const CoNFAState *state = &nfa->states[stack[--depth]];
+        int next[2] = { -1, -1 };
+        
+        if (state->kind == CoNFAEpsilon) {
+            next[0] = state->out;
+            next[1] = state->out1;
+        } else if (state->kind == CoNFAEnd && crossEnd) {
+            next[0] = state->out;
+        }
+        
+        for (int i = 0; i < 2; i++) {
+            if (next[i] >= 0 && !(set[next[i] >> 6] & (1ULL << (next[i] & 63)))) {
+                set[next[i] >> 6] |= 1ULL << (next[i] & 63);
+                stack[depth++] = next[i];
+            }
+        }
+    }
+}
+
+@implementation CoPattern {
+    NSData *_table;     // uint16_t next state, 256 per state
+    NSData *_flags;     // uint8_t CoPatternAccept... per state
+}
+
++ (instancetype)patternWithString:(NSString *)pattern error:(NSError **)errPtr
+{
+    return [[self alloc] initWithString:pattern error:errPtr];
+}
+
+- (instancetype)initWithString:(NSString *)pattern error:(NSError **)errPtr
+{
+    if ((self = [super init])) {
+        _pattern = [pattern copy];
+        
+        NSData *utf8 = [_pattern dataUsingEncoding:NSUTF8StringEncoding];
+        CoNFA nfa = { 0 };
+        nfa.cursor = utf8.bytes;
+        nfa.limit = nfa.cursor + utf8.length;
+        
+        CoNFAFragment fragment = parse_alternation(&nfa);
+        
+        if (!nfa.error && nfa.cursor < nfa.limit) {
+            nfa.error = "Unmatched )";
+        }
+        
+        const char *error = nfa.error;
+        
+        if (!error) {
+            int accept = nfa_add(&nfa, CoNFAAccept, -1, -1);
+            nfa.states[fragment.end].out = accept;
+            error = nfa.error ?: [self buildFromNFA:&nfa start:fragment.start accept:accept];
+        }
+        
+        free(nfa.states);
+        
+        if (error) {
+            NSDictionary *userInfo = @{
+                                       NSLocalizedDescriptionKey : [NSString stringWithUTF8String:strerror(EINVAL)],
+                                       NSLocalizedFailureReasonErrorKey : [NSString stringWithFormat:@"%s at offset %ld of pattern %@",
+                                                                           error, (long)(nfa.cursor - (const uint8_t *)utf8.bytes), _pattern],
+                                       };
+            if (errPtr) *errPtr = [NSError errorWithDomain:NSPOSIXErrorDomain code:EINVAL userInfo:userInfo];
+            return nil;
+        }
+    }
+    return self;
+}
+
+/**
+ Subset construction. The DFA searches: every step may start a new match, so the NFA's start state
+ is added to every DFA state.
+ 
+ @return An error message, or NULL.
+ */
+- (const char *)buildFromNFA:(CoNFA *)nfa start:(int)start accept:(int)accept
+{
+    size_t words = (nfa->count + 63) / 64;
+    size_t setSize = words * sizeof(uint64_t);
+    int *stack = malloc(sizeof(int) * nfa->count);
+    uint64_t *next = malloc(setSize);
+    
+    NSMutableDictionary *indexes = [NSMutableDictionary dictionary];
+    NSMutableArray *sets = [NSMutableArray array];
+    NSMutableData *table = [NSMutableData data];
+    NSMutableData *flags = [NSMutableData data];
+    const char *error = NULL;
+    
+    // Adds the state for next unless there is one, returns its index or -1 if there are too many
+    int (^ lookup)(void) = ^int {
+        NSData *key = [NSData dataWithBytes:next length:setSize];
+        NSNumber *index = indexes[key];
+        
+        if (index) {
+            return index.intValue;
+        }
+        
+        if (sets.count >= CoPatternMaxStates) {
+            return -1;
+        }
+        
+        uint8_t flag = (next[accept >> 6] & (1ULL << (accept & 63))) ? CoPatternAccept : 0;
+        
+        uint64_t *atEnd = malloc(setSize);
+        memcpy(atEnd, next, setSize);
+        nfa_closure(nfa, atEnd, YES, stack);
+        
+        if (atEnd[accept >> 6] & (1ULL << (accept & 63))) {
+            flag |= CoPatternAcceptAtEnd;
+        }
+        
+        free(atEnd);
+        
+        int added = (int)sets.count;
+        indexes[key] = @(added);
+        [sets addObject:key];
+        [flags appendBytes:&flag length:1];
+        [table increaseLengthBy:256 * sizeof(uint16_t)];
+        return added;
+    };
+    
+    memset(next, 0, setSize);
+    next[start >> 6] |= 1ULL << (start & 63);
+    nfa_closure(nfa, next, NO, stack);
+    lookup();
+    
+    if (((const uint8_t *)flags.bytes)[0] != 0) {
+        error = "Pattern matches the empty string";
+    }
+    
+    for (NSUInteger index = 0; !error && index < sets.count; index++) {
+        // A read ends at the first match, nothing follows an accepting state
+        if (((const uint8_t *)flags.bytes)[index] & CoPatternAccept) {
+            continue;
+        }
+        
+        const uint64_t *current = [sets[index] bytes];
+        
+        for (int byte = 0; byte < 256 && !error; byte++) {
+            memset(next, 0, setSize);
+            next[start >> 6] |= 1ULL << (start & 63);
+            
+            for (int state = 0; state < nfa->count; state++) {
+                const CoNFAState *nfaState = &nfa->states[state];
+                
+                if ((current[state >> 6] & (1ULL << (state & 63)))
+                    && nfaState->kind == CoNFABytes
+                    && (nfaState->set[byte >> 6] & (1ULL << (byte & 63)))) {
+                    next[nfaState->out >> 6] |= 1ULL << (nfaState->out & 63);
+                }
+            }
+            
+            nfa_closure(nfa, next, NO, stack);
+            int target = lookup();
+            
+            if (target < 0) {
+                error = "Pattern needs too many DFA states";
+                break;
+            }
+            
+            ((uint16_t *)table.mutableBytes)[index * 256 + byte] = (uint16_t)target;
+        }
+    }
+    
+    free(stack);
+    free(next);
+    
+    _table = table;
+    _flags = flags;
+    _stateCount = sets.count;
+    _initialState = 0;
+    
+    return error;
+}
+
+- (NSUInteger)matchBytes:(const void *)bytes length:(NSUInteger)length atEnd:(BOOL)atEnd state:(NSUInteger *)statePtr
+{
+    const uint8_t *input = bytes;
+    const uint16_t *table = _table.bytes;
+    const uint8_t *flags = _flags.bytes;
+    NSUInteger state = *statePtr;
+    
+    for (NSUInteger i = 0; i < length; i++) {
+        state = table[(state << 8) | input[i]];
+        
+        if (flags[state] & CoPatternAccept) {
+            *statePtr = state;
+            return i + 1;
+        }
+    }
+    
+    *statePtr = state;
+    
+    return (atEnd && (flags[state] & CoPatternAcceptAtEnd)) ? length : NSNotFound;
+}
+
+@end
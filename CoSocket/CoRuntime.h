@@ -0,0 +1,73 @@
+//
+//  CoRuntime.h
+//  Copyright (c) 2014 Yang Yubo <yang@codinn.com>
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+//
+
+#import <Foundation/Foundation.h>
+#import "CoEventLoop.h"
+
+/**
+ * A thread-per-core runtime: one CoEventLoop per CPU, each on a thread pinned to its CPU.
+ *
+ * A connection is placed on one loop and stays there, together with its buffers and timers,
+ * so serving it never bounces cache lines between cores or contends on a lock. Loops only
+ * exchange work by posting blocks to each other.
+ **/
+@interface CoRuntime : NSObject
+
+/**
+ * Returns a started runtime with one pinned loop per CPU the process may run on.
+ **/
++ (CoRuntime *)sharedRuntime;
+
+/**
+ * Creates and starts a runtime.
+ *
+ * @param count  The number of loops, zero for one per CPU the process may run on.
+ * @param pinned Whether to pin loop i to the i-th of those CPUs (sched_setaffinity on Linux,
+ *               an affinity tag hint on Darwin).
+ **/
+- (instancetype)initWithLoopCount:(NSUInteger)count pinned:(BOOL)pinned;
+
+@property (atomic, readonly) NSArray *loops;
+
+/**
+ * Returns the loops in turn, for spreading new connections.
+ **/
+- (CoEventLoop *)nextLoop;
+
+/**
+ * Returns the calling thread's loop if it belongs to this runtime, so work stays on its core,
+ * or else nextLoop.
+ **/
+- (CoEventLoop *)preferredLoop;
+
+/**
+ * Stops all loops.
+ **/
+- (void)stop;
+
+/**
+ * Returns the CPUs the process may run on, in ascending order.
+ **/
++ (NSArray *)availableCPUs;
+
+@end
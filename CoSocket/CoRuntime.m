@@ -0,0 +1,136 @@
+//
+//  CoRuntime.m
+//  Copyright (c) 2014 Yang Yubo <yang@codinn.com>
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+//
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE     // CPU_ISSET and friends
+#endif
+
+#import "CoRuntime.h"
+#import <sched.h>
+#import <stdatomic.h>
+#import <unistd.h>
+
+@implementation CoRuntime {
+    _Atomic(NSUInteger) _nextLoop;
+}
+
++ (CoRuntime *)sharedRuntime
+{
+    static CoRuntime *sharedRuntime = nil;
+    
+    @synchronized(self) {
+        if (!sharedRuntime) {
+            sharedRuntime = [[CoRuntime alloc] initWithLoopCount:0 pinned:YES];
+        }
+    }
+    
+    return sharedRuntime;
+}
+
++ (NSArray *)availableCPUs
+{
+    NSMutableArray *cpus = [NSMutableArray array];
+    
+#if defined(__linux__)
+    // Honours taskset and cgroup cpusets, unlike the number of online CPUs
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &set)) [cpus addObject:@(cpu)];
+        }
+    }
+#endif
+    
+    if (cpus.count == 0) {
+        long count = sysconf(_SC_NPROCESSORS_ONLN);
+        
+        for (int cpu = 0; cpu < MAX(count, 1); cpu++) {
+            [cpus addObject:@(cpu)];
+        }
+    }
+    
+    return cpus;
+}
+
+- (instancetype)init
+{
+    return [self initWithLoopCount:0 pinned:YES];
+}
+
+- (instancetype)initWithLoopCount:(NSUInteger)count pinned:(BOOL)pinned
+{
+    if ((self = [super init])) {
+        NSArray *cpus = [self.class availableCPUs];
+        
+        if (count == 0) {
+            count = cpus.count;
+        }
+        
+        NSMutableArray *loops = [NSMutableArray arrayWithCapacity:count];
+        
+        for (NSUInteger i = 0; i < count; i++) {
+            // More loops than CPUs share them round robin
+            int cpu = pinned ? [cpus[i % cpus.count] intValue] : -1;
+            NSString *name = [NSString stringWithFormat:@"com.codinn.CoSocket.loop.%lu", (unsigned long)i];
+            
+            CoEventLoop *loop = [[CoEventLoop alloc] initWithName:name cpu:cpu];
+            
+            if (!loop) {
+                return nil;
+            }
+            
+            [loops addObject:loop];
+        }
+        
+        _loops = [loops copy];
+        [_loops makeObjectsPerformSelector:@selector(start)];
+    }
+    return self;
+}
+
+- (CoEventLoop *)nextLoop
+{
+    NSUInteger index = atomic_fetch_add(&_nextLoop, 1);
+    
+    return _loops[index % _loops.count];
+}
+
+- (CoEventLoop *)preferredLoop
+{
+    CoEventLoop *current = [CoEventLoop currentLoop];
+    
+    if (current && [_loops indexOfObjectIdenticalTo:current] != NSNotFound) {
+        return current;
+    }
+    
+    return [self nextLoop];
+}
+
+- (void)stop
+{
+    [_loops makeObjectsPerformSelector:@selector(stop)];
+}
+
+@end
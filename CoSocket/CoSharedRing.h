@@ -0,0 +1,114 @@
+//
+//  CoSharedRing.h
+//  Copyright (c) 2014 Yang Yubo <yang@codinn.com>
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+//
+
+#import <Foundation/Foundation.h>
+#import <sys/uio.h>
+
+// The memfd and the data and room eventfds of either side
+#define CoSharedRingDescriptorCount 5
+
+/**
+ * Two lock-free single-producer single-consumer byte rings in shared memory, one per direction,
+ * between two processes on the same host. Linux only, it's built on memfd and eventfd.
+ *
+ * One side creates the memory and hands its descriptors to the other, CoSocket does that over
+ * a unix domain connection, see -[CoSocket offerSharedMemoryWithCapacity:error:].
+ * Sending and receiving copy into and out of the mapping without a system call. Only a side that has
+ * to wait, for data or for room, sets a flag in the ring, and the other side then signals its eventfd.
+ *
+ * The connection the ring was negotiated over stays open as its liveness anchor: when it hangs up,
+ * waiting sides wake up and the stream ends after what was sent before.
+ *
+ * One thread may send while another receives, as CoSocket's write and read locks ensure.
+ * close is thread safe.
+ **/
+@interface CoSharedRing : NSObject
+
+/**
+ * Creates the shared memory, with capacity bytes per direction, rounded up to a power of two.
+ * Returns nil with errno set, ENOTSUP where memfd or eventfd are missing.
+ **/
+- (instancetype)initWithCapacity:(size_t)capacity anchorSocketFD:(int)socketFD;
+
+/**
+ * Maps the memory the other side created, from the descriptors of its getPeerDescriptors:.
+ * Takes over the descriptors, also on failure. Returns nil with errno set, EINVAL for a malformed mapping.
+ **/
+- (instancetype)initWithPeerDescriptors:(const int *)descriptors anchorSocketFD:(int)socketFD;
+
+/**
+ * The CoSharedRingDescriptorCount descriptors to pass to the peer. They stay owned by the ring.
+ **/
+- (void)getPeerDescriptors:(int *)descriptors;
+
+@property (nonatomic, readonly) size_t capacity;
+
+/**
+ * Copies up to length received bytes out of the ring.
+ *
+ * @return The number of bytes, 0 once the peer has stopped sending and everything sent was received,
+ *         or -1 with errno set: EAGAIN if the ring is empty, EBADF after close.
+ **/
+- (ssize_t)receive:(void *)bytes length:(size_t)length;
+
+/**
+ * Copies as much of the vector into the ring as fits.
+ *
+ * @return The number of bytes, or -1 with errno set: EAGAIN if the ring is full, EPIPE once the peer
+ *         doesn't receive any more, EBADF after shutdownSending or close.
+ **/
+- (ssize_t)sendIOVec:(const struct iovec *)iov count:(int)count;
+
+/**
+ * Waits until receive: (POLLIN) or sendIOVec:count: (POLLOUT) won't fail with EAGAIN, or the deadline
+ * on the clock of +[CoTimingWheel now] passes (zero waits forever). socketFD is the anchor.
+ *
+ * @return 1 if ready, 0 on timeout, -1 on error with errno set.
+ **/
+- (int)waitForEvents:(short)events socketFD:(int)socketFD before:(NSTimeInterval)deadline;
+
+/**
+ * Becomes readable whenever the peer signals this side or the anchor hangs up, for event loops.
+ * Once it is, call harvestEvents and try receiving and sending again.
+ **/
+@property (nonatomic, readonly) int readinessFileDescriptor;
+
+- (void)harvestEvents;
+
+/**
+ * Bytes sent but not received by the peer yet, 0 once the peer doesn't receive any more.
+ **/
+- (size_t)unsentLength;
+
+/**
+ * Sends an end of stream, like shutdown(SHUT_WR). The peer receives what was sent before.
+ **/
+- (void)shutdownSending;
+
+/**
+ * Ends both directions and wakes up the peer, and the threads of this side waiting on the ring.
+ * The memory stays mapped until the ring is released, so those threads don't touch unmapped memory.
+ **/
+- (void)close;
+
+@end
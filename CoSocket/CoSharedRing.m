@@ -0,0 +1,534 @@
+//
+//  CoSharedRing.m
+//  Copyright (c) 2014 Yang Yubo <yang@codinn.com>
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+//
+
+#import "CoSharedRing.h"
+#import "CoTimingWheel.h"
+#import <errno.h>
+#import <fcntl.h>
+#import <math.h>
+#import <poll.h>
+#import <stdatomic.h>
+#import <string.h>
+#import <unistd.h>
+#import <sys/mman.h>
+#import <sys/stat.h>
+
+#if defined(__linux__)
+#import <sys/epoll.h>
+#import <sys/eventfd.h>
+#import <sys/syscall.h>
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC         0x0001U
+#define MFD_ALLOW_SEALING   0x0002U
+#endif
+
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS     1033
+#define F_GET_SEALS     1034
+#define F_SEAL_SEAL     0x0001
+#define F_SEAL_SHRINK   0x0002
+#define F_SEAL_GROW     0x0004
+#endif
+#endif
+
+#define CoSharedRingHeaderSize      4096            // Keeps the data page aligned
+#define CoSharedRingMinCapacity     4096
+#define CoSharedRingMaxCapacity     (1UL << 30)
+#define CoSharedRingAnchorEvent     2               // epoll tag of the anchor socket, the eventfds are 0 and 1
+
+// Ring positions are shared between processes, that only works if they don't take a lock
+_Static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "64 bit atomics must be lock-free");
+
+// In front of the data of each direction. Positions only grow, the producer writes tail and
+// the consumer head, each on a cache line of its own.
+typedef struct {
+    _Alignas(64) _Atomic(uint64_t) tail;
+    _Alignas(64) _Atomic(uint64_t) head;
+    _Alignas(64) _Atomic(uint32_t) consumerWaiting;     // Set by the consumer before it sleeps, cleared by the producer waking it
+    _Atomic(uint32_t) producerWaiting;                  // The same for the producer, waiting for room
+    _Atomic(uint32_t) producerClosed;                   // No more data comes
+    _Atomic(uint32_t) consumerClosed;                   // Nothing is received any more
+} CoSharedRingHeader;
+
+_Static_assert(sizeof(CoSharedRingHeader) <= CoSharedRingHeaderSize, "Ring header must fit in front of the data");
+
+static void signal_eventfd(int fd);
+static void drain_eventfd(int fd);
+static void copy_in(uint8_t *data, size_t mask, uint64_t position, const uint8_t *bytes, size_t length);
+static void copy_out(const uint8_t *data, size_t mask, uint64_t position, uint8_t *bytes, size_t length);
+
+@implementation CoSharedRing {
+    void *_memory;
+    size_t _mappedSize;
+    size_t _mask;
+    int _memoryFD;
+    int _eventFDs[4];       // Data and room of the creator, then data and room of the other side
+    int _epollFD;
+    
+    // This side sends through _tx and receives through _rx
+    CoSharedRingHeader *_tx;
+    CoSharedRingHeader *_rx;
+    uint8_t *_txData;
+    uint8_t *_rxData;
+    
+    int _dataFD;            // Signalled when the peer sent, and this side waits for data
+    int _roomFD;            // Signalled when the peer received, and this side waits for room
+    int _peerDataFD;
+    int _peerRoomFD;
+    
+    _Atomic(BOOL) _closed;
+    _Atomic(BOOL) _hungUp;
+}
+
+- (instancetype)initWithCapacity:(size_t)capacity anchorSocketFD:(int)socketFD
+{
+    if (!(self = [super init])) {
+        return nil;
+    }
+    
+    [self resetDescriptors];
+    
+#if defined(__linux__) && defined(SYS_memfd_create)
+    _capacity = CoSharedRingMinCapacity;
+    
+    while (_capacity < capacity && _capacity < CoSharedRingMaxCapacity) {
+        _capacity <<= 1;
+    }
+    
+    _mappedSize = 2 * (CoSharedRingHeaderSize + _capacity);
+    _memoryFD = (int)syscall(SYS_memfd_create, "CoSharedRing", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    
+    if (_memoryFD < 0 || ftruncate(_memoryFD, _mappedSize) != 0) {
+        return nil;
+    }
+    
+    // The peer can't shrink the memory under this side's feet, which would fault on access
+    if (fcntl(_memoryFD, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0) {
+        return nil;
+    }
+    
+    for (int i = 0; i < 4; i++) {
+        if ((_eventFDs[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+            return nil;
+        }
+    }
+    
+    if (![self mapAsCreator:YES anchorSocketFD:socketFD]) {
+        return nil;
+    }
+    
+    return self;
+#else
+    errno = ENOTSUP;
+    return nil;
+#endif
+}
+
+- (instancetype)initWithPeerDescriptors:(const int *)descriptors anchorSocketFD:(int)socketFD
+{
+    if (!(self = [super init])) {
+        return nil;
+    }
+    
+    [self resetDescriptors];
+    
+    _memoryFD = descriptors[0];
+    memcpy(_eventFDs, descriptors + 1, sizeof(_eventFDs));
+    
+#if defined(__linux__)
+    struct stat info;
+    
+    if (fstat(_memoryFD, &info) != 0) {
+        return nil;
+    }
+    
+    _mappedSize = (size_t)info.st_size;
+    _capacity = _mappedSize / 2 - CoSharedRingHeaderSize;
+    
+    int seals = fcntl(_memoryFD, F_GET_SEALS);
+    
+    if (_mappedSize % 2 != 0 || _mappedSize / 2 <= CoSharedRingHeaderSize ||
+        _capacity < CoSharedRingMinCapacity || _capacity > CoSharedRingMaxCapacity || (_capacity & (_capacity - 1)) != 0 ||
+        seals == -1 || !(seals & F_SEAL_SHRINK)) {
+        errno = EINVAL;
+        return nil;
+    }
+    
+    if (![self mapAsCreator:NO anchorSocketFD:socketFD]) {
+        return nil;
+    }
+    
+    // The mapping keeps the memory
+    close(_memoryFD);
+    _memoryFD = -1;
+    
+    return self;
+#else
+    errno = ENOTSUP;
+    return nil;
+#endif
+}
+
+- (void)resetDescriptors
+{
+    _memoryFD = -1;
+    _epollFD = -1;
+    
+    for (int i = 0; i < 4; i++) {
+        _eventFDs[i] = -1;
+    }
+}
+
+/**
+ Maps the memory and sets up the epoll set of readinessFileDescriptor.
+ The creator sends through the first ring and receives through the second, the other side the other way round.
+ */
+- (BOOL)mapAsCreator:(BOOL)creator anchorSocketFD:(int)socketFD
+{
+#if defined(__linux__)
+    _memory = mmap(NULL, _mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, _memoryFD, 0);
+    
+    if (_memory == MAP_FAILED) {
+        _memory = NULL;
+        return NO;
+    }
+    
+    uint8_t *first = _memory;
+    uint8_t *second = first + CoSharedRingHeaderSize + _capacity;
+    
+    _tx = (CoSharedRingHeader *)(creator ? first : second);
+    _rx = (CoSharedRingHeader *)(creator ? second : first);
+    _txData = (uint8_t *)_tx + CoSharedRingHeaderSize;
+    _rxData = (uint8_t *)_rx + CoSharedRingHeaderSize;
+    _mask = _capacity - 1;
+    
+    int *own = creator ? &_eventFDs[0] : &_eventFDs[2];
+    int *peer = creator ? &_eventFDs[2] : &_eventFDs[0];
+    _dataFD = own[0];
+    _roomFD = own[1];
+    _peerDataFD = peer[0];
+    _peerRoomFD = peer[1];
+    
+    // Edge triggered, so an event loop sees every signal, without taking it from a blocked thread
+    _epollFD = epoll_create1(EPOLL_CLOEXEC);
+    
+    struct epoll_event data = { .events = EPOLLIN | EPOLLET, .data.u32 = 0 };
+    struct epoll_event room = { .events = EPOLLIN | EPOLLET, .data.u32 = 1 };
+    struct epoll_event anchor = { .events = EPOLLIN | EPOLLRDHUP | EPOLLET, .data.u32 = CoSharedRingAnchorEvent };
+    
+    return _epollFD >= 0 &&
+        epoll_ctl(_epollFD, EPOLL_CTL_ADD, _dataFD, &data) == 0 &&
+        epoll_ctl(_epollFD, EPOLL_CTL_ADD, _roomFD, &room) == 0 &&
+        epoll_ctl(_epollFD, EPOLL_CTL_ADD, socketFD, &anchor) == 0;
+#else
+    errno = ENOTSUP;
+    return NO;
+#endif
+}
+
+- (void)dealloc
+{
+    // A failed init returns nil with errno set
+    int error = errno;
+    
+    if (_memory) {
+        munmap(_memory, _mappedSize);
+    }
+    
+    if (_memoryFD >= 0) {
+        close(_memoryFD);
+    }
+    
+    if (_epollFD >= 0) {
+        close(_epollFD);
+    }
+    
+    for (int i = 0; i < 4; i++) {
+        if (_eventFDs[i] >= 0) {
+            close(_eventFDs[i]);
+        }
+    }
+    
+    errno = error;
+}
+
+- (void)getPeerDescriptors:(int *)descriptors
+{
+    descriptors[0] = _memoryFD;
+    memcpy(descriptors + 1, _eventFDs, sizeof(_eventFDs));
+}
+
+- (int)readinessFileDescriptor
+{
+    return _epollFD;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Receiving
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (BOOL)isReceiveFinished
+{
+    return atomic_load(&_closed) || atomic_load(&_rx->producerClosed) || atomic_load(&_hungUp);
+}
+
+/**
+ Returns whether receive: has something to return, bytes or the end of the stream. If not, asks the peer
+ for a wake-up. The eventfd is emptied before the last look, so a signal sent after that stays.
+ */
+- (BOOL)armReceive
+{
+    uint64_t head = atomic_load_explicit(&_rx->head, memory_order_relaxed);
+    
+    if (atomic_load_explicit(&_rx->tail, memory_order_acquire) != head || [self isReceiveFinished]) {
+        return YES;
+    }
+    
+    drain_eventfd(_dataFD);
+    atomic_store(&_rx->consumerWaiting, 1);
+    
+    return atomic_load(&_rx->tail) != head || [self isReceiveFinished];
+}
+
+- (ssize_t)receive:(void *)bytes length:(size_t)length
+{
+    if (atomic_load(&_closed)) {
+        errno = EBADF;
+        return -1;
+    }
+    
+    if (![self armReceive]) {
+        errno = EAGAIN;
+        return -1;
+    }
+    
+    uint64_t head = atomic_load_explicit(&_rx->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&_rx->tail, memory_order_acquire);
+    
+    if (tail == head) {
+        // Finished, after everything that was sent
+        return 0;
+    }
+    
+    size_t count = MIN(length, (size_t)(tail - head));
+    
+    copy_out(_rxData, _mask, head, bytes, count);
+    atomic_store_explicit(&_rx->head, head + count, memory_order_release);
+    
+    // Pairs with the fence in armSend of the peer: either it sees the room, or this side sees its flag
+    atomic_thread_fence(memory_order_seq_cst);
+    
+    if (atomic_load_explicit(&_rx->producerWaiting, memory_order_relaxed) && atomic_exchange(&_rx->producerWaiting, 0)) {
+        signal_eventfd(_peerRoomFD);
+    }
+    
+    return count;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Sending
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (BOOL)isSendFinished
+{
+    return atomic_load(&_closed) || atomic_load(&_tx->producerClosed) || atomic_load(&_tx->consumerClosed) || atomic_load(&_hungUp);
+}
+
+/**
+ Returns whether sendIOVec:count: has room, or an error to return. If not, asks the peer for a wake-up.
+ */
+- (BOOL)armSend
+{
+    uint64_t tail = atomic_load_explicit(&_tx->tail, memory_order_relaxed);
+    
+    if (tail - atomic_load_explicit(&_tx->head, memory_order_acquire) < _capacity || [self isSendFinished]) {
+        return YES;
+    }
+    
+    drain_eventfd(_roomFD);
+    atomic_store(&_tx->producerWaiting, 1);
+    
+    return tail - atomic_load(&_tx->head) < _capacity || [self isSendFinished];
+}
+
+- (ssize_t)sendIOVec:(const struct iovec *)iov count:(int)count
+{
+    if (atomic_load(&_closed) || atomic_load_explicit(&_tx->producerClosed, memory_order_relaxed)) {
+        errno = EBADF;
+        return -1;
+    }
+    
+    if (![self armSend]) {
+        errno = EAGAIN;
+        return -1;
+    }
+    
+    uint64_t tail = atomic_load_explicit(&_tx->tail, memory_order_relaxed);
+    size_t room = _capacity - (size_t)(tail - atomic_load_explicit(&_tx->head, memory_order_acquire));
+    
+    if (atomic_load(&_tx->consumerClosed) || atomic_load(&_hungUp) || room == 0) {
+        errno = EPIPE;
+        return -1;
+    }
+    
+    size_t sent = 0;
+    
+    for (int i = 0; i < count && sent < room; i++) {
+        size_t length = MIN(iov[i].iov_len, room - sent);
+        copy_in(_txData, _mask, tail + sent, iov[i].iov_base, length);
+        sent += length;
+    }
+    
+    atomic_store_explicit(&_tx->tail, tail + sent, memory_order_release);
+    
+    // Pairs with the fence in armReceive of the peer
+    atomic_thread_fence(memory_order_seq_cst);
+    
+    if (atomic_load_explicit(&_tx->consumerWaiting, memory_order_relaxed) && atomic_exchange(&_tx->consumerWaiting, 0)) {
+        signal_eventfd(_peerDataFD);
+    }
+    
+    return sent;
+}
+
+- (size_t)unsentLength
+{
+    if (atomic_load(&_tx->consumerClosed) || atomic_load(&_hungUp)) {
+        // Nobody receives it any more
+        return 0;
+    }
+    
+    return (size_t)(atomic_load(&_tx->tail) - atomic_load(&_tx->head));
+}
+
+- (void)shutdownSending
+{
+    atomic_store(&_tx->producerClosed, 1);
+    signal_eventfd(_peerDataFD);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Waiting
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (int)waitForEvents:(short)events socketFD:(int)socketFD before:(NSTimeInterval)deadline
+{
+    // Nothing but the hang up comes over the anchor once the ring is set up
+    struct pollfd pfds[3] = {
+        { .fd = (events & POLLIN) ? _dataFD : -1, .events = POLLIN, .revents = 0 },
+        { .fd = (events & POLLOUT) ? _roomFD : -1, .events = POLLIN, .revents = 0 },
+        { .fd = socketFD, .events = POLLIN, .revents = 0 },
+    };
+    
+    for (;;) {
+        if (((events & POLLIN) && [self armReceive]) || ((events & POLLOUT) && [self armSend])) {
+            return 1;
+        }
+        
+        int timeout_ms = -1;
+        if (deadline > 0) {
+            NSTimeInterval remaining = deadline - [CoTimingWheel now];
+            timeout_ms = remaining > 0 ? (int)ceil(remaining * 1000) : 0;
+        }
+        
+        int result = poll(pfds, 3, timeout_ms);
+        
+        if (result == -1 && errno == EINTR) {
+            continue;
+        }
+        
+        if (result <= 0) {
+            return result;
+        }
+        
+        if (pfds[2].revents) {
+            atomic_store(&_hungUp, YES);
+        }
+    }
+}
+
+- (void)harvestEvents
+{
+#if defined(__linux__)
+    struct epoll_event events[3];
+    int count = epoll_wait(_epollFD, events, 3, 0);
+    
+    for (int i = 0; i < count; i++) {
+        if (events[i].data.u32 == CoSharedRingAnchorEvent) {
+            atomic_store(&_hungUp, YES);
+        }
+    }
+#endif
+}
+
+- (void)close
+{
+    if (atomic_exchange(&_closed, YES)) {
+        return;
+    }
+    
+    atomic_store(&_tx->producerClosed, 1);
+    atomic_store(&_rx->consumerClosed, 1);
+    
+    // The peer, and this side's threads blocked on the ring
+    signal_eventfd(_peerDataFD);
+    signal_eventfd(_peerRoomFD);
+    signal_eventfd(_dataFD);
+    signal_eventfd(_roomFD);
+}
+
+@end
+
+static void signal_eventfd(int fd)
+{
+    uint64_t one = 1;
+    
+    // Fails only if the counter is about to overflow, which wakes up the other side just as well
+    while (write(fd, &one, sizeof(one)) < 0 && errno == EINTR);
+}
+
+static void drain_eventfd(int fd)
+{
+    uint64_t count;
+    
+    while (read(fd, &count, sizeof(count)) < 0 && errno == EINTR);
+}
+
+static void copy_in(uint8_t *data, size_t mask, uint64_t position, const uint8_t *bytes, size_t length)
+{
+    size_t offset = (size_t)(position & mask);
+    size_t first = MIN(length, mask + 1 - offset);
+    
+    memcpy(data + offset, bytes, first);
+    memcpy(data, bytes + first, length - first);
+}
+
+static void copy_out(const uint8_t *data, size_t mask, uint64_t position, uint8_t *bytes, size_t length)
+{
+    size_t offset = (size_t)(position & mask);
+    size_t first = MIN(length, mask + 1 - offset);
+    
+    memcpy(bytes, data + offset, first);
+    memcpy(bytes + first, data, length - first);
+}
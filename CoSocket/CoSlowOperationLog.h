@@ -0,0 +1,115 @@
+//
+//  CoSlowOperationLog.h
+//  Copyright (c) 2014 Yang Yubo <yang@codinn.com>
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+//
+
+#import <Foundation/Foundation.h>
+
+/**
+ * A connect, read or write that took longer than the socket's slowOperationThreshold, and where its time went.
+ **/
+@interface CoSlowOperation : NSObject
+
+/**
+ * The method, e.g. -[CoSocket readDataToLength:error:]. Asynchronous operations are named after their kind.
+ **/
+@property (nonatomic, copy) NSString *operation;
+
+@property (nonatomic, strong) NSDate *date;
+@property (nonatomic, assign) NSTimeInterval duration;
+
+/**
+ * Time spent in getaddrinfo(), for a connect to a host name.
+ **/
+@property (nonatomic, assign) NSTimeInterval lookupTime;
+
+/**
+ * Time from connect() until the connection was established or failed.
+ **/
+@property (nonatomic, assign) NSTimeInterval handshakeTime;
+
+/**
+ * Time spent waiting for the socket to become readable or writable, the handshake included.
+ * Whatever remains of the duration was spent in the library, copying and scanning, or waiting for its locks.
+ * Not known for asynchronous operations.
+ **/
+@property (nonatomic, assign) NSTimeInterval waitTime;
+
+/**
+ * CPU time the calling thread used, copying, scanning and in system calls. Not known for asynchronous operations.
+ **/
+@property (nonatomic, assign) NSTimeInterval cpuTime;
+
+@property (nonatomic, assign) NSUInteger bytes;
+
+/**
+ * recv() and send() calls made, many small ones mean the data trickled in or out.
+ **/
+@property (nonatomic, assign) NSUInteger receiveCount;
+@property (nonatomic, assign) NSUInteger sendCount;
+
+@property (nonatomic, copy) NSString *remoteHost;
+@property (nonatomic, assign) uint16_t remotePort;
+
+/**
+ * The trace tag of the socket's operation context, if any.
+ **/
+@property (nonatomic, copy) NSString *traceTag;
+
+/**
+ * The error the operation failed with, if the caller asked for it.
+ **/
+@property (nonatomic, strong) NSError *error;
+
+@end
+
+typedef void (^ CoSlowOperationHandler)(CoSlowOperation *operation);
+
+/**
+ * A bounded in-memory log of slow operations. When it is full, the oldest entry makes room.
+ * All methods are thread safe.
+ **/
+@interface CoSlowOperationLog : NSObject
+
+/**
+ * The log sockets write to unless told otherwise. It keeps the last 256 entries.
+ **/
++ (CoSlowOperationLog *)sharedLog;
+
+- (instancetype)initWithCapacity:(NSUInteger)capacity;
+
+@property (atomic, readonly) NSUInteger capacity;
+
+/**
+ * Called with each new entry, on the thread that ran the operation. Keep it short.
+ **/
+@property (atomic, copy) CoSlowOperationHandler handler;
+
+- (void)addOperation:(CoSlowOperation *)operation;
+
+/**
+ * The entries, oldest first.
+ **/
+@property (atomic, readonly) NSArray *operations;
+
+- (void)removeAllOperations;
+
+@end
@@ -0,0 +1,98 @@
+//
+//  CoSlowOperationLog.m
+//  Copyright (c) 2014 Yang Yubo <yang@codinn.com>
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+//
+
+#import "CoSlowOperationLog.h"
+
+@implementation CoSlowOperation
+
+- (NSString *)description
+{
+    return [NSString stringWithFormat:@"%@ %@:%u took %.3fs (lookup %.3fs, handshake %.3fs, waiting %.3fs, on CPU %.3fs), %lu bytes in %lu recv and %lu send calls%@%@",
+            self.operation, self.remoteHost, self.remotePort, self.duration, self.lookupTime, self.handshakeTime, self.waitTime, self.cpuTime,
+            (unsigned long)self.bytes, (unsigned long)self.receiveCount, (unsigned long)self.sendCount,
+            self.traceTag ? [@" for " stringByAppendingString:self.traceTag] : @"",
+            self.error ? [@", failed: " stringByAppendingString:self.error.localizedDescription] : @""];
+}
+
+@end
+
+@implementation CoSlowOperationLog {
+    NSMutableArray *_operations;
+}
+
++ (CoSlowOperationLog *)sharedLog
+{
+    static CoSlowOperationLog *sharedLog = nil;
+    
+    @synchronized(self) {
+        if (!sharedLog) {
+            sharedLog = [[CoSlowOperationLog alloc] initWithCapacity:256];
+        }
+    }
+    
+    return sharedLog;
+}
+
+- (instancetype)init
+{
+    return [self initWithCapacity:256];
+}
+
+- (instancetype)initWithCapacity:(NSUInteger)capacity
+{
+    if ((self = [super init])) {
+        _capacity = MAX(capacity, 1);
+        _operations = [NSMutableArray arrayWithCapacity:_capacity];
+    }
+    return self;
+}
+
+- (void)addOperation:(CoSlowOperation *)operation
+{
+    @synchronized(self) {
+        if (_operations.count == _capacity) {
+            [_operations removeObjectAtIndex:0];
+        }
+        
+        [_operations addObject:operation];
+    }
+    
+    CoSlowOperationHandler handler = self.handler;
+    if (handler) handler(operation);
+}
+
+- (NSArray *)operations
+{
+    @synchronized(self) {
+        return [_operations copy];
+    }
+}
+
+- (void)removeAllOperations
+{
+    @synchronized(self) {
+        [_operations removeAllObjects];
+    }
+}
+
+@end
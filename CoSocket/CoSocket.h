@@ -27,9 +27,27 @@
 //
 
 #import <Foundation/Foundation.h>
+#import <dispatch/dispatch.h>
 #include <sys/socket.h> // AF_INET, AF_INET6
+#import "CoEventLoop.h"
+#import "CoOperationContext.h"
+#import "CoPattern.h"
+#import "CoSlowOperationLog.h"
+#import "CoTraceRecorder.h"
 
 typedef void (^ CoSocketLogHandler)(NSString *fmt, ...);
+typedef void (^ CoSocketCompletion)(NSError *error);
+typedef void (^ CoSocketReadCompletion)(NSData *data, NSError *error);
+typedef NSUInteger (^ CoSocketBufferReader)(const void *bytes, NSUInteger length);
+typedef NSUInteger (^ CoSocketMessageFramer)(const void *bytes, NSUInteger length, BOOL *isPong);
+
+#ifndef NS_SWIFT_NAME
+#define NS_SWIFT_NAME(name)
+#endif
+
+#ifndef NS_SWIFT_NOTHROW
+#define NS_SWIFT_NOTHROW
+#endif
 
 @interface CoSocket : NSObject
 
@@ -53,6 +71,84 @@ typedef void (^ CoSocketLogHandler)(NSString *fmt, ...);
 
 @property (atomic, assign, readwrite, getter=isIPv4PreferredOverIPv6) BOOL IPv4PreferredOverIPv6;
 
+/**
+ * Multipath TCP, disabled by default.
+ *
+ * When enabled, outgoing connections are created with IPPROTO_MPTCP, so the kernel can add subflows
+ * over other interfaces and keep the connection alive when one of them goes away.
+ * If the kernel doesn't support MPTCP, CoSocket falls back to a plain TCP socket.
+ * If the peer doesn't support it, the kernel falls back to TCP during the handshake.
+ * Either way the connection behaves like any other, use isMultipath to find out what was negotiated.
+ *
+ * MPTCP is only available through BSD sockets on Linux 5.6 and later. Elsewhere this has no effect.
+ **/
+@property (atomic, assign, readwrite, getter=isMultipathEnabled) BOOL multipathEnabled;
+
+/**
+ * Same-host upgrade from loopback TCP to a unix domain socket the server advertises, disabled by default.
+ *
+ * The server knows which unix socket serves the session, so the client needs no configuration,
+ * but only enable this for servers that implement the handshake. When connectToHost:... connects
+ * to a loopback address, CoSocket asks over the new TCP connection for a unix socket path:
+ *
+ *   client -> server, TCP:  "COUNIX?1"
+ *   server -> client, TCP:  "COUNIX!1", path length (2 bytes, big-endian), path, 16 byte token
+ *   client -> server, unix: "COUNIX=1", token
+ *
+ * The server pairs the unix connection with the TCP one by the token and serves the session on it,
+ * CoSocket closes the TCP connection. After an upgrade connectedHost returns the socket path.
+ * A path length of zero (and no token) declines, and the session goes on over TCP, as it does if the
+ * advertised socket can't be connected. So a server waits for the session on both connections until
+ * the client picks one, answerLoopbackUpgradeWithPath:error: implements the server side.
+ * Any other answer fails the connect with EPROTO.
+ *
+ * No upgrade is attempted when an interface is given, or when connecting with connectToAddress:...
+ **/
+@property (atomic, assign, readwrite, getter=isLoopbackUpgradeEnabled) BOOL loopbackUpgradeEnabled;
+
+/**
+ * Idle timeout, disabled (zero) by default.
+ *
+ * A connection that hasn't sent or received a byte for this long is shut down, waking up any read or write
+ * blocked on it, and later reads and writes fail.
+ * The check runs on the shared CoTimingWheel, so it is coarse (10ms) and costs nothing per read or write.
+ *
+ * Takes effect on the next connect.
+ **/
+@property (atomic, assign, readwrite) NSTimeInterval idleTimeout;
+
+/**
+ * The request the socket is working for, nil by default.
+ *
+ * While set, connects (including the host name lookup), reads and writes, blocking or asynchronous, end
+ * at the context's deadline if that comes before their own timeout, so one budget bounds the whole request.
+ * Cancelling the context shuts the connection down; operations in progress and later ones fail with ECANCELED.
+ * Errors carry the context's trace tag under CoOperationTraceTagKey.
+ *
+ * The lookup itself can't be interrupted, it is only checked against the context once it returns.
+ **/
+@property (atomic, strong, readwrite) CoOperationContext *context;
+
+/**
+ * Connects, reads and writes taking at least this long are added to slowOperationLog, with where their time went:
+ * the host name lookup, the handshake, waiting for the socket, and the number of recv() and send() calls.
+ * Disabled (zero) by default, then nothing is measured.
+ *
+ * Each blocking method is one entry, whatever it calls internally. Asynchronous operations are only timed as a whole.
+ **/
+@property (atomic, assign, readwrite) NSTimeInterval slowOperationThreshold;
+
+/**
+ * Where slow operations go, [CoSlowOperationLog sharedLog] by default.
+ **/
+@property (atomic, strong, readwrite) CoSlowOperationLog *slowOperationLog;
+
+/**
+ * Records the socket's connects, reads and writes, down to every wait and every recv() and send(), nil by default.
+ * Several sockets may share a recorder, each gets a track of its own.
+ **/
+@property (atomic, strong, readwrite) CoTraceRecorder *traceRecorder;
+
 #pragma mark Connecting
 
 /**
@@ -155,6 +251,81 @@ typedef void (^ CoSocketLogHandler)(NSString *fmt, ...);
              withTimeout:(NSTimeInterval)timeout
                    error:(NSError **)errPtr;
 
+/**
+ * Connects to a unix domain socket at the given file system path, with no timeout.
+ **/
+- (BOOL)connectToUnixSocketAtPath:(NSString *)path error:(NSError **)errPtr;
+
+/**
+ * Connects to a unix domain socket at the given file system path, with an optional timeout.
+ *
+ * For peers on the same host this skips the TCP/IP stack: there is no checksumming, segmentation
+ * or loopback routing. Data is still copied into the kernel on send and out of it on receive, like over TCP,
+ * until both sides switch to shared memory, see offerSharedMemoryWithCapacity:error:.
+ * All reading and writing methods work the same as with a TCP connection.
+ * connectToHost: can switch to a unix socket by itself, see loopbackUpgradeEnabled.
+ *
+ * For a unix domain connection connectedHost returns the socket path and connectedPort returns 0.
+ *
+ * To not time out use a negative time interval.
+ **/
+- (BOOL)connectToUnixSocketAtPath:(NSString *)path withTimeout:(NSTimeInterval)timeout error:(NSError **)errPtr;
+
+/**
+ * Connects to a SOCK_SEQPACKET unix domain socket at the given path, with an optional timeout.
+ *
+ * A seqpacket socket keeps message boundaries: every sendMessage: on one side is received by exactly
+ * one receiveMessage on the other, so local IPC needs neither length prefixes nor separators.
+ * Use sendMessage:error: and receiveMessageWithError: on such a connection, not the stream methods.
+ *
+ * Unix domain seqpacket sockets are available on Linux, but not on Darwin.
+ * To not time out use a negative time interval.
+ **/
+- (BOOL)connectToSeqPacketSocketAtPath:(NSString *)path withTimeout:(NSTimeInterval)timeout error:(NSError **)errPtr;
+
+/**
+ * Takes over an already connected socket, for example one end of a socketpair().
+ * The socket is made non-blocking and close-on-exec, and is closed on disconnect like any other.
+ **/
+- (BOOL)adoptConnectedSocketFD:(int)socketFD error:(NSError **)errPtr;
+
+/**
+ * Server side of the loopback upgrade (see loopbackUpgradeEnabled), on an accepted TCP connection
+ * of a client that enabled it, before any other data.
+ *
+ * Reads the client's request and advertises the unix socket at path, or declines if path is nil.
+ * Returns the token the client presents on the unix socket, an empty one when declining, or nil on error.
+ **/
+- (NSData *)answerLoopbackUpgradeWithPath:(NSString *)path error:(NSError **)errPtr;
+
+/**
+ * Reads the token a client presents first on a connection accepted on the advertised unix socket.
+ * Returns nil with EPROTO if the connection doesn't start with one.
+ **/
+- (NSData *)readLoopbackUpgradeTokenWithError:(NSError **)errPtr;
+
+/**
+ * Moves the data of a unix domain stream connection into shared memory, a lock-free ring per direction
+ * that both processes map (see CoSharedRing). Reads and writes then copy in and out of the mapping
+ * without a system call, the kernel is only entered to wake up a side waiting for data or room.
+ *
+ * One side offers, with capacity bytes per direction (zero for 1 MiB), the other accepts, both before any
+ * other data and with the heartbeat stopped. The offer passes the memory and eventfd descriptors over the socket.
+ * The socket stays open to tell either side when the other goes away, closing the connection ends both rings.
+ * All reading and writing methods, the non-blocking and the asynchronous ones included, work the same.
+ *
+ * Linux only. If the peer can't map the memory, the offer fails but the connection goes on over the socket,
+ * like after an accept that failed. Only a broken handshake closes it.
+ **/
+- (BOOL)offerSharedMemoryWithCapacity:(NSUInteger)capacity error:(NSError **)errPtr;
+
+- (BOOL)acceptSharedMemoryWithError:(NSError **)errPtr;
+
+/**
+ * Whether the connection runs over shared memory.
+ **/
+@property (atomic, readonly) BOOL isSharedMemory;
+
 
 #pragma mark Disconnecting
 
@@ -164,6 +335,65 @@ typedef void (^ CoSocketLogHandler)(NSString *fmt, ...);
  **/
 - (void)disconnect;
 
+/**
+ * Half-closes the connection: sends a FIN after any write in progress, while reads keep working
+ * until the peer closes its side. Use it to tell the peer the request is complete.
+ * Stops the heartbeat, since no more pings can be sent.
+ **/
+- (BOOL)shutdownWriteAndReturnError:(NSError **)errPtr;
+
+/**
+ * Waits until everything written has been acknowledged by the peer, then disconnects.
+ *
+ * The send queue is sampled with SIOCOUTQ on Linux and SO_NWRITE on Darwin.
+ * If it doesn't drain within timeout, the connection is closed anyway and ETIMEDOUT reported.
+ * Zero timeout waits for as long as it takes.
+ **/
+- (BOOL)closeGracefullyWithTimeout:(NSTimeInterval)timeout error:(NSError **)errPtr;
+
+/**
+ * Closes the connection with a RST (SO_LINGER of zero), discarding unsent data.
+ *
+ * No TIME_WAIT entry is left behind, which keeps local ports available on hosts opening many short connections.
+ **/
+- (void)abort;
+
+#pragma mark Heartbeat
+
+/**
+ * Starts sending ping whenever the connection has been quiet for interval seconds, on the shared CoTimingWheel.
+ *
+ * The framer tells the socket where the protocol's messages begin and end, in both directions: given the bytes
+ * at the start of a message, it returns the message's length, or 0 if it can't tell from that many bytes yet,
+ * and sets *isPong for a pong. The length may go beyond the bytes given, so it can come from a header.
+ * Pongs are taken out of the stream wherever they arrive between two messages, and reads never see them.
+ * Bytes received after a message the framer can't measure yet are held back from reads until it can.
+ * Pings, which must be whole messages, are only sent between the messages the application writes.
+ *
+ * Any data received after a ping counts as an answer, so busy connections are never pinged.
+ * After maxMissed intervals without an answer the connection is shut down, and pending and later reads and
+ * writes fail with ETIMEDOUT.
+ *
+ * The heartbeat stops on disconnect and has to be started again after reconnecting. Start it before the first
+ * read or write of the connection, the framer has to see every message from the first.
+ **/
+- (void)startHeartbeatWithInterval:(NSTimeInterval)interval
+                              ping:(NSData *)ping
+                            framer:(CoSocketMessageFramer)framer
+                         maxMissed:(NSUInteger)maxMissed;
+
+- (void)stopHeartbeat;
+
+/**
+ * Time between sending the last answered ping and receiving its pong, zero until a pong is received.
+ **/
+@property (atomic, readonly) NSTimeInterval heartbeatRoundTripTime;
+
+/**
+ * Heartbeat intervals in a row without an answer from the peer.
+ **/
+@property (atomic, readonly) NSUInteger missedHeartbeats;
+
 #pragma mark Diagnostics
 
 /**
@@ -200,8 +430,47 @@ typedef void (^ CoSocketLogHandler)(NSString *fmt, ...);
 @property (atomic, readonly) BOOL isIPv4;
 @property (atomic, readonly) BOOL isIPv6;
 
+/**
+ * Returns whether the connection is running Multipath TCP, rather than TCP after a fallback.
+ **/
+@property (atomic, readonly) BOOL isMultipath;
+
+/**
+ * Returns the kernel's MPTCP_INFO for a multipath connection, or nil if the connection isn't one.
+ *
+ * Keys: subflows, subflowsMax, addAddrSignal, addAddrAccepted, localAddrUsed, localAddrMax, flags, token.
+ * All values are NSNumbers.
+ **/
+@property (atomic, readonly) NSDictionary *multipathInfo;
+
+/**
+ * Whether operationTimes is kept, NO by default. It costs a clock_gettime() call per method, recv(), send() and wait.
+ **/
+@property (atomic, assign, readwrite, getter=isCPUTimeAccountingEnabled) BOOL CPUTimeAccountingEnabled;
+
+/**
+ * Where the blocking connects, reads and writes spent their time, by method, since the socket was created
+ * or last reset. Tells a connection that is expensive for this process, e.g. one read byte by byte to a separator,
+ * from one that is merely slow.
+ *
+ * Keys are method names, e.g. -[CoSocket readDataToData:maxLength:error:]. Values are dictionaries of NSNumbers:
+ * count, wallTime, cpuTime (the calling thread's, from CLOCK_THREAD_CPUTIME_ID), and blockedTime (waiting for
+ * the socket or for the host name lookup). What wall time is neither was spent waiting for a lock or the CPU.
+ *
+ * Asynchronous operations run on the event loop's thread and aren't counted.
+ **/
+@property (atomic, readonly) NSDictionary *operationTimes;
+
+- (void)resetOperationTimes;
+
 @property (strong, readwrite) CoSocketLogHandler logDebug;
 
+/**
+ * The loop serving this socket, set by -[CoEventLoop addSocket:] or by the first asynchronous operation.
+ * Idle timeouts and heartbeats then run on the loop's timing wheel and thread, instead of the shared wheel.
+ **/
+@property (atomic, weak, readonly) CoEventLoop *eventLoop;
+
 #pragma mark Writing
 
 /**
@@ -212,6 +481,42 @@ typedef void (^ CoSocketLogHandler)(NSString *fmt, ...);
  */
 - (BOOL)writeData:(NSData *)data error:(NSError **)errPtr;
 
+/**
+ * Sends the string in the given encoding, without first making an NSData of it.
+ *
+ * The string is encoded into 64K chunks from the shared CoBufferPool, and up to 16 of them go out with
+ * a single sendmsg(). A character that can't be encoded fails the write with EILSEQ; nothing is sent then,
+ * unless the string is longer than those 16 chunks and part of it has gone out already.
+ **/
+- (BOOL)writeString:(NSString *)string encoding:(NSStringEncoding)encoding error:(NSError **)errPtr;
+
+/**
+ * Formats and sends the result as UTF-8, like writeString:encoding:error:.
+ **/
+- (BOOL)writeWithError:(NSError **)errPtr format:(NSString *)format, ... NS_FORMAT_FUNCTION(2,3);
+
+
+#pragma mark Messages
+
+/**
+ Sends the given data as a single message on a message-oriented (seqpacket) connection.
+ 
+ The message is sent whole or not at all. A message larger than the socket send buffer fails with EMSGSIZE,
+ and the connection stays usable.
+ 
+ @param message The data of the message.
+ @return YES if the message was sent, NO otherwise.
+ */
+- (BOOL)sendMessage:(NSData *)message error:(NSError **)errPtr;
+
+/**
+ Receives the next message on a message-oriented (seqpacket) connection, with its boundaries preserved.
+ 
+ Messages up to 64K are supported. A larger message is an error, since the rest of it would be lost.
+ 
+ @return The message, or nil if a timeout or other error occurs.
+ */
+- (NSData *)receiveMessageWithError:(NSError **)errPtr;
 
 #pragma mark Reading
 
@@ -247,6 +552,144 @@ typedef void (^ CoSocketLogHandler)(NSString *fmt, ...);
  **/
 - (NSData *)readDataToData:(NSData *)data error:(NSError **)errPtr;
 
+/**
+ * Like readDataToData:error:, but fails once maxLength bytes were received without the separator,
+ * e.g. 255 for an SSH identification line. maxLength includes the separator, zero means the read buffer size.
+ **/
+- (NSData *)readDataToData:(NSData *)data maxLength:(NSUInteger)maxLength error:(NSError **)errPtr;
+
+/**
+ * Reads bytes until (and including) the first match of the pattern, e.g. a shell prompt.
+ *
+ * The pattern's DFA runs over each received byte once, keeping its state while waiting for more,
+ * so a long output is never rescanned. A $ in the pattern matches the end of the data received so far,
+ * which depends on where the kernel split the stream, see CoPattern.
+ * Fails once maxLength bytes were received without a match; zero means the read buffer size.
+ **/
+- (NSData *)readDataToPattern:(CoPattern *)pattern maxLength:(NSUInteger)maxLength error:(NSError **)errPtr;
+
+/**
+ * Reads the next expected.length bytes if they equal expected, e.g. a protocol banner, magic number or handshake ack.
+ *
+ * Bytes are compared as they arrive, so a mismatch fails right away with EPROTO, without waiting for the rest
+ * and without copying anything. The received bytes stay in the read buffer, to be looked at with
+ * readBufferWithReader:error: or read as usual, and the connection stays open.
+ *
+ * expected must be no bigger than the read buffer (64 KiB).
+ **/
+- (BOOL)readExpectingData:(NSData *)expected error:(NSError **)errPtr;
+
+/**
+ * Reads a line like readDataToData:error:, and returns it as a string, without the separator.
+ *
+ * The string is created straight from the read buffer, with no NSData in between.
+ * UTF-8 and ASCII lines are validated first, pure ASCII 16 bytes at a time (SSE2 or NEON).
+ * A line that isn't valid in the encoding fails with EILSEQ, and is skipped; the connection stays usable.
+ **/
+- (NSString *)readLineAsStringWithSeparator:(NSData *)separator encoding:(NSStringEncoding)encoding error:(NSError **)errPtr;
+
+/**
+ * Lends the bytes received but not read yet to reader, without copying them, waiting for at least one byte.
+ * The reader returns how many of them it consumed; the rest are read next.
+ *
+ * The bytes are only valid while the reader runs, and the socket must not be used from within it.
+ **/
+- (BOOL)readBufferWithReader:(CoSocketBufferReader)reader error:(NSError **)errPtr NS_SWIFT_NAME(withUnsafeReadBuffer(_:));
+
+/**
+ * Returns every complete line received so far, separator included, up to max lines (zero for no limit).
+ *
+ * Whatever the socket holds is received first, without waiting, so a busy connection yields thousands of
+ * lines per call. It only waits if not even one line is there, and then only once, so it may return an empty
+ * array if just part of a line arrives. The lines share a single allocation, copied out of the read buffer at once.
+ **/
+- (NSArray *)readAvailableLinesWithSeparator:(NSData *)separator max:(NSUInteger)max error:(NSError **)errPtr;
+
+/**
+ * Like readAvailableLinesWithSeparator:max:error:, for frames prefixed with their payload length in headerLength
+ * (1, 2, 4 or 8) bytes, big-endian. Returns the payloads, without their headers.
+ *
+ * A frame must fit the read buffer (64 KiB), header included. A header declaring more fails the read
+ * as soon as it arrives.
+ **/
+- (NSArray *)readAvailableFramesWithHeaderLength:(NSUInteger)headerLength max:(NSUInteger)max error:(NSError **)errPtr;
+
+#pragma mark Non-blocking
+
+/**
+ * The methods below never wait, so CoSocket can be driven by an existing event loop (libuv, libev, your own epoll)
+ * instead of a thread per socket: watch readinessFileDescriptor for the interest they return, and call them
+ * again when it's ready.
+ *
+ * A read that would block returns nil without an error, and sets interest to CoEventRead. Data already
+ * received is served first, so call the read before waiting for readiness. An interest of zero with no error
+ * means the memory budget (see CoBufferPool) is exhausted; try again later.
+ * Errors close the connection, like with the blocking methods.
+ *
+ * Since nil without an error isn't a failure, Swift doesn't import the reads as throwing.
+ **/
+
+/**
+ * length must be no bigger than the read buffer (64 KiB).
+ **/
+- (NSData *)tryReadDataToLength:(NSUInteger)length interest:(CoEventMask *)interest error:(NSError **)errPtr NS_SWIFT_NOTHROW;
+
+- (NSData *)tryReadDataToData:(NSData *)data interest:(CoEventMask *)interest error:(NSError **)errPtr NS_SWIFT_NOTHROW;
+
+/**
+ * Writes as much of data as the socket takes, and returns how much that was, or -1 on error.
+ * If not all of it was written, interest is set to CoEventWrite and the rest is up to the caller.
+ **/
+- (NSInteger)tryWriteData:(NSData *)data interest:(CoEventMask *)interest error:(NSError **)errPtr;
+
+/**
+ * The descriptor to watch for the interest the non-blocking methods return. It changes on reconnect.
+ * Over shared memory it becomes readable for either interest.
+ **/
+@property (atomic, readonly) int readinessFileDescriptor;
+
+#pragma mark Asynchronous
+
+/**
+ * The asynchronous methods below run on the socket's eventLoop, as readiness events come in, without
+ * blocking any thread. Swift 5.5 and later imports them as async methods, e.g. try await socket.read(exactly: 4),
+ * which unlike the blocking methods never tie up a thread of the cooperative pool. A socket that isn't served by a loop yet is added to one of the shared CoRuntime.
+ *
+ * They can be mixed with the blocking methods on the same socket: reads, blocking or not, are served in
+ * turn from the same stream, and so are writes. Operations of one direction complete in the order issued.
+ * Each operation gets the timeout of the connect, and closes the connection when it runs out, like the
+ * blocking ones.
+ *
+ * Completions are dispatched to completionQueue. When it's nil (the default) they run on the
+ * event loop's thread; to have them run on a thread of your own, run a CoEventLoop there and add the socket to it.
+ **/
+@property (atomic, strong) dispatch_queue_t completionQueue;
+
+- (void)connectToHost:(NSString *)host
+               onPort:(uint16_t)port
+          withTimeout:(NSTimeInterval)timeout
+           completion:(CoSocketCompletion)completion NS_SWIFT_NAME(connect(toHost:port:timeout:completion:));
+
+/**
+ * The host name is looked up on the shared CoExecutor, since getaddrinfo() can only block.
+ **/
+- (void)connectToHost:(NSString *)host
+               onPort:(uint16_t)port
+         viaInterface:(NSString *)interface
+          withTimeout:(NSTimeInterval)timeout
+           completion:(CoSocketCompletion)completion NS_SWIFT_NAME(connect(toHost:port:interface:timeout:completion:));
+
+- (void)writeData:(NSData *)data completion:(CoSocketCompletion)completion NS_SWIFT_NAME(write(_:completion:));
+
+- (void)readDataToLength:(NSUInteger)length completion:(CoSocketReadCompletion)completion NS_SWIFT_NAME(read(exactly:completion:));
+
+- (void)readDataToData:(NSData *)data completion:(CoSocketReadCompletion)completion NS_SWIFT_NAME(read(until:completion:));
+
+/**
+ * Asynchronous readBufferWithReader:error:. The reader runs on the event loop's thread.
+ **/
+- (void)readBufferWithReader:(CoSocketBufferReader)reader completion:(CoSocketCompletion)completion NS_SWIFT_NAME(withUnsafeReadBuffer(_:completion:));
+
 #pragma mark Advanced
 
 /**
@@ -277,6 +720,8 @@ typedef void (^ CoSocketLogHandler)(NSString *fmt, ...);
 
 + (BOOL)isIPv4Address:(NSData *)address;
 + (BOOL)isIPv6Address:(NSData *)address;
++ (BOOL)isUnixAddress:(NSData *)address;
++ (BOOL)isLoopbackAddress:(NSData *)address;
 
 + (BOOL)getHost:(NSString **)hostPtr port:(uint16_t *)portPtr fromAddress:(NSData *)address;
 
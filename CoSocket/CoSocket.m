@@ -49,42 +49,351 @@
 
 
 #import "CoSocket.h"
-#import <CommonCrypto/CommonDigest.h>
+#import "CoTimingWheel.h"
+#import "CoEventLoop.h"
+#import "CoBufferPool.h"
+#import "CoExecutor.h"
+#import "CoOperationContext.h"
+#import "CoPattern.h"
+#import "CoSlowOperationLog.h"
+#import "CoTraceRecorder.h"
+#import "CoRuntime.h"
+#import "CoSharedRing.h"
 #import <netdb.h>
 #import <net/if.h>
 #import <netinet/tcp.h>
 #import <netinet/in.h>
 #import <arpa/inet.h>
+#import <errno.h>
 #import <fcntl.h>
 #import <ifaddrs.h>
+#import <math.h>
+#import <poll.h>
+#import <pthread.h>
+#import <stdatomic.h>
+#import <string.h>
+#import <time.h>
+#import <unistd.h>
 #import <sys/socket.h>
 #import <sys/types.h>
 #import <sys/ioctl.h>
+#import <sys/un.h>
+#import <sys/uio.h>
+
+#if defined(__SSE2__)
+#import <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#import <arm_neon.h>
+#endif
+
+#if defined(__linux__)
+#import <linux/sockios.h>   // SIOCOUTQ, or closeGracefully wouldn't wait for the send queue
+#if __has_include(<linux/mptcp.h>)
+#import <linux/mptcp.h> // struct mptcp_info, MPTCP_INFO
+#endif
+// Older libc headers predate MPTCP, the values are fixed by the kernel ABI.
+#ifndef IPPROTO_MPTCP
+#define IPPROTO_MPTCP 262
+#endif
+#ifndef SOL_MPTCP
+#define SOL_MPTCP 284
+#endif
+#endif
 
 #define CoSocketErrorDomain @"CoSocketErrorDomain"
-#define CoTCPSocketBufferSize 65536 // 64K
 #define SOCKET_NULL -1
 
-static struct timeval get_timeval(NSTimeInterval interval);
+#define CoSocketMinimalReadAhead 4096   // Read size under memory pressure when the wanted size isn't known
+#define CoSocketMaxWriteChunks 16       // Pooled chunks encoded ahead of one sendmsg()
+#define CoSocketMaxHeaderCarry 64       // Bytes of a split message header kept for the heartbeat framer
+#define CoSocketMaxTimedOperations 32   // Distinct methods in operationTimes, more than CoSocket has
+
+// Loopback upgrade handshake, see loopbackUpgradeEnabled
+#define CoSocketUpgradeMagicLength 8
+#define CoSocketUpgradeTokenLength 16
+static const char CoSocketUpgradeRequest[] = "COUNIX?1";    // Client to server, over TCP
+static const char CoSocketUpgradeReply[] = "COUNIX!1";      // Server to client, then path length, path and token
+static const char CoSocketUpgradeHello[] = "COUNIX=1";      // Client to server, over the unix socket, then the token
+
+// Shared memory handshake, see offerSharedMemoryWithCapacity:
+#define CoSocketSharedMemoryCapacity (1 << 20)
+#define CoSocketSharedMemoryOfferLength 16
+static const char CoSocketSharedMemoryOffer[] = "COSHMEM1";  // Then the capacity as 64 bit big endian, with the ring's descriptors
+static const char CoSocketSharedMemoryAccepted = 'Y';       // Or anything else to decline
+
+// Darwin suppresses SIGPIPE per socket (SO_NOSIGPIPE), Linux per call (MSG_NOSIGNAL).
+#ifdef MSG_NOSIGNAL
+#define CoSocketSendFlags MSG_NOSIGNAL
+#else
+#define CoSocketSendFlags 0
+#endif
 
 #if 0
 static NSTimeInterval get_interval(struct timeval tv);
 #endif
 
-static int connect_timeout(int sockfd, const struct sockaddr *address, socklen_t address_len, struct timeval * timeout, CoSocketLogHandler logDebug);
+static NSTimeInterval monotonic_time(void);
+static NSTimeInterval thread_cpu_time(void);
+static NSTimeInterval deadline_from_timeout(NSTimeInterval timeout);
+static int create_socket(int domain, int type, int protocol);
+static int wait_for_socket(int sockfd, short events, NSTimeInterval deadline);
+static int connect_timeout(int sockfd, const struct sockaddr *address, socklen_t address_len, NSTimeInterval deadline, CoSocketLogHandler logDebug);
+static const void *find_bytes(const void *haystack, size_t length, const void *needle, size_t needleLength);
+static size_t ascii_prefix_length(const unsigned char *bytes, size_t length);
+static BOOL is_valid_utf8(const unsigned char *bytes, size_t length);
+static int unsent_bytes(int sockfd);
+static void abort_connection(int sockfd);
+
+typedef NS_ENUM(NSInteger, CoSocketOperationKind) {
+    CoSocketOperationConnect,
+    CoSocketOperationReadToLength,
+    CoSocketOperationReadToData,
+    CoSocketOperationReadBuffer,
+    CoSocketOperationWrite,
+};
+
+/**
+ An asynchronous connect, read or write, queued on the socket's event loop.
+ */
+@interface CoSocketOperation : NSObject {
+@public
+    CoSocketOperationKind _kind;
+    NSUInteger _length;         // Read to length
+    NSData *_data;              // Separator, or data to write
+    CoSocketBufferReader _reader;   // Borrows the read-ahead buffer
+    NSMutableData *_received;   // Reads bigger than the buffer
+    NSUInteger _progress;       // Bytes written, or received into _received
+    uint64_t _scanned;          // Read to data, see takeBufferedDataToData:scanned:
+    NSTimeInterval _deadline;
+    CoTimer *_timer;
+    id _completion;
+    NSTimeInterval _startTime;      // For the slow operation log
+    NSTimeInterval _lookupTime;
+    BOOL _upgradeLoopback;          // Connect: ask a loopback server for a unix domain socket
+    BOOL _upgrading;                // Connect: the upgrade runs on an executor
+}
+@end
+
+@implementation CoSocketOperation
+
+- (instancetype)init
+{
+    if ((self = [super init])) {
+        _startTime = monotonic_time();
+    }
+    return self;
+}
+
+@end
+
+/**
+ Totals of one kind of blocking operation, for operationTimes.
+ */
+typedef struct {
+    const char *operation;      // __func__ of the method
+    NSUInteger count;
+    NSTimeInterval wallTime;
+    NSTimeInterval cpuTime;
+    NSTimeInterval blockedTime;
+} CoSocketOperationTimes;
+
+/**
+ Returns the length of the line or frame at the head of bytes, 0 if it isn't complete yet,
+ or NSNotFound if it can't ever fit the read buffer.
+ */
+typedef NSUInteger (^ CoSocketUnitMeasure)(const char *bytes, NSUInteger length);
+
+/**
+ Returns a read-only view of part of a batch, so the lines of a batch read share a single allocation.
+ Not an NSData subclass: GNUstep's NSData leaves its initializers to subclasses.
+ */
+static NSData *slice_of_batch(NSData *batch, NSRange range)
+{
+    void *bytes = (char *)batch.bytes + range.location;
+    
+    return [[NSData alloc] initWithBytesNoCopy:bytes length:range.length deallocator:^(void *sliceBytes, NSUInteger length) {
+        // The batch lives as long as its last slice
+        (void)batch;
+    }];
+}
+
+static inline pthread_mutex_t *lock_for_scope(pthread_mutex_t *mutex) { pthread_mutex_lock(mutex); return mutex; }
+static inline void unlock_scope(pthread_mutex_t **mutex) { pthread_mutex_unlock(*mutex); }
+
+// Holds the mutex until the enclosing scope is left, whichever way it is left
+#define CoSocketLockScope(mutex) \
+    __attribute__((cleanup(unlock_scope), unused)) pthread_mutex_t *scopedLock_ = lock_for_scope(mutex)
 
 
 @interface CoSocket () {
 @protected
-	void *_buffer;
+	void *_buffer;              // From the shared CoBufferPool, taken on the first read
 	long _size;
-    NSTimeInterval _timeout;    // select() may update the timeout argument
-    // to indicate how much time was left.
+    NSUInteger _bufferOffset;   // Read-ahead: bytes received but not read yet
+    NSUInteger _bufferLength;   // start at _bufferOffset in _buffer.
+    uint64_t _bufferConsumed;   // Stream offset of _bufferOffset
+    NSTimeInterval _timeout;    // Budget of a single connect, read or write,
+    // turned into a deadline when the operation starts.
     
     NSData * _connectInterface;
+    
+    // Reads hold the read lock and writes the write lock, so the heartbeat
+    // can tell whether it may touch the socket from the timer thread.
+    pthread_mutex_t _readLock;
+    pthread_mutex_t _writeLock;
+    
+    _Atomic(NSTimeInterval) _lastActivity;  // monotonic time of the last byte sent or received
+    _Atomic(NSTimeInterval) _lastReceived;  // monotonic time of the last byte received
+    
+    // Set under both locks, read by the timer thread too
+    _Atomic(NSTimeInterval) _heartbeatInterval;
+    NSData *_pingData;
+    CoSocketMessageFramer _framer;
+    NSUInteger _maxMissedHeartbeats;
+    _Atomic(NSTimeInterval) _lastPingSentAt;
+    _Atomic(NSUInteger) _pingsOutstanding;
+    _Atomic(BOOL) _heartbeatFailed;
+    
+    // Message boundaries found by the framer, so pongs are only taken out and pings only sent between messages
+    uint64_t _framedTo;         // Stream offset of the next received message, under the read lock
+    NSUInteger _heldLength;     // Received bytes after the end of _bufferLength, behind a message of unknown length
+    uint64_t _sendRemaining;    // Bytes of the message being written that weren't written yet, under the write lock
+    NSUInteger _pingSent;       // Bytes sent of a ping the socket took only part of, the rest goes before the next write
+    NSMutableData *_sendHeader; // Start of a message written in pieces too short for the framer
+    
+    // tryReadDataToData: picks up the scan where the last call for the same separator stopped, under the read lock
+    NSData *_trySeparator;
+    uint64_t _tryScanned;
+    
+    // Asynchronous operations, on the event loop's thread only
+    CoSocketOperation *_connectOperation;
+    NSMutableArray *_readOperations;
+    NSMutableArray *_writeOperations;
+    CoEventMask _awaitedEvents;     // Readiness the head operations wait for
+    int _watchedFD;
+    BOOL _retryScheduled;
+    BOOL _deallocating;
+    
+    id _contextCancellationToken;
+    
+    NSString *_remoteHost;      // Of the last connection, for the slow operation log
+    uint16_t _remotePort;
+    uint64_t _traceTrack;       // Numbers the socket in traces
+    
+    // Held while the descriptor is closed, so other threads can shut the connection down without
+    // hitting a descriptor that was closed and reused. The generation changes with every connect and disconnect.
+    pthread_mutex_t _closeLock;
+    uint64_t _connectionGeneration;
+    
+    // Time spent by each kind of blocking operation, see operationTimes
+    pthread_mutex_t _timesLock;
+    CoSocketOperationTimes _times[CoSocketMaxTimedOperations];
+    NSUInteger _timesCount;
 }
+
+@property (atomic, weak, readwrite) CoEventLoop *eventLoop;
+@property (atomic, strong) CoTimer *idleTimer;
+@property (atomic, strong) CoTimer *heartbeatTimer;
+@property (atomic, readwrite) NSTimeInterval heartbeatRoundTripTime;
+@property (atomic, readwrite) NSUInteger missedHeartbeats;
+@property (atomic, strong) CoSharedRing *sharedRing;    // Set under both locks, the I/O goes through it instead of the socket
+
 @end
 
+/**
+ What a blocking connect, read or write spent its time on. The I/O helpers add to the record of the
+ calling thread, so they needn't pass it around, and the heartbeat's I/O on the timer thread isn't counted.
+ With a trace recorder, they also trace each step.
+ */
+typedef struct {
+    __unsafe_unretained CoSocket *socket;   // nil when not recording, e.g. within an outer operation
+    const char *operation;
+    NSError *__autoreleasing *errPtr;
+    __unsafe_unretained NSString *host;     // Of a connect, before there is a peer
+    uint16_t port;
+    void *recorder;                         // Retained CoTraceRecorder, or NULL
+    uint64_t track;
+    NSTimeInterval start;
+    NSTimeInterval cpuStart;                // Of the calling thread
+    NSTimeInterval lookupTime;
+    NSTimeInterval handshakeTime;
+    NSTimeInterval waitTime;
+    NSUInteger bytes;
+    NSUInteger receiveCount;
+    NSUInteger sendCount;
+} CoSocketOperationStats;
+
+static __thread CoSocketOperationStats *current_stats;
+
+static uint64_t last_trace_track;
+
+/**
+ The start of a step to be recorded, or 0 when nothing is recorded, to spare the clock.
+ */
+static inline NSTimeInterval stats_clock(void)
+{
+    return current_stats ? monotonic_time() : 0;
+}
+
+static inline void trace_step(const char *name, NSTimeInterval start, NSTimeInterval end, const char *argument, int64_t value)
+{
+    if (current_stats->recorder) {
+        [(__bridge CoTraceRecorder *)current_stats->recorder recordSpan:name track:current_stats->track start:start end:end argument:argument value:value];
+    }
+}
+
+static inline void record_receive(ssize_t received, NSTimeInterval start)
+{
+    if (current_stats) {
+        current_stats->receiveCount++;
+        if (received > 0) current_stats->bytes += received;
+        trace_step("recv", start, monotonic_time(), "bytes", received);
+    }
+}
+
+static inline void record_send(ssize_t sent, NSTimeInterval start)
+{
+    if (current_stats) {
+        current_stats->sendCount++;
+        if (sent > 0) current_stats->bytes += sent;
+        trace_step("send", start, monotonic_time(), "bytes", sent);
+    }
+}
+
+static inline void record_lookup(NSTimeInterval start)
+{
+    if (current_stats) {
+        NSTimeInterval end = monotonic_time();
+        current_stats->lookupTime += end - start;
+        trace_step("lookup", start, end, NULL, 0);
+    }
+}
+
+static inline void record_handshake(NSTimeInterval start)
+{
+    if (current_stats) {
+        NSTimeInterval end = monotonic_time();
+        current_stats->handshakeTime += end - start;
+        trace_step("handshake", start, end, NULL, 0);
+    }
+}
+
+static inline void record_wait(short events, NSTimeInterval start)
+{
+    if (current_stats) {
+        NSTimeInterval end = monotonic_time();
+        current_stats->waitTime += end - start;
+        trace_step(events == POLLIN ? "wait readable" : events == POLLOUT ? "wait writable" : "wait connected", start, end, NULL, 0);
+    }
+}
+
+static void finish_stats(CoSocketOperationStats *stats);
+
+// Records the enclosing method, unless it runs within another recorded operation
+#define CoSocketStatsScope(errorPtr) \
+    __attribute__((cleanup(finish_stats), unused)) CoSocketOperationStats scopedStats_ = { 0 }; \
+    [self beginStats:&scopedStats_ operation:__func__ error:(errorPtr)]
+
 
 @implementation CoSocket
 
@@ -92,21 +401,42 @@ static int connect_timeout(int sockfd, const struct sockaddr *address, socklen_t
 {
 	if ((self = [super init])) {
 		_socketFD = SOCKET_NULL;
-		_size = CoTCPSocketBufferSize;
-		_buffer = malloc(_size);
+		_size = [CoBufferPool sharedPool].bufferSize; // 64K
+		_buffer = NULL;
         _timeout = 0;
         
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+        pthread_mutex_init(&_readLock, &attr);
+        pthread_mutex_init(&_writeLock, &attr);
+        pthread_mutexattr_destroy(&attr);
+        pthread_mutex_init(&_timesLock, NULL);
+        pthread_mutex_init(&_closeLock, NULL);
+        
+        _readOperations = [NSMutableArray array];
+        _writeOperations = [NSMutableArray array];
+        _watchedFD = SOCKET_NULL;
+        
         self.IPv4Enabled = YES;
         self.IPv6Enabled = YES;
         self.IPv4PreferredOverIPv6 = YES;
+        self.slowOperationLog = [CoSlowOperationLog sharedLog];
+        _traceTrack = __atomic_add_fetch(&last_trace_track, 1, __ATOMIC_RELAXED);
 	}
 	return self;
 }
 
 - (void)dealloc {
+    _deallocating = YES;
+    [_context removeCancellationHandler:_contextCancellationToken];
     [self disconnect];
     _socketFD = SOCKET_NULL;
-	free(_buffer);
+	[[CoBufferPool sharedPool] releaseBuffer:_buffer];
+    pthread_mutex_destroy(&_readLock);
+    pthread_mutex_destroy(&_writeLock);
+    pthread_mutex_destroy(&_timesLock);
+    pthread_mutex_destroy(&_closeLock);
 }
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////
 #pragma mark Errors
@@ -128,7 +458,7 @@ static int connect_timeout(int sockfd, const struct sockaddr *address, socklen_t
                                NSLocalizedFailureReasonErrorKey : reason,
                                };
     
-    return [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:userInfo];
+    return [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:[self userInfoWithTraceTag:userInfo]];
 }
 
 - (NSError *)errnoError
@@ -138,14 +468,69 @@ static int connect_timeout(int sockfd, const struct sockaddr *address, socklen_t
                                NSLocalizedDescriptionKey : errMsg,
                                };
     
-    return [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:userInfo];
+    return [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:[self userInfoWithTraceTag:userInfo]];
 }
 
 - (NSError *)otherError:(NSString *)errMsg
 {
     NSDictionary *userInfo = [NSDictionary dictionaryWithObject:errMsg forKey:NSLocalizedDescriptionKey];
     
-    return [NSError errorWithDomain:CoSocketErrorDomain code:8 userInfo:userInfo];
+    return [NSError errorWithDomain:CoSocketErrorDomain code:8 userInfo:[self userInfoWithTraceTag:userInfo]];
+}
+
+/**
+ Tags errors with the trace tag of the operation context, so the request they belong to can be found.
+ */
+- (NSDictionary *)userInfoWithTraceTag:(NSDictionary *)userInfo
+{
+    NSString *traceTag = self.context.traceTag;
+    
+    if (!traceTag) {
+        return userInfo;
+    }
+    
+    NSMutableDictionary *tagged = [userInfo mutableCopy];
+    tagged[CoOperationTraceTagKey] = traceTag;
+    return tagged;
+}
+
+/**
+ The error for an I/O that failed because the connection was shut down under it, by the heartbeat
+ or a cancelled context, or nil if it wasn't.
+ */
+- (NSError *)interruptionError
+{
+    if (atomic_load(&_heartbeatFailed)) {
+        return [self heartbeatError];
+    }
+    
+    return [self cancellationError];
+}
+
+- (NSError *)cancellationError
+{
+    CoOperationContext *context = self.context;
+    
+    return context.isCancelled ? context.error : nil;
+}
+
+/**
+ Closes a connection being set up if the context was cancelled. A cancel before the socket existed,
+ or before connect() started on it, had nothing to shut down, so the connect would wait out its timeout.
+ 
+ @return YES if it was cancelled, with *errPtr set.
+ */
+- (BOOL)failIfCancelled:(NSError **)errPtr
+{
+    NSError *contextError = [self cancellationError];
+    
+    if (!contextError) {
+        return NO;
+    }
+    
+    if (errPtr) *errPtr = contextError;
+    [self disconnect];
+    return YES;
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -154,6 +539,13 @@ static int connect_timeout(int sockfd, const struct sockaddr *address, socklen_t
 
 - (BOOL)preConnectWithInterface:(NSString *)interface error:(NSError **)errPtr
 {
+    NSError *contextError = self.context.error;
+    
+    if (contextError) { // Nothing to do for a request that's over
+        if (errPtr) *errPtr = contextError;
+        return NO;
+    }
+    
     if ([self isConnected]) { // Must be disconnected
         if (errPtr) {
             *errPtr = [self otherError:@"Attempting to connect while connected or accepting connections. Disconnect first."];
@@ -210,7 +602,12 @@ static int connect_timeout(int sockfd, const struct sockaddr *address, socklen_t
 }
 
 
-- (BOOL)connectWithAddress4:(NSData *)address4 address6:(NSData *)address6 error:(NSError **)errPtr
+/**
+ Creates and sets up the socket for whichever of the addresses is preferred, without connecting it.
+ 
+ @return The address to connect to, or nil on error.
+ */
+- (NSData *)openSocketWithAddress4:(NSData *)address4 address6:(NSData *)address6 error:(NSError **)errPtr
 {
     // Determine socket type
     BOOL useIPv4 = (self.isIPv4Enabled && ( (self.isIPv4PreferredOverIPv6 && address4) || (address6 == nil) ) );
@@ -218,22 +615,42 @@ static int connect_timeout(int sockfd, const struct sockaddr *address, socklen_t
     // Create the socket
     
     NSData *address;
+    int family;
     
     if (useIPv4) {
-        _socketFD = socket(AF_INET, SOCK_STREAM, 0);
+        family = AF_INET;
         address = address4;
         if (_logDebug) _logDebug(@"Create socket with IPv4 address family");
     } else {
-        _socketFD = socket(AF_INET6, SOCK_STREAM, 0);
+        family = AF_INET6;
         address = address6;
         if (_logDebug) _logDebug(@"Create socket with IPv6 address family");
     }
     
+    int protocol = 0;
+    
+    if (self.isMultipathEnabled) {
+#ifdef IPPROTO_MPTCP
+        protocol = IPPROTO_MPTCP;
+#else
+        if (_logDebug) _logDebug(@"Multipath TCP is not available through BSD sockets on this platform, use TCP");
+#endif
+    }
+    
+    _socketFD = create_socket(family, SOCK_STREAM, protocol);
+    
+    if (_socketFD == SOCKET_NULL && protocol != 0 &&
+        (errno == EPROTONOSUPPORT || errno == EINVAL || errno == ENOPROTOOPT)) {
+        // Kernel built without MPTCP, or net.mptcp.enabled=0
+        if (_logDebug) _logDebug(@"Multipath TCP is not supported by the kernel, fall back to TCP");
+        _socketFD = create_socket(family, SOCK_STREAM, 0);
+    }
+    
     if (_socketFD == SOCKET_NULL) {
         if (errPtr)
             *errPtr = [self errnoErrorWithReason:@"Error in socket() function"];
         
-        return NO;
+        return nil;
     }
     
     // Bind the socket to the desired interface (if needed)
@@ -253,7 +670,8 @@ static int connect_timeout(int sockfd, const struct sockaddr *address, socklen_t
             if (errPtr)
                 *errPtr = [self errnoErrorWithReason:@"Error in bind() function"];
             
-            return NO;
+            [self disconnect];
+            return nil;
         }
         
         if (_logDebug) _logDebug(@"Bound to specified interface");
@@ -266,29 +684,49 @@ static int connect_timeout(int sockfd, const struct sockaddr *address, socklen_t
         if (_logDebug) _logDebug(@"Failed to set TCP_NODELAY");
     }
     
+#ifdef SO_NOSIGPIPE
     // Instead of receiving a SIGPIPE signal, have write() return an error.
+    // Where SO_NOSIGPIPE doesn't exist every send() passes MSG_NOSIGNAL instead.
     if (setsockopt(_socketFD, SOL_SOCKET, SO_NOSIGPIPE, &(int){1}, sizeof(int)) != 0) {
         if (errPtr) *errPtr = [self errnoError];
         [self disconnect];
-        return NO;
+        return nil;
     }
+#endif
     
-    // Set socket to non-blocking.
-    fcntl(_socketFD, F_SETFL, O_NONBLOCK);
+    return address;
+}
+
+- (BOOL)connectWithAddress4:(NSData *)address4 address6:(NSData *)address6 error:(NSError **)errPtr
+{
+    NSData *address = [self openSocketWithAddress4:address4 address6:address6 error:errPtr];
     
-    struct timeval timeout = get_timeval(_timeout);
-    struct timeval *timeoutPtr = NULL;
-    if (_timeout>0) {
-        timeoutPtr = &timeout;
+    if (!address) {
+        return NO;
+    }
+    
+    if ([self failIfCancelled:errPtr]) {
+        return NO;
     }
     
     // Connect the socket using the given timeout.
-    if (connect_timeout(_socketFD, (const struct sockaddr *)address.bytes, (socklen_t)address.length, timeoutPtr, _logDebug) < 0) {
-        if (errPtr) *errPtr = [self errnoError];
+    NSTimeInterval deadline = [self operationDeadline];
+    NSTimeInterval handshakeStart = stats_clock();
+    int connected = connect_timeout(_socketFD, (const struct sockaddr *)address.bytes, (socklen_t)address.length, deadline, _logDebug);
+    record_handshake(handshakeStart);
+    
+    if (connected < 0) {
+        if (errPtr) *errPtr = [self cancellationError] ?: [self errnoError];
         [self disconnect];
         return NO;
     }
     
+    if ([self failIfCancelled:errPtr]) {
+        return NO;
+    }
+    
+    [self didConnect];
+    
     return YES;
 }
 
@@ -311,6 +749,10 @@ static int connect_timeout(int sockfd, const struct sockaddr *address, socklen_t
           withTimeout:(NSTimeInterval)timeout
                 error:(NSError **)errPtr
 {
+    CoSocketStatsScope(errPtr);
+    scopedStats_.host = inHost;
+    scopedStats_.port = port;
+    
     if (_logDebug) _logDebug(@"Connect to %@:%d, with timeout %f", inHost, port, timeout);
     
     _timeout = timeout;
@@ -342,39 +784,28 @@ static int connect_timeout(int sockfd, const struct sockaddr *address, socklen_t
     
     NSString *hostCpy = [host copy];
     
-    NSMutableArray *addresses = [self.class lookupHost:hostCpy port:port error:errPtr];
+    NSError *lookupError = nil;
+    NSTimeInterval lookupStart = stats_clock();
+    NSMutableArray *addresses = [self.class lookupHost:hostCpy port:port error:&lookupError];
+    record_lookup(lookupStart);
+    
+    // getaddrinfo() can't be interrupted, but the time it took counts against the context
+    lookupError = lookupError ?: self.context.error;
     
-    if (errPtr && *errPtr) {
+    if (lookupError) {
+        if (errPtr) *errPtr = lookupError;
         [self disconnect];
         return NO;
     } else {
         NSData *address4 = nil;
         NSData *address6 = nil;
         
-        for (NSData *address in addresses) {
-            if (!address4 && [self.class isIPv4Address:address]) {
-                address4 = address;
-            } else if (!address6 && [self.class isIPv6Address:address]) {
-                address6 = address;
-            }
-        }
-        
-        // Check for problems
-        
-        if (!self.isIPv4Enabled && (address6 == nil)) {
-            NSString *msg = @"IPv4 has been disabled and DNS lookup found no IPv6 address.";
-            if (errPtr) *errPtr = [self otherError:msg];
+        if (![self pickAddress4:&address4 address6:&address6 fromAddresses:addresses error:errPtr]) {
             [self disconnect];
             return NO;
         }
         
-        if (!self.isIPv6Enabled && (address4 == nil)) {
-            NSString *msg = @"IPv6 has been disabled and DNS lookup found no IPv4 address.";
-            
-            if (errPtr) *errPtr = [self otherError:msg];
-            [self disconnect];
-            return NO;
-        }
+        BOOL upgrade = [self shouldUpgradeLoopbackAddress4:address4 address6:address6 interface:interface];
         
         // Start the normal connection process
         
@@ -382,338 +813,3271 @@ static int connect_timeout(int sockfd, const struct sockaddr *address, socklen_t
             [self disconnect];
             return NO;
         };
+        
+        // A same-host server may move the session to a unix domain socket
+        
+        if (upgrade) {
+            int unixFD = SOCKET_NULL;
+            
+            if (![self negotiateLoopbackUpgrade:&unixFD error:errPtr]) {
+                return NO;
+            }
+            
+            if (unixFD != SOCKET_NULL && ![self switchToUpgradedSocketFD:unixFD]) {
+                errno = EBADF;
+                if (errPtr) *errPtr = [self interruptionError] ?: [self errnoError];
+                return NO;
+            }
+        }
     }
     
     return YES;
 }
 
-- (BOOL)connectToAddress:(NSData *)remoteAddr error:(NSError **)errPtr
-{
-    return [self connectToAddress:remoteAddr viaInterface:nil withTimeout:-1 error:errPtr];
-}
-
-- (BOOL)connectToAddress:(NSData *)remoteAddr withTimeout:(NSTimeInterval)timeout error:(NSError **)errPtr
-{
-    return [self connectToAddress:remoteAddr viaInterface:nil withTimeout:timeout error:errPtr];
-}
-
-- (BOOL)connectToAddress:(NSData *)inRemoteAddr
-            viaInterface:(NSString *)inInterface
-             withTimeout:(NSTimeInterval)timeout
-                   error:(NSError **)errPtr
+/**
+ Picks the first IPv4 and the first IPv6 address of a lookup, and checks they fit the enabled protocols.
+ */
+- (BOOL)pickAddress4:(NSData **)address4Ptr address6:(NSData **)address6Ptr fromAddresses:(NSArray *)addresses error:(NSError **)errPtr
 {
-    _timeout = timeout;
-    
-    // Just in case immutable objects were passed
-    NSData *remoteAddr = [inRemoteAddr copy];
-    NSString *interface = [inInterface copy];
-    
-    // Check for problems with remoteAddr parameter
-    
     NSData *address4 = nil;
     NSData *address6 = nil;
     
-    if ([remoteAddr length] >= sizeof(struct sockaddr)) {
-        const struct sockaddr *sockaddr = (const struct sockaddr *)[remoteAddr bytes];
-        
-        if (sockaddr->sa_family == AF_INET) {
-            if ([remoteAddr length] == sizeof(struct sockaddr_in)) {
-                address4 = remoteAddr;
-            }
-        } else if (sockaddr->sa_family == AF_INET6) {
-            if ([remoteAddr length] == sizeof(struct sockaddr_in6)) {
-                address6 = remoteAddr;
-            }
+    for (NSData *address in addresses) {
+        if (!address4 && [self.class isIPv4Address:address]) {
+            address4 = address;
+        } else if (!address6 && [self.class isIPv6Address:address]) {
+            address6 = address;
         }
     }
     
-    if ((address4 == nil) && (address6 == nil)) {
-        if (errPtr) *errPtr = [self otherError:@"A valid IPv4 or IPv6 address was not given"];
-        
-        return NO;
-    }
+    // Check for problems
     
-    if (!self.isIPv4Enabled && (address4 != nil)) {
-        if (errPtr) *errPtr = [self otherError:@"IPv4 has been disabled and an IPv4 address was passed."];
-        
+    if (!self.isIPv4Enabled && (address6 == nil)) {
+        NSString *msg = @"IPv4 has been disabled and DNS lookup found no IPv6 address.";
+        if (errPtr) *errPtr = [self otherError:msg];
         return NO;
     }
     
-    if (!self.isIPv6Enabled && (address6 != nil)) {
-        if (errPtr) *errPtr = [self otherError:@"IPv6 has been disabled and an IPv6 address was passed."];
+    if (!self.isIPv6Enabled && (address4 == nil)) {
+        NSString *msg = @"IPv6 has been disabled and DNS lookup found no IPv4 address.";
         
+        if (errPtr) *errPtr = [self otherError:msg];
         return NO;
     }
     
-    // Run through standard pre-connect checks
+    *address4Ptr = address4;
+    *address6Ptr = address6;
     
-    if (![self preConnectWithInterface:interface error:errPtr]) {
+    return YES;
+}
+
+/**
+ Whether to try the loopback upgrade: it's enabled, no interface was given and the address
+ connectWithAddress4:address6:error: will pick is a loopback address.
+ */
+- (BOOL)shouldUpgradeLoopbackAddress4:(NSData *)address4 address6:(NSData *)address6 interface:(NSString *)interface
+{
+    // An explicit interface means the caller wants TCP over that interface
+    if (!self.isLoopbackUpgradeEnabled || interface) {
         return NO;
     }
     
-    // We've made it past all the checks.
-    // It's time to start the connection process.
-    
-    if (![self connectWithAddress4:address4 address6:address6 error:errPtr]) {
-        return NO;
-    }
+    BOOL useIPv4 = (self.isIPv4Enabled && ( (self.isIPv4PreferredOverIPv6 && address4) || (address6 == nil) ) );
     
-    return YES;
+    return [self.class isLoopbackAddress:useIPv4 ? address4 : address6];
 }
 
 /**
- Shutdown the connection to the remote host.
- 
- Close vs shutdown socket:
- 
- shutdown is a flexible way to block communication in one or both directions. When the second parameter is SHUT_RDWR, it will block both sending and receiving (like close). However, close is the way to actually destroy a socket.
- 
- With shutdown, you will still be able to receive pending data the peer already sent (thanks to Joey Adams for noting this).
- 
- Big difference between shutdown and close on a socket is the behavior when the socket is shared by other processes. A shutdown() affects all copies of the socket while close() affects only the file descriptor in one process.
- 
- Someone also had success under linux using shutdown() from one pthread to force another pthread currently blocked in connect() to abort early.
+ Asks the server over the TCP connection just made for a unix domain socket, connects to it and presents
+ the server's token there. It blocks, asynchronous connects run it on an executor.
  
- Under other OSes (OSX at least), I found calling close() was enough to get connect() fail.
+ @param unixFDPtr Set to the connected unix domain socket, or to SOCKET_NULL to go on over TCP:
+                  the server declined, or its socket couldn't be connected. The upgrade is an optimization,
+                  it must never make a working TCP service unreachable.
+ @return NO if the handshake itself failed, in which case the connection is closed.
  */
-- (void)disconnect
+- (BOOL)negotiateLoopbackUpgrade:(int *)unixFDPtr error:(NSError **)errPtr
 {
-    if (_socketFD != SOCKET_NULL) {
-        shutdown(_socketFD, SHUT_RDWR);
-        close(_socketFD);
+    *unixFDPtr = SOCKET_NULL;
+    
+    if (![self writeData:[NSData dataWithBytes:CoSocketUpgradeRequest length:CoSocketUpgradeMagicLength] error:errPtr]) {
+        return NO;
     }
-}
-
+    
+    NSData *reply = [self readDataToLength:CoSocketUpgradeMagicLength + 2 error:errPtr];
+    
+    if (!reply) {
+        return NO;
+    }
+    
+    const uint8_t *bytes = reply.bytes;
+    size_t pathLength = (bytes[CoSocketUpgradeMagicLength] << 8) | bytes[CoSocketUpgradeMagicLength + 1];
+    
+    if (memcmp(bytes, CoSocketUpgradeReply, CoSocketUpgradeMagicLength) != 0 || pathLength >= sizeof(((struct sockaddr_un *)0)->sun_path)) {
+        errno = EPROTO;
+        if (errPtr) *errPtr = [self errnoErrorWithReason:@"Server answered the loopback upgrade request with garbage"];
+        [self disconnect];
+        return NO;
+    }
+    
+    if (pathLength == 0) {
+        if (_logDebug) _logDebug(@"Loopback upgrade declined by the server, stay on TCP");
+        return YES;
+    }
+    
+    NSData *advert = [self readDataToLength:pathLength + CoSocketUpgradeTokenLength error:errPtr];
+    
+    if (!advert) {
+        return NO;
+    }
+    
+    NSString *path = [[NSFileManager defaultManager] stringWithFileSystemRepresentation:advert.bytes length:pathLength];
+    NSMutableData *hello = [NSMutableData dataWithBytes:CoSocketUpgradeHello length:CoSocketUpgradeMagicLength];
+    [hello appendData:[advert subdataWithRange:NSMakeRange(pathLength, CoSocketUpgradeTokenLength)]];
+    
+    if (_bufferLength + _heldLength > 0) {
+        // The server has already started the session on TCP, what it sent would be lost with the connection
+        if (_logDebug) _logDebug(@"Server sent data after its loopback upgrade answer, stay on TCP");
+        return YES;
+    }
+    
+    struct sockaddr_un address;
+    
+    if (![self getUnixAddress:&address path:path error:NULL]) {
+        return YES;
+    }
+    
+    int unixFD = create_socket(AF_UNIX, SOCK_STREAM, 0);
+    
+#ifdef SO_NOSIGPIPE
+    if (unixFD != SOCKET_NULL) {
+        setsockopt(unixFD, SOL_SOCKET, SO_NOSIGPIPE, &(int){1}, sizeof(int));
+    }
+#endif
+    
+    // A fresh unix socket takes the few bytes of the hello at once
+    if (unixFD == SOCKET_NULL ||
+        connect_timeout(unixFD, (const struct sockaddr *)&address, (socklen_t)sizeof(address), [self operationDeadline], _logDebug) < 0 ||
+        send(unixFD, hello.bytes, hello.length, CoSocketSendFlags) != (ssize_t)hello.length) {
+        if (_logDebug) _logDebug(@"Loopback upgrade to %@ failed, stay on TCP: %s", path, strerror(errno));
+        
+        if (unixFD != SOCKET_NULL) {
+            close(unixFD);
+        }
+        return YES;
+    }
+    
+    *unixFDPtr = unixFD;
+    
+    return YES;
+}
+
+/**
+ Moves the session to the unix domain socket of a loopback upgrade and closes the TCP connection.
+ 
+ @return NO if the socket was disconnected meanwhile, unixFD is closed then.
+ */
+- (BOOL)switchToUpgradedSocketFD:(int)unixFD
+{
+    pthread_mutex_lock(&_closeLock);
+    
+    int tcpFD = _socketFD;
+    
+    if (tcpFD != SOCKET_NULL) {
+        _socketFD = unixFD;
+    }
+    
+    pthread_mutex_unlock(&_closeLock);
+    
+    if (tcpFD == SOCKET_NULL) {
+        close(unixFD);
+        return NO;
+    }
+    
+    close(tcpFD);
+    [self didConnect];
+    
+    if (_logDebug) _logDebug(@"Loopback connection upgraded to unix socket %@", self.connectedHost);
+    
+    return YES;
+}
+
+- (NSData *)answerLoopbackUpgradeWithPath:(NSString *)path error:(NSError **)errPtr
+{
+    NSData *request = [self readDataToLength:CoSocketUpgradeMagicLength error:errPtr];
+    
+    if (!request) {
+        return nil;
+    }
+    
+    if (memcmp(request.bytes, CoSocketUpgradeRequest, CoSocketUpgradeMagicLength) != 0) {
+        errno = EPROTO;
+        if (errPtr) *errPtr = [self errnoErrorWithReason:@"Connection doesn't start with a loopback upgrade request"];
+        [self disconnect];
+        return nil;
+    }
+    
+    const char *fsPath = path.length ? path.fileSystemRepresentation : "";
+    size_t pathLength = strlen(fsPath);
+    
+    if (pathLength >= sizeof(((struct sockaddr_un *)0)->sun_path)) {
+        if (errPtr) *errPtr = [self otherError:@"Unix socket path is too long."];
+        [self disconnect];
+        return nil;
+    }
+    
+    uint8_t token[CoSocketUpgradeTokenLength];
+    [[NSUUID UUID] getUUIDBytes:token];
+    
+    NSMutableData *reply = [NSMutableData dataWithBytes:CoSocketUpgradeReply length:CoSocketUpgradeMagicLength];
+    uint8_t length[2] = { (uint8_t)(pathLength >> 8), (uint8_t)pathLength };
+    [reply appendBytes:length length:sizeof(length)];
+    
+    if (pathLength) {
+        [reply appendBytes:fsPath length:pathLength];
+        [reply appendBytes:token length:CoSocketUpgradeTokenLength];
+    }
+    
+    if (![self writeData:reply error:errPtr]) {
+        return nil;
+    }
+    
+    return pathLength ? [NSData dataWithBytes:token length:CoSocketUpgradeTokenLength] : [NSData data];
+}
+
+- (NSData *)readLoopbackUpgradeTokenWithError:(NSError **)errPtr
+{
+    NSData *hello = [self readDataToLength:CoSocketUpgradeMagicLength + CoSocketUpgradeTokenLength error:errPtr];
+    
+    if (!hello) {
+        return nil;
+    }
+    
+    if (memcmp(hello.bytes, CoSocketUpgradeHello, CoSocketUpgradeMagicLength) != 0) {
+        errno = EPROTO;
+        if (errPtr) *errPtr = [self errnoErrorWithReason:@"Connection doesn't start with a loopback upgrade token"];
+        [self disconnect];
+        return nil;
+    }
+    
+    return [hello subdataWithRange:NSMakeRange(CoSocketUpgradeMagicLength, CoSocketUpgradeTokenLength)];
+}
+
+- (BOOL)connectToAddress:(NSData *)remoteAddr error:(NSError **)errPtr
+{
+    return [self connectToAddress:remoteAddr viaInterface:nil withTimeout:-1 error:errPtr];
+}
+
+- (BOOL)connectToAddress:(NSData *)remoteAddr withTimeout:(NSTimeInterval)timeout error:(NSError **)errPtr
+{
+    return [self connectToAddress:remoteAddr viaInterface:nil withTimeout:timeout error:errPtr];
+}
+
+- (BOOL)connectToAddress:(NSData *)inRemoteAddr
+            viaInterface:(NSString *)inInterface
+             withTimeout:(NSTimeInterval)timeout
+                   error:(NSError **)errPtr
+{
+    CoSocketStatsScope(errPtr);
+    
+    _timeout = timeout;
+    
+    // Just in case immutable objects were passed
+    NSData *remoteAddr = [inRemoteAddr copy];
+    NSString *interface = [inInterface copy];
+    
+    // Check for problems with remoteAddr parameter
+    
+    NSData *address4 = nil;
+    NSData *address6 = nil;
+    
+    if ([remoteAddr length] >= sizeof(struct sockaddr)) {
+        const struct sockaddr *sockaddr = (const struct sockaddr *)[remoteAddr bytes];
+        
+        if (sockaddr->sa_family == AF_INET) {
+            if ([remoteAddr length] == sizeof(struct sockaddr_in)) {
+                address4 = remoteAddr;
+            }
+        } else if (sockaddr->sa_family == AF_INET6) {
+            if ([remoteAddr length] == sizeof(struct sockaddr_in6)) {
+                address6 = remoteAddr;
+            }
+        }
+    }
+    
+    if ((address4 == nil) && (address6 == nil)) {
+        if (errPtr) *errPtr = [self otherError:@"A valid IPv4 or IPv6 address was not given"];
+        
+        return NO;
+    }
+    
+    if (!self.isIPv4Enabled && (address4 != nil)) {
+        if (errPtr) *errPtr = [self otherError:@"IPv4 has been disabled and an IPv4 address was passed."];
+        
+        return NO;
+    }
+    
+    if (!self.isIPv6Enabled && (address6 != nil)) {
+        if (errPtr) *errPtr = [self otherError:@"IPv6 has been disabled and an IPv6 address was passed."];
+        
+        return NO;
+    }
+    
+    // Run through standard pre-connect checks
+    
+    if (![self preConnectWithInterface:interface error:errPtr]) {
+        return NO;
+    }
+    
+    // We've made it past all the checks.
+    // It's time to start the connection process.
+    
+    if (![self connectWithAddress4:address4 address6:address6 error:errPtr]) {
+        return NO;
+    }
+    
+    return YES;
+}
+
+- (BOOL)connectToUnixSocketAtPath:(NSString *)path error:(NSError **)errPtr
+{
+    return [self connectToUnixSocketAtPath:path withTimeout:-1 error:errPtr];
+}
+
+- (BOOL)connectToUnixSocketAtPath:(NSString *)path withTimeout:(NSTimeInterval)timeout error:(NSError **)errPtr
+{
+    if (_logDebug) _logDebug(@"Connect to unix socket %@, with timeout %f", path, timeout);
+    
+    _timeout = timeout;
+    
+    return [self connectUnixSocketAtPath:[path copy] type:SOCK_STREAM error:errPtr];
+}
+
+- (BOOL)connectToSeqPacketSocketAtPath:(NSString *)path withTimeout:(NSTimeInterval)timeout error:(NSError **)errPtr
+{
+    if (_logDebug) _logDebug(@"Connect to seqpacket socket %@, with timeout %f", path, timeout);
+    
+    _timeout = timeout;
+    
+    return [self connectUnixSocketAtPath:[path copy] type:SOCK_SEQPACKET error:errPtr];
+}
+
+- (BOOL)adoptConnectedSocketFD:(int)socketFD error:(NSError **)errPtr
+{
+    if ([self isConnected]) { // Must be disconnected
+        if (errPtr) *errPtr = [self otherError:@"Attempting to connect while connected or accepting connections. Disconnect first."];
+        return NO;
+    }
+    
+    int flags = fcntl(socketFD, F_GETFL);
+    
+    if (flags == -1 || fcntl(socketFD, F_SETFL, flags | O_NONBLOCK) == -1 || fcntl(socketFD, F_SETFD, FD_CLOEXEC) == -1) {
+        if (errPtr) *errPtr = [self errnoError];
+        return NO;
+    }
+    
+#ifdef SO_NOSIGPIPE
+    if (setsockopt(socketFD, SOL_SOCKET, SO_NOSIGPIPE, &(int){1}, sizeof(int)) != 0) {
+        if (errPtr) *errPtr = [self errnoError];
+        return NO;
+    }
+#endif
+    
+    if (_logDebug) _logDebug(@"Adopt connected socket %d", socketFD);
+    
+    _socketFD = socketFD;
+    [self didConnect];
+    
+    return YES;
+}
+
+- (BOOL)connectUnixSocketAtPath:(NSString *)path type:(int)type error:(NSError **)errPtr
+{
+    CoSocketStatsScope(errPtr);
+    scopedStats_.host = path;
+    
+    if (!path.length) {
+        if (errPtr) *errPtr = [self otherError:@"Invalid path parameter (nil or \"\"). Should be the file system path of a unix domain socket."];
+        return NO;
+    }
+    
+    if ([self isConnected]) { // Must be disconnected
+        if (errPtr) *errPtr = [self otherError:@"Attempting to connect while connected or accepting connections. Disconnect first."];
+        return NO;
+    }
+    
+    struct sockaddr_un nativeAddr;
+    
+    if (![self getUnixAddress:&nativeAddr path:path error:errPtr]) {
+        return NO;
+    }
+    
+    _socketFD = create_socket(AF_UNIX, type, 0);
+    
+    if (_socketFD == SOCKET_NULL) {
+        if (errPtr) *errPtr = [self errnoErrorWithReason:@"Error in socket() function"];
+        return NO;
+    }
+    
+    if (_logDebug) _logDebug(@"Create socket with unix address family");
+    
+#ifdef SO_NOSIGPIPE
+    if (setsockopt(_socketFD, SOL_SOCKET, SO_NOSIGPIPE, &(int){1}, sizeof(int)) != 0) {
+        if (errPtr) *errPtr = [self errnoError];
+        [self disconnect];
+        return NO;
+    }
+#endif
+    
+    if ([self failIfCancelled:errPtr]) {
+        return NO;
+    }
+    
+    NSTimeInterval deadline = [self operationDeadline];
+    NSTimeInterval handshakeStart = stats_clock();
+    int connected = connect_timeout(_socketFD, (const struct sockaddr *)&nativeAddr, (socklen_t)sizeof(nativeAddr), deadline, _logDebug);
+    record_handshake(handshakeStart);
+    
+    if (connected < 0) {
+        if (errPtr) *errPtr = [self cancellationError] ?: [self errnoError];
+        [self disconnect];
+        return NO;
+    }
+    
+    if ([self failIfCancelled:errPtr]) {
+        return NO;
+    }
+    
+    [self didConnect];
+    
+    return YES;
+}
+
+/**
+ Fills in the address of the unix domain socket at path.
+ */
+- (BOOL)getUnixAddress:(struct sockaddr_un *)nativeAddr path:(NSString *)path error:(NSError **)errPtr
+{
+    memset(nativeAddr, 0, sizeof(*nativeAddr));
+    
+    const char *fsPath = path.fileSystemRepresentation;
+    if (strlen(fsPath) >= sizeof(nativeAddr->sun_path)) {
+        if (errPtr) *errPtr = [self otherError:@"Unix socket path is too long."];
+        return NO;
+    }
+    
+#ifdef SIN6_LEN
+    nativeAddr->sun_len    = sizeof(*nativeAddr);
+#endif
+    nativeAddr->sun_family = AF_UNIX;
+    strncpy(nativeAddr->sun_path, fsPath, sizeof(nativeAddr->sun_path) - 1);
+    
+    return YES;
+}
+
+/**
+ Sets up per-connection state once any kind of connection is established.
+ */
+- (void)didConnect
+{
+    _remoteHost = self.connectedHost;
+    _remotePort = self.connectedPort;
+    
+    NSString *trackName = _remotePort ? [NSString stringWithFormat:@"socket %llu %@:%u", (unsigned long long)_traceTrack, _remoteHost, _remotePort]
+                                      : [NSString stringWithFormat:@"socket %llu %@", (unsigned long long)_traceTrack, _remoteHost];
+    [self.traceRecorder setName:trackName ofTrack:_traceTrack];
+    atomic_store(&_lastActivity, monotonic_time());
+    
+    pthread_mutex_lock(&_closeLock);
+    _connectionGeneration++;
+    pthread_mutex_unlock(&_closeLock);
+    
+    // A read or write left over from the last connection may still be on its way out, in the same order as startHeartbeat
+    pthread_mutex_lock(&_readLock);
+    pthread_mutex_lock(&_writeLock);
+    
+    // The connection may be served by a thread on another NUMA node than the last one,
+    // the next read takes a buffer local to the reading thread
+    [[CoBufferPool sharedPool] releaseBuffer:_buffer];
+    _buffer = NULL;
+    _bufferOffset = 0;
+    _bufferLength = 0;
+    _heldLength = 0;
+    _framedTo = _bufferConsumed;
+    _sendRemaining = 0;
+    _sendHeader.length = 0;
+    _pingSent = 0;
+    atomic_store(&_heartbeatFailed, NO);
+    
+    pthread_mutex_unlock(&_writeLock);
+    pthread_mutex_unlock(&_readLock);
+    
+    [self scheduleIdleTimerAfter:self.idleTimeout];
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Shared Memory
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (BOOL)offerSharedMemoryWithCapacity:(NSUInteger)capacity error:(NSError **)errPtr
+{
+    CoSocketStatsScope(errPtr);
+    
+    // Neither a read nor a write may run while the transport changes under it
+    pthread_mutex_lock(&_readLock);
+    pthread_mutex_lock(&_writeLock);
+    
+    BOOL offered = [self negotiateSharedMemoryWithCapacity:capacity ?: CoSocketSharedMemoryCapacity error:errPtr];
+    
+    pthread_mutex_unlock(&_writeLock);
+    pthread_mutex_unlock(&_readLock);
+    
+    return offered;
+}
+
+- (BOOL)acceptSharedMemoryWithError:(NSError **)errPtr
+{
+    CoSocketStatsScope(errPtr);
+    
+    pthread_mutex_lock(&_readLock);
+    pthread_mutex_lock(&_writeLock);
+    
+    BOOL accepted = [self negotiateSharedMemoryWithCapacity:0 error:errPtr];
+    
+    pthread_mutex_unlock(&_writeLock);
+    pthread_mutex_unlock(&_readLock);
+    
+    return accepted;
+}
+
+- (BOOL)isSharedMemory
+{
+    return self.sharedRing != nil;
+}
+
+/**
+ Both sides of the shared memory handshake, the offering side with a capacity and the accepting side with zero.
+ Must be called with both locks held.
+ 
+ The offer carries the ring's descriptors (SCM_RIGHTS), the answer is a single byte. Failing to set up
+ the ring leaves the connection as it was, only a broken handshake closes it.
+ */
+- (BOOL)negotiateSharedMemoryWithCapacity:(NSUInteger)capacity error:(NSError **)errPtr
+{
+    int type = 0;
+    struct sockaddr_storage address;
+    socklen_t length = sizeof(address);
+    
+    if (_socketFD == SOCKET_NULL ||
+        getsockopt(_socketFD, SOL_SOCKET, SO_TYPE, &type, &(socklen_t){sizeof(type)}) != 0 || type != SOCK_STREAM ||
+        getsockname(_socketFD, (struct sockaddr *)&address, &length) != 0 || address.ss_family != AF_UNIX) {
+        if (errPtr) *errPtr = [self otherError:@"Shared memory needs a connected unix domain stream socket."];
+        return NO;
+    }
+    
+    if (self.sharedRing || _bufferLength + _heldLength > 0) {
+        if (errPtr) *errPtr = [self otherError:@"Shared memory must be set up before any other data is exchanged."];
+        return NO;
+    }
+    
+    NSTimeInterval deadline = [self operationDeadline];
+    CoSharedRing *ring = nil;
+    uint8_t offer[CoSocketSharedMemoryOfferLength];
+    int descriptors[CoSharedRingDescriptorCount];
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(descriptors))];
+    } control;
+    
+    struct iovec iov = { .iov_base = offer, .iov_len = sizeof(offer) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.space;
+    msg.msg_controllen = sizeof(control.space);
+    
+    if (capacity) {
+        ring = [[CoSharedRing alloc] initWithCapacity:capacity anchorSocketFD:_socketFD];
+        
+        if (!ring) {
+            if (errPtr) *errPtr = [self errnoErrorWithReason:@"Failed to create the shared memory"];
+            return NO;
+        }
+        
+        uint64_t announced = ring.capacity;
+        memcpy(offer, CoSocketSharedMemoryOffer, 8);
+        for (int i = 0; i < 8; i++) {
+            offer[8 + i] = (uint8_t)(announced >> (56 - 8 * i));
+        }
+        
+        [ring getPeerDescriptors:descriptors];
+        
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(descriptors));
+        memcpy(CMSG_DATA(cmsg), descriptors, sizeof(descriptors));
+        
+        if (![self transferSharedMemoryMessage:&msg events:POLLOUT before:deadline error:errPtr]) {
+            return NO;
+        }
+        
+        char answer = 0;
+        iov.iov_base = &answer;
+        iov.iov_len = 1;
+        msg.msg_control = NULL;
+        msg.msg_controllen = 0;
+        
+        if (![self transferSharedMemoryMessage:&msg events:POLLIN before:deadline error:errPtr]) {
+            return NO;
+        }
+        
+        if (answer != CoSocketSharedMemoryAccepted) {
+            errno = ENOTSUP;
+            if (errPtr) *errPtr = [self errnoErrorWithReason:@"Peer declined the shared memory"];
+            return NO;
+        }
+    } else {
+        if (![self transferSharedMemoryMessage:&msg events:POLLIN before:deadline error:errPtr]) {
+            return NO;
+        }
+        
+        // Descriptors that came along are closed whatever happens next
+        NSUInteger count = 0;
+        
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+                continue;
+            }
+            
+            for (size_t i = 0; i < (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int); i++) {
+                int fd;
+                memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                
+                if (count < CoSharedRingDescriptorCount) {
+                    descriptors[count++] = fd;
+                } else {
+                    close(fd);
+                }
+            }
+        }
+        
+        if (count != CoSharedRingDescriptorCount || (msg.msg_flags & MSG_CTRUNC) ||
+            memcmp(offer, CoSocketSharedMemoryOffer, 8) != 0) {
+            for (NSUInteger i = 0; i < count; i++) {
+                close(descriptors[i]);
+            }
+            
+            errno = EPROTO;
+            if (errPtr) *errPtr = [self errnoErrorWithReason:@"Connection doesn't start with a shared memory offer"];
+            [self disconnect];
+            return NO;
+        }
+        
+        uint64_t announced = 0;
+        for (int i = 0; i < 8; i++) {
+            announced = (announced << 8) | offer[8 + i];
+        }
+        
+        ring = [[CoSharedRing alloc] initWithPeerDescriptors:descriptors anchorSocketFD:_socketFD];
+        
+        if (ring && ring.capacity != announced) {
+            ring = nil;
+            errno = EINVAL;
+        }
+        
+        NSError *error = ring ? nil : [self errnoErrorWithReason:@"Failed to map the offered shared memory"];
+        char answer = ring ? CoSocketSharedMemoryAccepted : 'N';
+        iov.iov_base = &answer;
+        iov.iov_len = 1;
+        msg.msg_control = NULL;
+        msg.msg_controllen = 0;
+        
+        if (![self transferSharedMemoryMessage:&msg events:POLLOUT before:deadline error:errPtr]) {
+            return NO;
+        }
+        
+        if (!ring) {
+            if (errPtr) *errPtr = error;
+            return NO;
+        }
+    }
+    
+    self.sharedRing = ring;
+    
+    if (_logDebug) _logDebug(@"Connection switched to shared memory, %lu bytes per direction", (unsigned long)ring.capacity);
+    
+    return YES;
+}
+
+/**
+ Sends or receives (events POLLOUT or POLLIN) one handshake message, waiting for the socket.
+ Closes the connection if that fails. msg's single iovec is advanced over what was transferred.
+ */
+- (BOOL)transferSharedMemoryMessage:(struct msghdr *)msg events:(short)events before:(NSTimeInterval)deadline error:(NSError **)errPtr
+{
+    struct iovec *iov = msg->msg_iov;
+    struct msghdr *current = msg;
+    struct msghdr plain;
+    memset(&plain, 0, sizeof(plain));
+    plain.msg_iov = iov;
+    plain.msg_iovlen = 1;
+    
+    while (iov->iov_len > 0) {
+        int wait_result = wait_for_socket(_socketFD, events, deadline);
+        
+        if (wait_result == 0) {
+            errno = ETIMEDOUT;
+            if (errPtr) *errPtr = [self errnoErrorWithReason:@"Shared memory handshake timed out"];
+            [self disconnect];
+            return NO;
+        }
+        
+        ssize_t transferred = -1;
+        
+        if (wait_result > 0 && events == POLLOUT) {
+            transferred = sendmsg(_socketFD, current, CoSocketSendFlags);
+        } else if (wait_result > 0) {
+#ifdef MSG_CMSG_CLOEXEC
+            transferred = recvmsg(_socketFD, current, MSG_CMSG_CLOEXEC);
+#else
+            transferred = recvmsg(_socketFD, current, 0);
+#endif
+        }
+        
+        if (transferred < 0 && wait_result > 0 && (errno == EAGAIN || errno == EINTR)) {
+            continue;
+        }
+        
+        if (transferred <= 0) {
+            if (transferred == 0) {
+                errno = ECONNRESET;
+            }
+            
+            if (errPtr) *errPtr = [self interruptionError] ?: [self errnoErrorWithReason:@"Shared memory handshake failed"];
+            [self disconnect];
+            return NO;
+        }
+        
+        // The descriptors go with the first byte, msg keeps what was received with them
+        current = &plain;
+        
+        iov->iov_base = (char *)iov->iov_base + transferred;
+        iov->iov_len -= transferred;
+    }
+    
+    return YES;
+}
+
+/**
+ The I/O primitives of the read and write paths: the socket, or the shared memory ring once one was set up.
+ They behave like recv(), sendmsg() and wait_for_socket(), errors included.
+ */
+- (ssize_t)receiveBytes:(void *)bytes length:(size_t)length
+{
+    CoSharedRing *ring = self.sharedRing;
+    
+    return ring ? [ring receive:bytes length:length] : recv(_socketFD, bytes, length, 0);
+}
+
+- (ssize_t)sendVector:(const struct iovec *)iov count:(int)count
+{
+    CoSharedRing *ring = self.sharedRing;
+    
+    if (ring) {
+        return [ring sendIOVec:iov count:count];
+    }
+    
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec *)iov;
+    msg.msg_iovlen = count;
+    
+    return sendmsg(_socketFD, &msg, CoSocketSendFlags);
+}
+
+- (ssize_t)sendBytes:(const void *)bytes length:(size_t)length
+{
+    struct iovec iov = { .iov_base = (void *)bytes, .iov_len = length };
+    
+    return [self sendVector:&iov count:1];
+}
+
+- (int)waitForEvents:(short)events before:(NSTimeInterval)deadline
+{
+    CoSharedRing *ring = self.sharedRing;
+    int socketFD = _socketFD;
+    
+    if (!ring || socketFD == SOCKET_NULL) {
+        return wait_for_socket(socketFD, events, deadline);
+    }
+    
+    NSTimeInterval waitStart = stats_clock();
+    int result = [ring waitForEvents:events socketFD:socketFD before:deadline];
+    record_wait(events, waitStart);
+    
+    return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Operation Context
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+@synthesize context = _context;
+
+- (CoOperationContext *)context
+{
+    @synchronized(self) {
+        return _context;
+    }
+}
+
+- (void)setContext:(CoOperationContext *)context
+{
+    @synchronized(self) {
+        [_context removeCancellationHandler:_contextCancellationToken];
+        _context = context;
+        
+        __weak CoSocket *weakSelf = self;
+        _contextCancellationToken = [context addCancellationHandler:^{
+            [weakSelf contextWasCancelled];
+        }];
+    }
+}
+
+- (void)contextWasCancelled
+{
+    if (_logDebug) _logDebug(@"Operation context %@ cancelled, shut the connection down", self.context.traceTag ?: @"");
+    
+    // Like the idle timeout, wakes up whatever is blocked on the socket. Its error then says why.
+    // Checked under the close lock, the descriptor may be closed and reused by now.
+    // Without a socket yet, the connect notices the cancel itself, see failIfCancelled:.
+    [self shutdownConnectionOfGeneration:[self connectionGeneration]];
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Slow Operations and Tracing
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (void)beginStats:(CoSocketOperationStats *)stats operation:(const char *)operation error:(NSError *__autoreleasing *)errPtr
+{
+    CoTraceRecorder *recorder = self.traceRecorder;
+    
+    if (current_stats || (self.slowOperationThreshold <= 0 && !recorder && !self.isCPUTimeAccountingEnabled)) {
+        return;
+    }
+    
+    stats->socket = self;
+    stats->operation = operation;
+    stats->errPtr = errPtr;
+    stats->recorder = (__bridge_retained void *)recorder;
+    stats->track = _traceTrack;
+    stats->start = monotonic_time();
+    stats->cpuStart = thread_cpu_time();
+    current_stats = stats;
+}
+
+- (void)operationDidFinish:(CoSocketOperationStats *)stats
+{
+    NSTimeInterval end = monotonic_time();
+    NSTimeInterval duration = end - stats->start;
+    NSTimeInterval cpuTime = thread_cpu_time() - stats->cpuStart;
+    NSTimeInterval threshold = self.slowOperationThreshold;
+    NSError *error = stats->errPtr ? *stats->errPtr : nil;
+    CoTraceRecorder *recorder = (__bridge_transfer CoTraceRecorder *)stats->recorder;
+    
+    if (self.isCPUTimeAccountingEnabled) {
+        // getaddrinfo() mostly waits for the name server too
+        [self addTimesOfOperation:stats->operation wall:duration cpu:cpuTime blocked:stats->waitTime + stats->lookupTime];
+    }
+    
+    if (recorder) {
+        if (error.code == ETIMEDOUT) {
+            [recorder recordInstant:"timeout" track:stats->track argument:NULL value:0];
+        }
+        [recorder recordSpan:stats->operation track:stats->track start:stats->start end:end argument:"bytes" value:stats->bytes];
+    }
+    
+    if (threshold <= 0 || duration < threshold) {
+        return;
+    }
+    
+    CoSlowOperation *entry = [[CoSlowOperation alloc] init];
+    entry.operation = @(stats->operation);
+    entry.date = [NSDate dateWithTimeIntervalSinceNow:-duration];
+    entry.duration = duration;
+    entry.lookupTime = stats->lookupTime;
+    entry.handshakeTime = stats->handshakeTime;
+    entry.waitTime = stats->waitTime;
+    entry.cpuTime = cpuTime;
+    entry.bytes = stats->bytes;
+    entry.receiveCount = stats->receiveCount;
+    entry.sendCount = stats->sendCount;
+    entry.remoteHost = stats->host ?: _remoteHost;
+    entry.remotePort = stats->host ? stats->port : _remotePort;
+    entry.traceTag = self.context.traceTag;
+    entry.error = error;
+    
+    [self.slowOperationLog addOperation:entry];
+}
+
+static void finish_stats(CoSocketOperationStats *stats)
+{
+    if (!stats->socket) {
+        return;
+    }
+    
+    current_stats = NULL;
+    [stats->socket operationDidFinish:stats];
+}
+
+- (void)addTimesOfOperation:(const char *)operation wall:(NSTimeInterval)wall cpu:(NSTimeInterval)cpu blocked:(NSTimeInterval)blocked
+{
+    pthread_mutex_lock(&_timesLock);
+    
+    // A handful of methods, compared by their __func__ pointer
+    NSUInteger i = 0;
+    while (i < _timesCount && _times[i].operation != operation) i++;
+    
+    if (i == _timesCount && _timesCount < CoSocketMaxTimedOperations) {
+        _times[_timesCount++] = (CoSocketOperationTimes){ .operation = operation };
+    }
+    
+    if (i < _timesCount) {
+        _times[i].count++;
+        _times[i].wallTime += wall;
+        _times[i].cpuTime += cpu;
+        _times[i].blockedTime += blocked;
+    }
+    
+    pthread_mutex_unlock(&_timesLock);
+}
+
+- (NSDictionary *)operationTimes
+{
+    NSMutableDictionary *operationTimes = [NSMutableDictionary dictionary];
+    
+    pthread_mutex_lock(&_timesLock);
+    
+    for (NSUInteger i = 0; i < _timesCount; i++) {
+        operationTimes[@(_times[i].operation)] = @{
+            @"count" : @(_times[i].count),
+            @"wallTime" : @(_times[i].wallTime),
+            @"cpuTime" : @(_times[i].cpuTime),
+            @"blockedTime" : @(_times[i].blockedTime),
+        };
+    }
+    
+    pthread_mutex_unlock(&_timesLock);
+    
+    return operationTimes;
+}
+
+- (void)resetOperationTimes
+{
+    pthread_mutex_lock(&_timesLock);
+    _timesCount = 0;
+    pthread_mutex_unlock(&_timesLock);
+}
+
+/**
+ Traces an asynchronous operation, and logs it if it was slow. Its time can't be broken down like a blocking
+ one's, it waits on the loop among the operations of other sockets.
+ */
+- (void)asynchronousOperationDidFinish:(CoSocketOperation *)operation data:(NSData *)data error:(NSError *)error
+{
+    static const char *const names[] = {
+        [CoSocketOperationConnect] = "connect (asynchronous)",
+        [CoSocketOperationReadToLength] = "read to length (asynchronous)",
+        [CoSocketOperationReadToData] = "read to data (asynchronous)",
+        [CoSocketOperationReadBuffer] = "read buffer (asynchronous)",
+        [CoSocketOperationWrite] = "write (asynchronous)",
+    };
+    
+    NSTimeInterval end = monotonic_time();
+    NSTimeInterval duration = end - operation->_startTime;
+    NSTimeInterval threshold = self.slowOperationThreshold;
+    NSUInteger bytes = data ? data.length : operation->_progress;
+    CoTraceRecorder *recorder = self.traceRecorder;
+    
+    if (recorder) {
+        if (error.code == ETIMEDOUT) {
+            [recorder recordInstant:"timeout" track:_traceTrack argument:NULL value:0];
+        }
+        [recorder recordSpan:names[operation->_kind] track:_traceTrack start:operation->_startTime end:end argument:"bytes" value:bytes];
+    }
+    
+    if (threshold <= 0 || duration < threshold) {
+        return;
+    }
+    
+    CoSlowOperation *entry = [[CoSlowOperation alloc] init];
+    entry.operation = @(names[operation->_kind]);
+    entry.date = [NSDate dateWithTimeIntervalSinceNow:-duration];
+    entry.duration = duration;
+    entry.lookupTime = operation->_lookupTime;
+    entry.bytes = bytes;
+    entry.remoteHost = _remoteHost;
+    entry.remotePort = _remotePort;
+    entry.traceTag = self.context.traceTag;
+    entry.error = error;
+    
+    [self.slowOperationLog addOperation:entry];
+}
+
+/**
+ The deadline of a connect, read or write starting now: its timeout, cut short by the context's deadline.
+ */
+- (NSTimeInterval)operationDeadline
+{
+    CoOperationContext *context = self.context;
+    
+    return context ? [context deadlineWithTimeout:_timeout] : deadline_from_timeout(_timeout);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Idle Timeout
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ The wheel of the socket's event loop, so its timers fire on the thread serving it, or else the shared wheel.
+ */
+- (CoTimingWheel *)timingWheel
+{
+    return self.eventLoop.timingWheel ?: [CoTimingWheel sharedWheel];
+}
+
+- (void)scheduleIdleTimerAfter:(NSTimeInterval)interval
+{
+    [self.idleTimer cancel];
+    self.idleTimer = nil;
+    
+    if (interval <= 0) {
+        return;
+    }
+    
+    // I/O only records the time, the timer checks it once per idle period.
+    // The wheel may already be running the handler when the timer is cancelled, the generation tells.
+    uint64_t generation = [self connectionGeneration];
+    __weak CoSocket *weakSelf = self;
+    self.idleTimer = [self.timingWheel scheduleTimerWithTimeInterval:interval handler:^{
+        [weakSelf idleTimerFiredForGeneration:generation];
+    }];
+}
+
+- (void)idleTimerFiredForGeneration:(uint64_t)generation
+{
+    NSTimeInterval idleTimeout = self.idleTimeout;
+    
+    if (idleTimeout <= 0 || generation != [self connectionGeneration]) {
+        return;
+    }
+    
+    NSTimeInterval idle = monotonic_time() - atomic_load(&_lastActivity);
+    
+    if (idle < idleTimeout) {
+        [self scheduleIdleTimerAfter:idleTimeout - idle];
+        return;
+    }
+    
+    if (_logDebug) _logDebug(@"Connection has been idle for %f seconds, shut it down", idle);
+    
+    [self shutdownConnectionOfGeneration:generation];
+}
+
+- (uint64_t)connectionGeneration
+{
+    pthread_mutex_lock(&_closeLock);
+    uint64_t generation = _connectionGeneration;
+    pthread_mutex_unlock(&_closeLock);
+    
+    return generation;
+}
+
+/**
+ Shuts the connection down from another thread. Unlike close(), shutdown() is safe while another thread
+ is blocked on the socket, and wakes it up. Does nothing once the connection of that generation is closed,
+ as its descriptor number may belong to another connection by then.
+ */
+- (BOOL)shutdownConnectionOfGeneration:(uint64_t)generation
+{
+    BOOL shut = NO;
+    
+    pthread_mutex_lock(&_closeLock);
+    
+    if (generation == _connectionGeneration && _socketFD != SOCKET_NULL) {
+        shut = (shutdown(_socketFD, SHUT_RDWR) == 0);
+    }
+    
+    pthread_mutex_unlock(&_closeLock);
+    
+    return shut;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Heartbeat
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (void)startHeartbeatWithInterval:(NSTimeInterval)interval
+                              ping:(NSData *)ping
+                            framer:(CoSocketMessageFramer)framer
+                         maxMissed:(NSUInteger)maxMissed
+{
+    [self stopHeartbeat];
+    
+    if (interval <= 0 || !ping.length || !framer) {
+        return;
+    }
+    
+    // Reads take pongs out and writes are framed for pings, so change both under their locks
+    pthread_mutex_lock(&_readLock);
+    pthread_mutex_lock(&_writeLock);
+    
+    _pingData = [ping copy];
+    _framer = [framer copy];
+    _maxMissedHeartbeats = MAX(maxMissed, 1);
+    _framedTo = _bufferConsumed;
+    _sendRemaining = 0;
+    _sendHeader = [NSMutableData data];
+    atomic_store(&_lastPingSentAt, 0);
+    atomic_store(&_pingsOutstanding, 0);
+    self.missedHeartbeats = 0;
+    self.heartbeatRoundTripTime = 0;
+    
+    // Last, the timer thread reads the rest once it sees the interval
+    atomic_store(&_heartbeatInterval, interval);
+    
+    pthread_mutex_unlock(&_writeLock);
+    pthread_mutex_unlock(&_readLock);
+    
+    [self scheduleHeartbeatTimer];
+}
+
+- (void)stopHeartbeat
+{
+    // The framer stays, pongs still in flight are taken out when they arrive
+    atomic_store(&_heartbeatInterval, 0);
+    
+    [self.heartbeatTimer cancel];
+    self.heartbeatTimer = nil;
+}
+
+- (void)scheduleHeartbeatTimer
+{
+    NSTimeInterval interval = atomic_load(&_heartbeatInterval);
+    
+    if (interval <= 0) {
+        return;
+    }
+    
+    uint64_t generation = [self connectionGeneration];
+    __weak CoSocket *weakSelf = self;
+    self.heartbeatTimer = [self.timingWheel scheduleTimerWithTimeInterval:interval handler:^{
+        [weakSelf heartbeatTimerFiredForGeneration:generation];
+    }];
+}
+
+/**
+ Runs on the timer thread, once per heartbeat interval. It never blocks on the socket:
+ it only touches the read side or the write side when no read or write is in progress.
+ */
+- (void)heartbeatTimerFiredForGeneration:(uint64_t)generation
+{
+    NSTimeInterval interval = atomic_load(&_heartbeatInterval);
+    
+    if (interval <= 0 || generation != [self connectionGeneration] || atomic_load(&_heartbeatFailed)) {
+        return;
+    }
+    
+    // Pick up a pong that arrived while nobody was reading. A read in progress picks it up itself.
+    if (atomic_load(&_pingsOutstanding) > 0 && pthread_mutex_trylock(&_readLock) == 0) {
+        if (_bufferOffset + _bufferLength + _heldLength < _size || _bufferOffset > 0) {
+            [self receiveIntoBufferWanting:0];
+        }
+        pthread_mutex_unlock(&_readLock);
+    }
+    
+    NSTimeInterval now = monotonic_time();
+    NSTimeInterval lastPingSentAt = atomic_load(&_lastPingSentAt);
+    BOOL shouldPing = NO;
+    
+    if (atomic_load(&_pingsOutstanding) > 0) {
+        if (atomic_load(&_lastReceived) > lastPingSentAt) {
+            // Data came in after the ping, so the peer is alive even if its pong is queued behind that data
+            self.missedHeartbeats = 0;
+        } else if (now - lastPingSentAt >= interval) {
+            self.missedHeartbeats = self.missedHeartbeats + 1;
+            
+            if (self.missedHeartbeats >= _maxMissedHeartbeats) {
+                [self heartbeatDidFailForGeneration:generation];
+                return;
+            }
+            
+            shouldPing = YES;
+        }
+    } else {
+        // Ping only a quiet connection, so the pong is the next thing the peer sends
+        shouldPing = (now - atomic_load(&_lastActivity) >= interval);
+    }
+    
+    if (pthread_mutex_trylock(&_writeLock) == 0) {
+        if (_pingSent > 0) {
+            // The rest of the last ping, in case no write came to send it
+            [self sendRestOfPing];
+        } else if (shouldPing && _sendRemaining == 0 && _sendHeader.length == 0 && [self sendPing]) {
+            // Only between two messages, never into one the application is writing in pieces
+            atomic_store(&_lastPingSentAt, now);
+            atomic_fetch_add(&_pingsOutstanding, 1);
+        }
+        pthread_mutex_unlock(&_writeLock);
+    }
+    
+    [self scheduleHeartbeatTimer];
+}
+
+/**
+ Sends the ping without waiting for the socket, the timer may run on an event loop's thread.
+ A ping the socket took only part of counts as sent, its rest goes out before the next write.
+ Must be called with the write lock held.
+ */
+- (BOOL)sendPing
+{
+    ssize_t wrote;
+    
+    do {
+        wrote = [self sendBytes:_pingData.bytes length:_pingData.length];
+    } while (wrote < 0 && errno == EINTR);
+    
+    if (wrote <= 0) {
+        // Send buffer is full, the connection isn't idle after all
+        return NO;
+    }
+    
+    if ((NSUInteger)wrote < _pingData.length) {
+        _pingSent = wrote;
+    }
+    
+    atomic_store(&_lastActivity, monotonic_time());
+    return YES;
+}
+
+/**
+ Sends what the socket can take of a partially sent ping, without waiting.
+ Must be called with the write lock held.
+ 
+ @return YES once the ping is complete, or can't ever be and the write that follows reports why.
+ */
+- (BOOL)sendRestOfPing
+{
+    while (_pingSent > 0 && _pingSent < _pingData.length) {
+        ssize_t wrote = [self sendBytes:(const char *)_pingData.bytes + _pingSent length:_pingData.length - _pingSent];
+        
+        if (wrote < 0 && errno == EINTR) {
+            continue;
+        }
+        
+        if (wrote < 0 && errno == EAGAIN) {
+            return NO;
+        }
+        
+        if (wrote <= 0) {
+            break;
+        }
+        
+        _pingSent += wrote;
+    }
+    
+    _pingSent = 0;
+    return YES;
+}
+
+/**
+ Walks the messages in the received bytes from the last boundary on, and takes out complete pongs.
+ Bytes from a message that may be a pong but can't be measured yet on are held back from reads.
+ Must be called with the read lock held.
+ */
+- (void)frameReceivedBytes
+{
+    NSUInteger received = _bufferLength + _heldLength;
+    
+    if (!_framer) {
+        _bufferLength = received;
+        _heldLength = 0;
+        return;
+    }
+    
+    // A read that went into a message the framer couldn't measure lost the boundary, start over where it ended
+    if (_framedTo < _bufferConsumed) {
+        _framedTo = _bufferConsumed;
+    }
+    
+    char *head = (char *)_buffer + _bufferOffset;
+    NSUInteger boundary = (NSUInteger)MIN(_framedTo - _bufferConsumed, (uint64_t)received);
+    
+    while (_framedTo - _bufferConsumed < received) {
+        BOOL isPong = NO;
+        NSUInteger length = _framer(head + boundary, received - boundary, &isPong);
+        
+        if (length == 0 || (isPong && length > received - boundary)) {
+            break;
+        }
+        
+        if (!isPong) {
+            _framedTo += length;
+            boundary = (NSUInteger)MIN(_framedTo - _bufferConsumed, (uint64_t)received);
+            continue;
+        }
+        
+        memmove(head + boundary, head + boundary + length, received - boundary - length);
+        received -= length;
+        [self didReceivePong];
+    }
+    
+    _bufferLength = boundary;
+    _heldLength = received - boundary;
+    
+    if (_framedTo - _bufferConsumed >= received) {
+        // The last message is still coming in, nothing to hold back
+        _bufferLength = received;
+        _heldLength = 0;
+    }
+}
+
+- (void)didReceivePong
+{
+    if (atomic_load(&_pingsOutstanding) == 0) {
+        return;
+    }
+    
+    atomic_fetch_sub(&_pingsOutstanding, 1);
+    self.heartbeatRoundTripTime = monotonic_time() - atomic_load(&_lastPingSentAt);
+    self.missedHeartbeats = 0;
+}
+
+/**
+ Follows the messages in bytes about to be written, so pings go out between them. Must be called with the write lock held.
+ */
+- (void)frameOutgoingBytes:(const char *)bytes length:(NSUInteger)length
+{
+    if (!_framer) {
+        return;
+    }
+    
+    while (length > 0) {
+        if (_sendRemaining > 0) {
+            NSUInteger skip = (NSUInteger)MIN(_sendRemaining, (uint64_t)length);
+            _sendRemaining -= skip;
+            bytes += skip;
+            length -= skip;
+            continue;
+        }
+        
+        BOOL isPong = NO;
+        
+        if (_sendHeader.length == 0) {
+            NSUInteger messageLength = _framer(bytes, length, &isPong);
+            
+            if (messageLength == 0) {
+                [_sendHeader appendBytes:bytes length:length];
+                return;
+            }
+            
+            _sendRemaining = messageLength;
+            continue;
+        }
+        
+        // The message's header is split over writes, measure it with what came before
+        NSUInteger before = _sendHeader.length;
+        NSUInteger take = MIN(length, (NSUInteger)CoSocketMaxHeaderCarry);
+        [_sendHeader appendBytes:bytes length:take];
+        
+        NSUInteger messageLength = _framer(_sendHeader.bytes, _sendHeader.length, &isPong);
+        
+        if (messageLength == 0) {
+            bytes += take;
+            length -= take;
+            continue;
+        }
+        
+        _sendHeader.length = 0;
+        _sendRemaining = messageLength > before ? messageLength - before : 0;
+    }
+}
+
+- (void)heartbeatDidFailForGeneration:(uint64_t)generation
+{
+    if (_logDebug) _logDebug(@"Peer missed %lu heartbeats, shut the connection down", (unsigned long)self.missedHeartbeats);
+    
+    atomic_store(&_heartbeatFailed, YES);
+    
+    if (![self shutdownConnectionOfGeneration:generation]) {
+        // Reconnected meanwhile, the new connection has nothing to do with the missed heartbeats
+        atomic_store(&_heartbeatFailed, NO);
+    }
+}
+
+/**
+ The error for an I/O that failed because the heartbeat shut the connection down.
+ */
+- (NSError *)heartbeatError
+{
+    errno = ETIMEDOUT;
+    return [self errnoErrorWithReason:@"Peer stopped answering heartbeats"];
+}
+
+/**
+ Shutdown the connection to the remote host.
+ 
+ Close vs shutdown socket:
+ 
+ shutdown is a flexible way to block communication in one or both directions. When the second parameter is SHUT_RDWR, it will block both sending and receiving (like close). However, close is the way to actually destroy a socket.
+ 
+ With shutdown, you will still be able to receive pending data the peer already sent (thanks to Joey Adams for noting this).
+ 
+ Big difference between shutdown and close on a socket is the behavior when the socket is shared by other processes. A shutdown() affects all copies of the socket while close() affects only the file descriptor in one process.
+ 
+ Someone also had success under linux using shutdown() from one pthread to force another pthread currently blocked in connect() to abort early.
+ 
+ Under other OSes (OSX at least), I found calling close() was enough to get connect() fail.
+ */
+- (void)disconnect
+{
+    [self disconnectAbortively:NO];
+}
+
+/**
+ Closes the connection, with a FIN after unsent data, or abortively with a RST that discards it.
+ */
+- (void)disconnectAbortively:(BOOL)abortive
+{
+    [self.idleTimer cancel];
+    self.idleTimer = nil;
+    [self stopHeartbeat];
+    
+    // A loop's watchers are keyed by descriptor, so the loop has to stop watching before the number can be reused.
+    // A socket being deallocated has no watcher left, the watchers hold on to their sockets.
+    CoEventLoop *loop = _deallocating ? nil : self.eventLoop;
+    
+    // Wakes up the peer and the threads blocked on the ring. They may still hold on to it, it's unmapped after them.
+    CoSharedRing *ring = self.sharedRing;
+    self.sharedRing = nil;
+    [ring close];
+    
+    // Only one caller gets the descriptor, so it's closed once even if two threads disconnect
+    pthread_mutex_lock(&_closeLock);
+    
+    int socketFD = __atomic_exchange_n(&_socketFD, SOCKET_NULL, __ATOMIC_SEQ_CST);
+    
+    if (socketFD != SOCKET_NULL) {
+        _connectionGeneration++;
+        
+        if (abortive) {
+            abort_connection(socketFD);
+        } else {
+            shutdown(socketFD, SHUT_RDWR);
+        }
+        
+        if (!loop) {
+            close(socketFD);
+        }
+    }
+    
+    pthread_mutex_unlock(&_closeLock);
+    
+    if (socketFD != SOCKET_NULL) {
+        [self.traceRecorder recordInstant:"disconnect" track:_traceTrack argument:NULL value:0];
+    }
+    
+    if (loop) {
+        [loop post:^{
+            // Pending asynchronous operations fail on the closed socket, rather than wait for events that never come.
+            // That also stops watching the descriptor, which is only closed after.
+            [self progressOperations];
+            
+            if (socketFD != SOCKET_NULL) {
+                close(socketFD);
+            }
+            
+            // The loop holds on to its sockets, let go of one that is done, unless a completion reconnected it
+            if (self->_socketFD == SOCKET_NULL && !self->_connectOperation &&
+                self->_readOperations.count == 0 && self->_writeOperations.count == 0) {
+                [loop removeSocket:self];
+            }
+        }];
+    }
+}
+
+- (BOOL)shutdownWriteAndReturnError:(NSError *__autoreleasing *)errPtr
+{
+    // Let a write in progress finish, the peer would see a truncated message otherwise
+    CoSocketLockScope(&_writeLock);
+    
+    [self stopHeartbeat];
+    
+    CoSharedRing *ring = self.sharedRing;
+    
+    if (ring) {
+        [ring shutdownSending];
+    } else if (shutdown(_socketFD, SHUT_WR) != 0) {
+        if (errPtr) *errPtr = [self errnoErrorWithReason:@"Error in shutdown() function"];
+        return NO;
+    }
+    
+    if (_logDebug) _logDebug(@"Socket is shut down for writing");
+    
+    return YES;
+}
+
+- (BOOL)closeGracefullyWithTimeout:(NSTimeInterval)timeout error:(NSError *__autoreleasing *)errPtr
+{
+    CoSocketLockScope(&_writeLock);
+    
+    NSTimeInterval deadline = deadline_from_timeout(timeout);
+    useconds_t delay = 1000;
+    
+    for (;;) {
+        // The ring's hang up is only seen through its readiness, the connection is closed after anyway
+        CoSharedRing *ring = self.sharedRing;
+        [ring harvestEvents];
+        int pending = ring ? (int)MIN(ring.unsentLength, INT_MAX) : unsent_bytes(_socketFD);
+        
+        if (pending == 0) {
+            break;
+        }
+        
+        if (pending < 0) {
+            // Nothing to wait on, e.g. the peer already reset the connection
+            if (_logDebug) _logDebug(@"Failed to get the socket send queue size, close now");
+            break;
+        }
+        
+        if (deadline > 0 && monotonic_time() >= deadline) {
+            errno = ETIMEDOUT;
+            if (errPtr) *errPtr = [self errnoErrorWithReason:@"Socket send queue did not drain in time"];
+            [self disconnect];
+            return NO;
+        }
+        
+        // There is no readiness event for "acknowledged by the peer", back off up to 20ms
+        usleep(delay);
+        delay = MIN(delay * 2, 20000);
+    }
+    
+    [self disconnect];
+    return YES;
+}
+
+- (void)abort
+{
+    [self disconnectAbortively:YES];
+}
+
 - (BOOL)writeData:(NSData *)theData error:(NSError *__autoreleasing *)errPtr
 {
-    fd_set writemask;
+    CoSocketStatsScope(errPtr);
+    CoSocketLockScope(&_writeLock);
+    
+    if (theData.length <= 0) {
+        if (errPtr) *errPtr = [self otherError:@"Socket write data length must bigger than zero"];
+        return NO;
+    }
+    
+    struct iovec iov = { .iov_base = (void *)theData.bytes, .iov_len = theData.length };
+    
+    return [self sendIOVec:&iov count:1 before:[self operationDeadline] error:errPtr];
+}
+
+/**
+ Sends all bytes of the vector, waiting for the socket to take them. Must be called with the write lock held.
+ The vector is advanced over what was sent.
+ */
+- (BOOL)sendIOVec:(struct iovec *)iov count:(int)count before:(NSTimeInterval)deadline error:(NSError *__autoreleasing *)errPtr
+{
+    // All of it is sent under the write lock, or the connection is closed, so it can be framed ahead
+    for (int i = 0; i < count; i++) {
+        [self frameOutgoingBytes:iov[i].iov_base length:iov[i].iov_len];
+    }
+    
+    while (count > 0) {
+        int wait_result = [self waitForEvents:POLLOUT before:deadline];
+        
+        if (wait_result==-1) {
+            if (errPtr) *errPtr = [self interruptionError] ?: [self errnoError];
+            [self disconnect];
+            return NO;
+        }
+        
+        if (wait_result==0) {     // Timeout
+            errno = ETIMEDOUT;
+            if (errPtr) *errPtr = [self errnoErrorWithReason:@"Socket write timed out"];
+            
+            [self disconnect];
+            return NO;
+        }
+        
+        // The rest of a ping goes first, the peer would see it inside the message otherwise
+        if (_pingSent > 0 && ![self sendRestOfPing]) {
+            continue;
+        }
+        
+        /* The socket is writable */
+        NSTimeInterval sendStart = stats_clock();
+        ssize_t wrote = [self sendVector:iov count:count];
+        record_send(wrote, sendStart);
+        
+        if (wrote == 0) {
+            // socket has been closed or shutdown for send
+            if (errPtr) *errPtr = [self otherError:@"Peer has closed the socket"];
+            [self disconnect];
+            return NO;
+        }
+        
+        if (wrote < 0) {
+            if (errno == EAGAIN || errno == EINTR) continue;
+            
+            if (errPtr) *errPtr = [self interruptionError] ?: [self errnoError];
+            [self disconnect];
+            return NO;
+        }
+        
+        atomic_store(&_lastActivity, monotonic_time());
+        
+        // Skip the chunks sent in full, and the sent part of the next one
+        while (count > 0 && (size_t)wrote >= iov->iov_len) {
+            wrote -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + wrote;
+            iov->iov_len -= wrote;
+        }
+    }
+    
+    return YES;
+}
+
+- (BOOL)writeString:(NSString *)string encoding:(NSStringEncoding)encoding error:(NSError *__autoreleasing *)errPtr
+{
+    CoSocketStatsScope(errPtr);
+    CoSocketLockScope(&_writeLock);
+    
+    if (string.length == 0) {
+        if (errPtr) *errPtr = [self otherError:@"Socket write data length must bigger than zero"];
+        return NO;
+    }
+    
+    CoBufferPool *pool = [CoBufferPool sharedPool];
+    NSTimeInterval deadline = [self operationDeadline];
+    NSRange remaining = NSMakeRange(0, string.length);
+    
+    while (remaining.length > 0) {
+        // Encode into pooled chunks, and send up to CoSocketMaxWriteChunks of them at once
+        struct iovec iov[CoSocketMaxWriteChunks];
+        int count = 0;
+        BOOL encoded = YES;
+        
+        while (remaining.length > 0 && count < CoSocketMaxWriteChunks) {
+            void *chunk = [pool allocateBuffer];
+            
+            if (!chunk) {
+                break;
+            }
+            
+            NSUInteger used = 0;
+            encoded = [string getBytes:chunk
+                             maxLength:pool.bufferSize
+                            usedLength:&used
+                              encoding:encoding
+                               options:0
+                                 range:remaining
+                        remainingRange:&remaining];
+            
+            iov[count++] = (struct iovec){ .iov_base = chunk, .iov_len = used };
+            
+            if (!encoded) {
+                break;
+            }
+        }
+        
+        if (count == 0) {
+            // Over the memory budget, encode the rest the old way
+            NSData *data = [[string substringWithRange:remaining] dataUsingEncoding:encoding];
+            
+            if (!data) {
+                errno = EILSEQ;
+                if (errPtr) *errPtr = [self errnoErrorWithReason:@"String can't be encoded with the given encoding"];
+                return NO;
+            }
+            
+            struct iovec whole = { .iov_base = (void *)data.bytes, .iov_len = data.length };
+            return [self sendIOVec:&whole count:1 before:deadline error:errPtr];
+        }
+        
+        // sendIOVec: moves the vector on, keep the chunks to give them back
+        void *chunks[CoSocketMaxWriteChunks];
+        
+        for (int i = 0; i < count; i++) {
+            chunks[i] = iov[i].iov_base;
+        }
+        
+        BOOL sent = encoded && [self sendIOVec:iov count:count before:deadline error:errPtr];
+        
+        for (int i = 0; i < count; i++) {
+            [pool releaseBuffer:chunks[i]];
+        }
+        
+        if (!encoded) {
+            errno = EILSEQ;
+            if (errPtr) *errPtr = [self errnoErrorWithReason:@"String can't be encoded with the given encoding"];
+            return NO;
+        }
+        
+        if (!sent) {
+            return NO;
+        }
+    }
+    
+    return YES;
+}
+
+- (BOOL)writeWithError:(NSError *__autoreleasing *)errPtr format:(NSString *)format, ...
+{
+    va_list args;
+    va_start(args, format);
+    NSString *string = [[NSString alloc] initWithFormat:format arguments:args];
+    va_end(args);
+    
+    return [self writeString:string encoding:NSUTF8StringEncoding error:errPtr];
+}
+
+- (BOOL)sendMessage:(NSData *)message error:(NSError *__autoreleasing *)errPtr
+{
+    CoSocketStatsScope(errPtr);
+    CoSocketLockScope(&_writeLock);
+    
+    if (message.length <= 0) {
+        if (errPtr) *errPtr = [self otherError:@"Socket message length must bigger than zero"];
+        return NO;
+    }
+    
+    NSTimeInterval deadline = [self operationDeadline];
+    
+    for (;;) {
+        int wait_result = wait_for_socket(_socketFD, POLLOUT, deadline);
+        
+        if (wait_result==-1) {
+            if (errPtr) *errPtr = [self interruptionError] ?: [self errnoError];
+            [self disconnect];
+            return NO;
+        }
+        
+        if (wait_result==0) {     // Timeout
+            errno = ETIMEDOUT;
+            if (errPtr) *errPtr = [self errnoErrorWithReason:@"Socket write timed out"];
+            [self disconnect];
+            return NO;
+        }
+        
+        // A message socket sends the whole record or nothing at all
+        NSTimeInterval sendStart = stats_clock();
+        ssize_t wrote = send(_socketFD, message.bytes, message.length, CoSocketSendFlags);
+        record_send(wrote, sendStart);
+        
+        if (wrote < 0) {
+            if (errno == EAGAIN || errno == EINTR) continue;
+            
+            if (errno == EMSGSIZE) {
+                // The connection is still usable, only this message can't be sent
+                if (errPtr) *errPtr = [self errnoErrorWithReason:@"Message is larger than the socket send buffer"];
+                return NO;
+            }
+            
+            if (errPtr) *errPtr = [self errnoError];
+            [self disconnect];
+            return NO;
+        }
+        
+        atomic_store(&_lastActivity, monotonic_time());
+        return YES;
+    }
+}
+
+- (NSData *)receiveMessageWithError:(NSError *__autoreleasing *)errPtr
+{
+    CoSocketStatsScope(errPtr);
+    CoSocketLockScope(&_readLock);
+    
+    NSTimeInterval deadline = [self operationDeadline];
+    
+    for (;;) {
+        int wait_result = wait_for_socket(_socketFD, POLLIN, deadline);
+        
+        if (wait_result==-1) {
+            if (errPtr) *errPtr = [self interruptionError] ?: [self errnoError];
+            [self disconnect];
+            return nil;
+        }
+        
+        if (wait_result==0) {     // Timeout
+            errno = ETIMEDOUT;
+            if (errPtr) *errPtr = [self errnoErrorWithReason:@"Socket read timed out"];
+            [self disconnect];
+            return nil;
+        }
+        
+        if (![self prepareBuffer]) {
+            if (errPtr) *errPtr = [self errnoError];
+            return nil;
+        }
+        
+        struct iovec iov = { .iov_base = _buffer, .iov_len = _size };
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        
+        NSTimeInterval receiveStart = stats_clock();
+        ssize_t justRead = recvmsg(_socketFD, &msg, 0);
+        record_receive(justRead, receiveStart);
+        
+        if (justRead == 0) {
+            // socket has been closed or shutdown for send
+            if (errPtr) *errPtr = [self otherError:@"Peer has closed the socket"];
+            [self disconnect];
+            return nil;
+        }
+        
+        if (justRead < 0) {
+            if (errno == EAGAIN || errno == EINTR) continue;
+            
+            if (errPtr) *errPtr = [self errnoError];
+            [self disconnect];
+            return nil;
+        }
+        
+        if (msg.msg_flags & MSG_TRUNC) {
+            // The rest of the record is gone, the boundary guarantee can't be kept
+            if (errPtr) *errPtr = [self otherError:@"Received message is larger than the socket buffer"];
+            [self disconnect];
+            return nil;
+        }
+        
+        atomic_store(&_lastActivity, monotonic_time());
+        NSData *message = [NSData dataWithBytes:_buffer length:justRead];
+        
+        if ([CoBufferPool isMemoryUnderPressure]) {
+            [[CoBufferPool sharedPool] releaseBuffer:_buffer];
+            _buffer = NULL;
+        }
+        
+        return message;
+    }
+}
+
+/**
+ Takes the read buffer from the pool of the calling thread's NUMA node, unless the socket has one.
+ Must be called with the read lock held.
+ */
+- (BOOL)prepareBuffer
+{
+    if (!_buffer) {
+        _buffer = [[CoBufferPool sharedPool] allocateBuffer];
+    }
+    
+    return _buffer != NULL;
+}
+
+/**
+ Receives whatever the socket has into the free end of the read-ahead buffer, without waiting.
+ Must be called with the read lock held.
+ 
+ @param wanted The bytes the read needs, or 0 if unknown. Under memory pressure no more is received,
+        the rest stays in the kernel.
+ 
+ @return The number of bytes received, 0 if the peer closed the connection, or -1 with errno set
+         (EAGAIN if there was nothing to receive, ENOBUFS if there is no memory for a buffer).
+ */
+- (ssize_t)receiveIntoBufferWanting:(NSUInteger)wanted
+{
+    if (![self prepareBuffer]) {
+        return -1;
+    }
+    
+    NSUInteger received = _bufferLength + _heldLength;
+    
+    if (received == 0) {
+        _bufferOffset = 0;
+    } else if (_bufferOffset + received == _size) {
+        memmove(_buffer, (char *)_buffer + _bufferOffset, received);
+        _bufferOffset = 0;
+    }
+    
+    size_t space = _size - _bufferOffset - received;
+    
+    if (space == 0) {
+        errno = ENOSPC;
+        return -1;
+    }
+    
+    if ([CoBufferPool isMemoryUnderPressure]) {
+        space = MIN(space, wanted ?: CoSocketMinimalReadAhead);
+    }
+    
+    NSTimeInterval receiveStart = stats_clock();
+    ssize_t justRead = [self receiveBytes:(char *)_buffer + _bufferOffset + received length:space];
+    record_receive(justRead, receiveStart);
+    
+    if (justRead > 0) {
+        _heldLength += justRead;
+        NSTimeInterval now = monotonic_time();
+        atomic_store(&_lastActivity, now);
+        atomic_store(&_lastReceived, now);
+        
+        [self frameReceivedBytes];
+    }
+    
+    return justRead;
+}
+
+/**
+ Waits until the socket is readable and receives into the read-ahead buffer.
+ Must be called with the read lock held, and with free space in the buffer.
+ 
+ @return YES if bytes were received (all of them may be held back or have been pongs), NO on timeout, error
+         or end of stream, in which case the connection is closed.
+ */
+- (BOOL)fillBufferWanting:(NSUInteger)wanted before:(NSTimeInterval)deadline error:(NSError *__autoreleasing *)errPtr
+{
+    useconds_t backoff = 1000;
+    
+    for (;;) {
+        int wait_result = [self waitForEvents:POLLIN before:deadline];
+        if (wait_result==-1) {    // On error
+            if (errPtr) *errPtr = [self interruptionError] ?: [self errnoError];
+            [self disconnect];
+            return NO;
+        }
+        
+        if (wait_result==0) {     // Timeout
+            errno = ETIMEDOUT;
+            if (errPtr) *errPtr = [self errnoErrorWithReason:@"Socket read timed out"];
+            
+            [self disconnect];
+            return NO;
+        }
+        
+        ssize_t justRead = [self receiveIntoBufferWanting:wanted];
+        
+        if (justRead == 0) {
+            // socket has been closed or shutdown for send
+            if (errPtr) *errPtr = [self interruptionError] ?: [self otherError:@"Peer has closed the socket"];
+            [self disconnect];
+            return NO;
+        }
+        
+        if (justRead < 0) {
+            if (errno == EAGAIN || errno == EINTR) continue;
+            
+            if (errno == ENOBUFS) {
+                // Over the memory budget. Leaving the data in the kernel fills the TCP window,
+                // which holds the peer back until other sockets give their buffers back.
+                NSError *interruption = [self interruptionError];
+                if (interruption) {
+                    if (errPtr) *errPtr = interruption;
+                    [self disconnect];
+                    return NO;
+                }
+                
+                NSTimeInterval now = monotonic_time();
+                if (deadline > 0 && now >= deadline) {
+                    // The socket stays readable, so the poll above doesn't time out by itself
+                    errno = ETIMEDOUT;
+                    if (errPtr) *errPtr = [self errnoErrorWithReason:@"Socket read timed out waiting for a buffer"];
+                    [self disconnect];
+                    return NO;
+                }
+                
+                useconds_t delay = backoff;
+                if (deadline > 0) {
+                    delay = (useconds_t)MIN((NSTimeInterval)backoff, ceil((deadline - now) * 1e6));
+                }
+                usleep(delay);
+                backoff = MIN(backoff * 2, 50000);
+                continue;
+            }
+            
+            if (errPtr) *errPtr = [self interruptionError] ?: [self errnoError];
+            [self disconnect];
+            return NO;
+        }
+        
+        return YES;
+    }
+}
+
+/**
+ Removes bytes from the head of the read-ahead buffer. Must be called with the read lock held.
+ */
+- (void)consumeBufferedBytes:(NSUInteger)length
+{
+    _bufferOffset += length;
+    _bufferLength -= length;
+    _bufferConsumed += length;
+    
+    if (_bufferLength == 0 && _heldLength == 0 && _buffer && [CoBufferPool isMemoryUnderPressure]) {
+        // An idle socket holds no memory while memory is short
+        [[CoBufferPool sharedPool] releaseBuffer:_buffer];
+        _buffer = NULL;
+    }
+}
+
+/**
+ Takes length bytes, no more than the buffer holds, from the read-ahead buffer if they are there.
+ Must be called with the read lock held.
+ */
+- (NSData *)takeBufferedDataToLength:(NSUInteger)length
+{
+    if (_bufferLength < length) {
+        return nil;
+    }
+    
+    NSData * theData = [NSData dataWithBytes:(char *)_buffer + _bufferOffset length:length];
+    [self consumeBufferedBytes:length];
+    return theData;
+}
+
+/**
+ Moves whatever the read-ahead buffer holds, up to the rest of a read bigger than the buffer, into that read's data.
+ Must be called with the read lock held.
+ */
+- (void)takeBufferedBytesInto:(NSMutableData *)theData progress:(NSUInteger *)hasRead
+{
+    NSUInteger chunk = MIN(_bufferLength, theData.length - *hasRead);
+    
+    if (chunk == 0) {
+        return;
+    }
+    
+    memcpy((char *)theData.mutableBytes + *hasRead, (char *)_buffer + _bufferOffset, chunk);
+    [self consumeBufferedBytes:chunk];
+    *hasRead += chunk;
+}
+
+/**
+ Takes the bytes up to and including the separator from the read-ahead buffer if they are there.
+ Must be called with the read lock held.
+ 
+ @param scanned Stream offset up to which no separator can start, so each byte is scanned only once.
+                Start with _bufferConsumed.
+ */
+- (NSData *)takeBufferedDataToData:(NSData *)data scanned:(uint64_t *)scanned
+{
+    NSUInteger length = [self bufferedLengthToData:data scanned:scanned];
+    
+    if (length == 0) {
+        return nil;
+    }
+    
+    NSData * theData = [NSData dataWithBytes:(char *)_buffer + _bufferOffset length:length];
+    [self consumeBufferedBytes:length];
+    return theData;
+}
+
+/**
+ Returns how many bytes of the read-ahead buffer are up to and including the separator, or 0 if it isn't there.
+ Must be called with the read lock held.
+ 
+ @param scanned See takeBufferedDataToData:scanned:
+ */
+- (NSUInteger)bufferedLengthToData:(NSData *)data scanned:(uint64_t *)scanned
+{
+    NSUInteger terminal = data.length;
+    
+    if (_bufferLength == 0) {
+        return 0;
+    }
+    
+    // The head may have been consumed since the last scan, hence the stream offsets
+    NSUInteger from = (NSUInteger)(MAX(*scanned, _bufferConsumed) - _bufferConsumed);
+    const char *head = (const char *)_buffer + _bufferOffset;
+    const char *found = find_bytes(head + from, _bufferLength - from, data.bytes, terminal);
+    
+    if (found) {
+        return (found - head) + terminal;
+    }
+    
+    if (_bufferLength >= terminal) {
+        *scanned = _bufferConsumed + _bufferLength - terminal + 1;
+    }
+    
+    return 0;
+}
+
+/**
+ Lends the read-ahead buffer to the reader and consumes what it took. Must be called with the read lock held.
+ */
+- (void)lendBufferToReader:(CoSocketBufferReader)reader
+{
+    NSUInteger consumed = reader((const char *)_buffer + _bufferOffset, _bufferLength);
+    [self consumeBufferedBytes:MIN(consumed, _bufferLength)];
+}
+
+- (BOOL)readBufferWithReader:(CoSocketBufferReader)reader error:(NSError *__autoreleasing *)errPtr
+{
+    CoSocketStatsScope(errPtr);
+    CoSocketLockScope(&_readLock);
+    
+    NSTimeInterval deadline = [self operationDeadline];
+    
+    while (_bufferLength == 0) {
+        if (![self fillBufferWanting:0 before:deadline error:errPtr]) {
+            return NO;
+        }
+    }
+    
+    [self lendBufferToReader:reader];
+    return YES;
+}
+
+- (NSData *)readDataToLength:(NSUInteger)length error:(NSError *__autoreleasing *)errPtr
+{
+    CoSocketStatsScope(errPtr);
+    CoSocketLockScope(&_readLock);
+    
+    if (length == 0) {
+        if (errPtr) *errPtr = [self otherError:@"Socket read length must bigger than zero"];
+        [self disconnect];
+        return nil;
+    }
+    
+    NSTimeInterval deadline = [self operationDeadline];
+    
+    if (length <= _size) {
+        NSData * theData;
+        
+        while (!(theData = [self takeBufferedDataToLength:length])) {
+            if (![self fillBufferWanting:length - _bufferLength before:deadline error:errPtr]) {
+                return nil;
+            }
+        }
+        
+        return theData;
+    }
+    
+    // Bigger than the buffer, pass it through chunk by chunk
+    NSMutableData * theData = [NSMutableData dataWithLength:length];
+    NSUInteger hasRead = 0;
+    
+    while (hasRead < length) {
+        if (_bufferLength == 0 && ![self fillBufferWanting:length - hasRead before:deadline error:errPtr]) {
+            return nil;
+        }
+        
+        [self takeBufferedBytesInto:theData progress:&hasRead];
+    }
+    
+    return theData;
+}
+
+
+- (NSData *)readDataToData:(NSData *)data error:(NSError *__autoreleasing *)errPtr
+{
+    return [self readDataToData:data maxLength:0 error:errPtr];
+}
+
+- (NSData *)readDataToData:(NSData *)data maxLength:(NSUInteger)maxLength error:(NSError *__autoreleasing *)errPtr
+{
+    CoSocketStatsScope(errPtr);
+    CoSocketLockScope(&_readLock);
+    
+    if (!data.length) {
+        if (errPtr) *errPtr = [self otherError:@"Socket passed nil or zero-length data as a separator"];
+        [self disconnect];
+        return nil;
+    }
+    
+    NSUInteger limit = maxLength ? MIN(maxLength, (NSUInteger)_size) : (NSUInteger)_size;
+    uint64_t scanned = _bufferConsumed;
+    
+    NSTimeInterval deadline = [self operationDeadline];
+    
+    for (;;) {
+        NSUInteger length = [self bufferedLengthToData:data scanned:&scanned];
+        
+        if (length > 0 && length <= limit) {
+            NSData * theData = [NSData dataWithBytes:(char *)_buffer + _bufferOffset length:length];
+            [self consumeBufferedBytes:length];
+            return theData;
+        }
+        
+        if (length > limit || _bufferLength >= limit) {
+            if (errPtr) *errPtr = [self otherError:limit < _size ? @"The separator could not be found within maxLength bytes"
+                                                                 : @"The separator could not be found in socket stream"];
+            [self disconnect];
+            return nil;
+        }
+        
+        if (![self fillBufferWanting:0 before:deadline error:errPtr]) {
+            return nil;
+        }
+    }
+}
+
+- (NSData *)readDataToPattern:(CoPattern *)pattern maxLength:(NSUInteger)maxLength error:(NSError *__autoreleasing *)errPtr
+{
+    CoSocketStatsScope(errPtr);
+    CoSocketLockScope(&_readLock);
+    
+    if (!pattern) {
+        if (errPtr) *errPtr = [self otherError:@"Socket passed nil as a pattern"];
+        [self disconnect];
+        return nil;
+    }
+    
+    NSUInteger limit = maxLength ? MIN(maxLength, (NSUInteger)_size) : (NSUInteger)_size;
+    NSUInteger state = pattern.initialState;
+    NSUInteger scanned = 0;     // Bytes from the head the DFA has seen
+    NSTimeInterval deadline = [self operationDeadline];
+    
+    for (;;) {
+        // Only the bytes received since the last round, the DFA state carries over
+        NSUInteger end = MIN(_bufferLength, limit);
+        const char *head = (const char *)_buffer + _bufferOffset;
+        NSUInteger matched = [pattern matchBytes:head + scanned length:end - scanned atEnd:end == _bufferLength state:&state];
+        
+        if (matched != NSNotFound && scanned + matched > 0) {
+            NSUInteger length = scanned + matched;
+            NSData * theData = [NSData dataWithBytes:head length:length];
+            [self consumeBufferedBytes:length];
+            return theData;
+        }
+        
+        scanned = end;
+        
+        if (_bufferLength >= limit) {
+            if (errPtr) *errPtr = [self otherError:limit < _size ? @"The pattern could not be found within maxLength bytes"
+                                                                 : @"The pattern could not be found in socket stream"];
+            [self disconnect];
+            return nil;
+        }
+        
+        if (![self fillBufferWanting:0 before:deadline error:errPtr]) {
+            return nil;
+        }
+    }
+}
+
+- (BOOL)readExpectingData:(NSData *)expected error:(NSError *__autoreleasing *)errPtr
+{
+    CoSocketStatsScope(errPtr);
+    CoSocketLockScope(&_readLock);
+    
+    NSUInteger length = expected.length;
+    
+    if (length == 0 || length > _size) {
+        if (errPtr) *errPtr = [self otherError:@"Expected data must be bigger than zero and no bigger than the read buffer"];
+        return NO;
+    }
+    
+    const unsigned char *expectedBytes = expected.bytes;
+    NSUInteger compared = 0;
+    NSTimeInterval deadline = [self operationDeadline];
+    
+    for (;;) {
+        // Only bytes that weren't compared yet, a mismatch shows as soon as its byte arrives
+        NSUInteger available = MIN(_bufferLength, length);
+        const unsigned char *head = (const unsigned char *)_buffer + _bufferOffset;
+        
+        if (available > compared) {
+            if (memcmp(head + compared, expectedBytes + compared, available - compared) != 0) {
+                while (head[compared] == expectedBytes[compared]) {
+                    compared++;
+                }
+                
+                errno = EPROTO;
+                if (errPtr) *errPtr = [self errnoErrorWithReason:[NSString stringWithFormat:@"Received data differs from the expected at byte %lu", (unsigned long)compared]];
+                return NO;
+            }
+            
+            compared = available;
+        }
+        
+        if (compared == length) {
+            [self consumeBufferedBytes:length];
+            return YES;
+        }
+        
+        if (![self fillBufferWanting:length - _bufferLength before:deadline error:errPtr]) {
+            return NO;
+        }
+    }
+}
+
+- (NSString *)readLineAsStringWithSeparator:(NSData *)separator encoding:(NSStringEncoding)encoding error:(NSError *__autoreleasing *)errPtr
+{
+    CoSocketStatsScope(errPtr);
+    CoSocketLockScope(&_readLock);
+    
+    if (!separator.length) {
+        if (errPtr) *errPtr = [self otherError:@"Socket passed nil or zero-length data as a separator"];
+        [self disconnect];
+        return nil;
+    }
+    
+    uint64_t scanned = _bufferConsumed;
+    NSUInteger length;
+    
+    NSTimeInterval deadline = [self operationDeadline];
+    
+    while (!(length = [self bufferedLengthToData:separator scanned:&scanned])) {
+        if (_bufferLength >= _size) {
+            if (errPtr) *errPtr = [self otherError:@"The separator could not be found in socket stream"];
+            [self disconnect];
+            return nil;
+        }
+        
+        if (![self fillBufferWanting:0 before:deadline error:errPtr]) {
+            return nil;
+        }
+    }
+    
+    NSString *line = [self stringWithBytes:(const unsigned char *)_buffer + _bufferOffset
+                                    length:length - separator.length
+                                  encoding:encoding
+                                     error:errPtr];
+    
+    // A line that doesn't decode is gone all the same, the next read starts after it
+    [self consumeBufferedBytes:length];
+    return line;
+}
+
+/**
+ Creates a string straight from bytes in the read buffer. UTF-8 and ASCII are validated here,
+ so pure ASCII, the bulk of text protocols, is found out 16 bytes at a time and never decoded.
+ */
+- (NSString *)stringWithBytes:(const unsigned char *)bytes
+                       length:(NSUInteger)length
+                     encoding:(NSStringEncoding)encoding
+                        error:(NSError *__autoreleasing *)errPtr
+{
+    if (encoding == NSUTF8StringEncoding || encoding == NSASCIIStringEncoding) {
+        if (ascii_prefix_length(bytes, length) == length) {
+            return [[NSString alloc] initWithBytes:bytes length:length encoding:NSASCIIStringEncoding];
+        }
+        
+        if (encoding == NSASCIIStringEncoding || !is_valid_utf8(bytes, length)) {
+            errno = EILSEQ;
+            if (errPtr) *errPtr = [self errnoErrorWithReason:encoding == NSASCIIStringEncoding ? @"Line is not ASCII" : @"Line is not valid UTF-8"];
+            return nil;
+        }
+    }
+    
+    NSString *string = [[NSString alloc] initWithBytes:bytes length:length encoding:encoding];
+    
+    if (!string) {
+        errno = EILSEQ;
+        if (errPtr) *errPtr = [self errnoErrorWithReason:@"Line can't be decoded with the given encoding"];
+    }
+    
+    return string;
+}
+
+/**
+ Takes every complete line or frame, up to max, from the read-ahead buffer with a single copy.
+ Must be called with the read lock held.
+ 
+ @param skip Leading bytes of each unit left out of its slice, i.e. the frame header.
+ @return The units, or nil if the first one can't ever fit the buffer.
+ */
+- (NSArray *)takeBufferedUnitsWithLimit:(NSUInteger)max skip:(NSUInteger)skip measure:(CoSocketUnitMeasure)measure
+{
+    if (_bufferLength == 0) {
+        return @[];
+    }
+    
+    const char *head = (const char *)_buffer + _bufferOffset;
+    NSMutableData *ranges = [NSMutableData data];
+    NSUInteger total = 0;
+    NSUInteger count = 0;
+    
+    while (max == 0 || count < max) {
+        NSUInteger length = measure(head + total, _bufferLength - total);
+        
+        if (length == NSNotFound && count == 0) {
+            return nil;
+        }
+        
+        if (length == 0 || length == NSNotFound) {
+            break;
+        }
+        
+        NSRange range = NSMakeRange(total + skip, length - skip);
+        [ranges appendBytes:&range length:sizeof(range)];
+        total += length;
+        count++;
+    }
+    
+    if (count == 0) {
+        return @[];
+    }
+    
+    NSData *batch = [NSData dataWithBytes:head length:total];
+    NSMutableArray *units = [NSMutableArray arrayWithCapacity:count];
+    const NSRange *range = ranges.bytes;
+    
+    for (NSUInteger i = 0; i < count; i++) {
+        [units addObject:slice_of_batch(batch, range[i])];
+    }
+    
+    [self consumeBufferedBytes:total];
+    return units;
+}
+
+/**
+ Waits for a first complete unit unless one is buffered already, receives whatever else the socket holds
+ without waiting, and takes all complete units.
+ */
+- (NSArray *)readAvailableUnitsWithLimit:(NSUInteger)max
+                                    skip:(NSUInteger)skip
+                                 measure:(CoSocketUnitMeasure)measure
+                         tooLargeMessage:(NSString *)tooLargeMessage
+                                   error:(NSError *__autoreleasing *)errPtr
+{
+    CoSocketLockScope(&_readLock);
+    
+    NSUInteger first = _bufferLength ? measure((const char *)_buffer + _bufferOffset, _bufferLength) : 0;
+    
+    if (first == 0 || first == NSNotFound) {
+        if (_bufferLength >= _size || first == NSNotFound) {
+            if (errPtr) *errPtr = [self otherError:tooLargeMessage];
+            [self disconnect];
+            return nil;
+        }
+        
+        // The one and only wait
+        if (![self fillBufferWanting:0 before:[self operationDeadline] error:errPtr]) {
+            return nil;
+        }
+    }
+    
+    CoEventMask interest = 0;
+    NSError *error = nil;
+    
+    while (_bufferLength < _size && [self tryFillBufferWanting:0 interest:&interest error:&error]) {
+    }
+    
+    if (error) {
+        if (errPtr) *errPtr = error;
+        return nil;
+    }
+    
+    NSArray *units = [self takeBufferedUnitsWithLimit:max skip:skip measure:measure];
+    
+    // A frame header may declare more than the buffer holds, there's no need to wait for the buffer to fill up
+    if (!units || (units.count == 0 && _bufferLength >= _size)) {
+        if (errPtr) *errPtr = [self otherError:tooLargeMessage];
+        [self disconnect];
+        return nil;
+    }
+    
+    return units;
+}
+
+- (NSArray *)readAvailableLinesWithSeparator:(NSData *)separator max:(NSUInteger)max error:(NSError *__autoreleasing *)errPtr
+{
+    CoSocketStatsScope(errPtr);
+    if (!separator.length) {
+        if (errPtr) *errPtr = [self otherError:@"Socket passed nil or zero-length data as a separator"];
+        [self disconnect];
+        return nil;
+    }
+    
+    const void *separatorBytes = separator.bytes;
+    NSUInteger separatorLength = separator.length;
+    
+    CoSocketUnitMeasure measure = ^NSUInteger(const char *bytes, NSUInteger length) {
+        const char *found = find_bytes(bytes, length, separatorBytes, separatorLength);
+        return found ? (found - bytes) + separatorLength : 0;
+    };
+    
+    return [self readAvailableUnitsWithLimit:max
+                                        skip:0
+                                     measure:measure
+                             tooLargeMessage:@"The separator could not be found in socket stream"
+                                       error:errPtr];
+}
+
+- (NSArray *)readAvailableFramesWithHeaderLength:(NSUInteger)headerLength max:(NSUInteger)max error:(NSError *__autoreleasing *)errPtr
+{
+    CoSocketStatsScope(errPtr);
+    if (headerLength != 1 && headerLength != 2 && headerLength != 4 && headerLength != 8) {
+        if (errPtr) *errPtr = [self otherError:@"Frame header length must be 1, 2, 4 or 8"];
+        [self disconnect];
+        return nil;
+    }
+    
+    uint64_t maxPayload = (uint64_t)_size - headerLength;
+    
+    CoSocketUnitMeasure measure = ^NSUInteger(const char *bytes, NSUInteger length) {
+        if (length < headerLength) {
+            return 0;
+        }
+        
+        uint64_t payload = 0;
+        
+        for (NSUInteger i = 0; i < headerLength; i++) {
+            payload = (payload << 8) | (uint8_t)bytes[i];
+        }
+        
+        if (payload > maxPayload) {
+            return NSNotFound;
+        }
+        
+        return payload <= length - headerLength ? headerLength + (NSUInteger)payload : 0;
+    };
+    
+    return [self readAvailableUnitsWithLimit:max
+                                        skip:headerLength
+                                     measure:measure
+                             tooLargeMessage:@"The frame is larger than the read buffer"
+                                       error:errPtr];
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Non-blocking
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ Receives into the read-ahead buffer without waiting. Must be called with the read lock held.
+ 
+ @return YES if bytes were received. NO with *errPtr set if the read failed, and the connection is closed.
+         NO with *errPtr nil if it would block: *interest is then CoEventRead, or 0 if there is no
+         memory for a buffer and readiness won't tell when to try again.
+ */
+- (BOOL)tryFillBufferWanting:(NSUInteger)wanted interest:(CoEventMask *)interest error:(NSError **)errPtr
+{
+    *interest = 0;
+    *errPtr = nil;
+    
+    // Takes the ring's readiness before it's armed again, see readinessFileDescriptor
+    [self.sharedRing harvestEvents];
+    
+    for (;;) {
+        ssize_t justRead = [self receiveIntoBufferWanting:wanted];
+        
+        if (justRead > 0) {
+            return YES;
+        }
+        
+        if (justRead < 0 && errno == EINTR) {
+            continue;
+        }
+        
+        if (justRead < 0 && errno == EAGAIN) {
+            *interest = CoEventRead;
+            return NO;
+        }
+        
+        if (justRead < 0 && errno == ENOBUFS && !atomic_load(&_heartbeatFailed)) {
+            return NO;
+        }
+        
+        if (justRead == 0) {
+            *errPtr = [self interruptionError] ?: [self otherError:@"Peer has closed the socket"];
+        } else {
+            *errPtr = [self interruptionError] ?: [self errnoError];
+        }
+        
+        [self disconnect];
+        return NO;
+    }
+}
+
+/**
+ Sends data from *progress on, as far as the socket takes it without waiting. Must be called with the write lock held.
+ 
+ @return YES once all data was sent, or sending failed with *errPtr set and the connection closed.
+         NO if it would block, with *interest set to CoEventWrite.
+ */
+- (BOOL)trySendData:(NSData *)data progress:(NSUInteger *)progress interest:(CoEventMask *)interest error:(NSError **)errPtr
+{
+    const char *bytes = data.bytes;
+    NSUInteger length = data.length;
+    
+    *interest = 0;
+    
+    [self.sharedRing harvestEvents];
+    
+    if (_pingSent > 0 && ![self sendRestOfPing]) {
+        *interest = CoEventWrite;
+        return NO;
+    }
+    
+    while (*progress < length) {
+        ssize_t wrote = [self sendBytes:&bytes[*progress] length:length - *progress];
+        
+        if (wrote < 0) {
+            if (errno == EINTR) continue;
+            
+            if (errno == EAGAIN) {
+                *interest = CoEventWrite;
+                return NO;
+            }
+            
+            *errPtr = [self interruptionError] ?: [self errnoError];
+            [self disconnect];
+            return YES;
+        }
+        
+        // Framed as sent, the write lock is released between the steps of an asynchronous write
+        [self frameOutgoingBytes:&bytes[*progress] length:wrote];
+        *progress += wrote;
+        atomic_store(&_lastActivity, monotonic_time());
+    }
+    
+    return YES;
+}
+
+- (NSData *)tryReadDataToLength:(NSUInteger)length interest:(CoEventMask *)interestPtr error:(NSError *__autoreleasing *)errPtr
+{
+    CoSocketLockScope(&_readLock);
     
-    if (theData.length <= 0) {
-        if (errPtr) *errPtr = [self otherError:@"Socket write data length must bigger than zero"];
-        return NO;
+    CoEventMask interest = 0;
+    NSError *error = nil;
+    
+    if (length == 0 || length > _size) {
+        error = [self otherError:@"Socket read length must be bigger than zero and no bigger than the read buffer"];
+    } else {
+        for (;;) {
+            NSData * theData = [self takeBufferedDataToLength:length];
+            
+            if (theData) {
+                if (interestPtr) *interestPtr = 0;
+                return theData;
+            }
+            
+            if (![self tryFillBufferWanting:length - _bufferLength interest:&interest error:&error]) {
+                break;
+            }
+        }
     }
     
-    const char * dataBytes = theData.bytes;
-    ssize_t index = 0;
+    if (interestPtr) *interestPtr = interest;
+    if (errPtr) *errPtr = error;
+    return nil;
+}
+
+- (NSData *)tryReadDataToData:(NSData *)data interest:(CoEventMask *)interestPtr error:(NSError *__autoreleasing *)errPtr
+{
+    CoSocketLockScope(&_readLock);
+    
+    CoEventMask interest = 0;
+    NSError *error = nil;
+    
+    if (![_trySeparator isEqualToData:data]) {
+        // Positions scanned for another separator may still hold this one
+        _trySeparator = [data copy];
+        _tryScanned = _bufferConsumed;
+    }
     
-    struct timeval timeout = get_timeval(_timeout);
-    struct timeval *timeoutPtr = NULL;
-    if (_timeout>0) {
-        timeoutPtr = &timeout;
+    if (!data.length) {
+        error = [self otherError:@"Socket passed nil or zero-length data as a separator"];
+    } else {
+        for (;;) {
+            NSData * theData = [self takeBufferedDataToData:data scanned:&_tryScanned];
+            
+            if (theData) {
+                if (interestPtr) *interestPtr = 0;
+                return theData;
+            }
+            
+            if (_bufferLength >= _size) {
+                error = [self otherError:@"The separator could not be found in socket stream"];
+                [self disconnect];
+                break;
+            }
+            
+            if (![self tryFillBufferWanting:0 interest:&interest error:&error]) {
+                break;
+            }
+        }
     }
     
-    while (index < theData.length) {
-        /* We must set all this information on each select we do */
-        FD_ZERO(&writemask);   /* empty readmask */
+    if (interestPtr) *interestPtr = interest;
+    if (errPtr) *errPtr = error;
+    return nil;
+}
+
+- (NSInteger)tryWriteData:(NSData *)data interest:(CoEventMask *)interestPtr error:(NSError *__autoreleasing *)errPtr
+{
+    CoSocketLockScope(&_writeLock);
+    
+    NSUInteger progress = 0;
+    CoEventMask interest = 0;
+    NSError *error = nil;
+    
+    [self trySendData:data progress:&progress interest:&interest error:&error];
+    
+    if (interestPtr) *interestPtr = interest;
+    if (errPtr) *errPtr = error;
+    
+    return error ? -1 : (NSInteger)progress;
+}
+
+- (int)readinessFileDescriptor
+{
+    CoSharedRing *ring = self.sharedRing;
+    
+    return ring ? ring.readinessFileDescriptor : _socketFD;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Asynchronous
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ The loop the asynchronous operations run on. A socket that isn't served by a loop yet
+ goes to the shared runtime's loop of the calling thread, or the next one.
+ It isn't added to the loop's sockets: only its pending operations keep it alive, through their watchers.
+ */
+- (CoEventLoop *)reactorLoop
+{
+    @synchronized(self) {
+        CoEventLoop *loop = self.eventLoop;
         
-        /* Then we put all the descriptors we want to wait for in a */
-        /* mask = writemask */
-        FD_SET(_socketFD, &writemask);
+        if (!loop) {
+            loop = [[CoRuntime sharedRuntime] preferredLoop];
+            self.eventLoop = loop;
+        }
         
-        /* The first parameter is the biggest descriptor+1. The first one
-         was 0, so every other descriptor will be bigger.*/
-        /* readfds = we are not waiting for readfds */
-        /* writefds = &writemask */
-        /* exceptfds = we are not waiting for exception fds */
-        int select_result = select(_socketFD+1, NULL, &writemask, NULL, timeoutPtr);
+        return loop;
+    }
+}
+
+/**
+ Fails an operation that never got queued. The completion still runs after the method returned,
+ like that of any other asynchronous operation.
+ */
+- (void)failOperation:(CoSocketOperation *)operation error:(NSError *)error
+{
+    CoEventLoop *loop = self.eventLoop ?: [[CoRuntime sharedRuntime] preferredLoop];
+    
+    [loop post:^{
+        [self completeOperation:operation data:nil error:error];
+    }];
+}
+
+- (void)connectToHost:(NSString *)host onPort:(uint16_t)port withTimeout:(NSTimeInterval)timeout completion:(CoSocketCompletion)completion
+{
+    [self connectToHost:host onPort:port viaInterface:nil withTimeout:timeout completion:completion];
+}
+
+- (void)connectToHost:(NSString *)inHost
+               onPort:(uint16_t)port
+         viaInterface:(NSString *)inInterface
+          withTimeout:(NSTimeInterval)timeout
+           completion:(CoSocketCompletion)completion
+{
+    if (_logDebug) _logDebug(@"Connect to %@:%d asynchronously, with timeout %f", inHost, port, timeout);
+    
+    _timeout = timeout;
+    
+    NSString *host = [inHost copy];
+    NSString *interface = [inInterface copy];
+    
+    CoSocketOperation *operation = [[CoSocketOperation alloc] init];
+    operation->_kind = CoSocketOperationConnect;
+    operation->_completion = [completion copy];
+    operation->_deadline = [self operationDeadline];
+    
+    NSError *error = nil;
+    
+    if (!host.length) {
+        error = [self otherError:@"Invalid host parameter (nil or \"\"). Should be a domain name or IP address string."];
+    } else {
+        [self preConnectWithInterface:interface error:&error];
+    }
+    
+    if (error) {
+        [self failOperation:operation error:error];
+        return;
+    }
+    
+    CoEventLoop *loop = [self reactorLoop];
+    
+    // getaddrinfo() has no non-blocking form, it ties up an executor worker instead of the loop
+    [[CoExecutor sharedExecutor] submit:^{
+        NSError *lookupError = nil;
+        NSTimeInterval lookupStart = monotonic_time();
+        NSMutableArray *addresses = [self.class lookupHost:host port:port error:&lookupError];
+        operation->_lookupTime = monotonic_time() - lookupStart;
+        [self.traceRecorder recordSpan:"lookup" track:_traceTrack start:lookupStart end:lookupStart + operation->_lookupTime argument:NULL value:0];
         
-        if (select_result==-1) {
-            if (errPtr) *errPtr = [self errnoError];
-            [self disconnect];
-            return NO;
+        [loop post:^{
+            [self startConnectOperation:operation addresses:addresses port:port interface:interface error:lookupError];
+        }];
+    }];
+}
+
+- (void)startConnectOperation:(CoSocketOperation *)operation addresses:(NSArray *)addresses port:(uint16_t)port interface:(NSString *)interface error:(NSError *)error
+{
+    NSData *address4 = nil;
+    NSData *address6 = nil;
+    
+    error = error ?: self.context.error;
+    
+    if (error || ![self pickAddress4:&address4 address6:&address6 fromAddresses:addresses error:&error]) {
+        [self disconnect];
+        [self completeOperation:operation data:nil error:error];
+        return;
+    }
+    
+    operation->_upgradeLoopback = [self shouldUpgradeLoopbackAddress4:address4 address6:address6 interface:interface];
+    
+    NSData *address = [self openSocketWithAddress4:address4 address6:address6 error:&error];
+    
+    if (!address || [self failIfCancelled:&error]) {
+        [self completeOperation:operation data:nil error:error];
+        return;
+    }
+    
+    if (connect(_socketFD, (const struct sockaddr *)address.bytes, (socklen_t)address.length) == 0) {
+        [self didConnect];
+        [self finishConnectOperation:operation];
+        [self progressOperations];
+        return;
+    }
+    
+    if (errno != EINPROGRESS) {
+        error = [self errnoError];
+        [self disconnect];
+        [self completeOperation:operation data:nil error:error];
+        return;
+    }
+    
+    // Writable once connected, or failed
+    _connectOperation = operation;
+    [self armDeadlineOfOperation:operation];
+    [self progressOperations];
+}
+
+- (void)writeData:(NSData *)data completion:(CoSocketCompletion)completion
+{
+    CoSocketOperation *operation = [[CoSocketOperation alloc] init];
+    operation->_kind = CoSocketOperationWrite;
+    operation->_data = [data copy];
+    operation->_completion = [completion copy];
+    
+    if (!data.length) {
+        [self failOperation:operation error:[self otherError:@"Socket write data length must bigger than zero"]];
+        return;
+    }
+    
+    [self enqueueOperation:operation];
+}
+
+- (void)readDataToLength:(NSUInteger)length completion:(CoSocketReadCompletion)completion
+{
+    CoSocketOperation *operation = [[CoSocketOperation alloc] init];
+    operation->_kind = CoSocketOperationReadToLength;
+    operation->_length = length;
+    operation->_completion = [completion copy];
+    
+    if (length == 0) {
+        [self failOperation:operation error:[self otherError:@"Socket read length must bigger than zero"]];
+        return;
+    }
+    
+    if (length > _size) {
+        operation->_received = [NSMutableData dataWithLength:length];
+    }
+    
+    [self enqueueOperation:operation];
+}
+
+- (void)readDataToData:(NSData *)data completion:(CoSocketReadCompletion)completion
+{
+    CoSocketOperation *operation = [[CoSocketOperation alloc] init];
+    operation->_kind = CoSocketOperationReadToData;
+    operation->_data = [data copy];
+    operation->_completion = [completion copy];
+    
+    if (!data.length) {
+        [self failOperation:operation error:[self otherError:@"Socket passed nil or zero-length data as a separator"]];
+        return;
+    }
+    
+    [self enqueueOperation:operation];
+}
+
+- (void)readBufferWithReader:(CoSocketBufferReader)reader completion:(CoSocketCompletion)completion
+{
+    CoSocketOperation *operation = [[CoSocketOperation alloc] init];
+    operation->_kind = CoSocketOperationReadBuffer;
+    operation->_reader = [reader copy];
+    operation->_completion = [completion copy];
+    
+    [self enqueueOperation:operation];
+}
+
+/**
+ Queues a read or write on the socket's loop. Like the blocking methods, each gets the socket's timeout from now.
+ */
+- (void)enqueueOperation:(CoSocketOperation *)operation
+{
+    operation->_deadline = [self operationDeadline];
+    
+    [[self reactorLoop] post:^{
+        if (operation->_kind == CoSocketOperationWrite) {
+            [_writeOperations addObject:operation];
+        } else {
+            operation->_scanned = _bufferConsumed;
+            [_readOperations addObject:operation];
         }
         
-        if (select_result==0) {     // Timeout
-            errno = ETIMEDOUT;
-            if (errPtr) *errPtr = [self errnoErrorWithReason:@"Socket write timed out"];
-            
-            [self disconnect];
-            return NO;
-        }
+        [self armDeadlineOfOperation:operation];
+        [self progressOperations];
+    }];
+}
+
+- (void)armDeadlineOfOperation:(CoSocketOperation *)operation
+{
+    if (operation->_deadline <= 0) {
+        return;
+    }
+    
+    __weak CoSocket *weakSelf = self;
+    operation->_timer = [self.timingWheel scheduleTimerWithTimeInterval:operation->_deadline - monotonic_time() handler:^{
+        [weakSelf operationTimedOut:operation];
+    }];
+}
+
+- (void)operationTimedOut:(CoSocketOperation *)operation
+{
+    NSString *reason = nil;
+    
+    if (operation == _connectOperation) {
+        _connectOperation = nil;
+        reason = @"Socket connect timed out";
+    } else if ([_readOperations containsObject:operation]) {
+        [_readOperations removeObjectIdenticalTo:operation];
+        reason = @"Socket read timed out";
+    } else if ([_writeOperations containsObject:operation]) {
+        [_writeOperations removeObjectIdenticalTo:operation];
+        reason = @"Socket write timed out";
+    } else {
+        return;
+    }
+    
+    // Same as the blocking methods, a timed out operation closes the connection
+    errno = ETIMEDOUT;
+    NSError *error = [self errnoErrorWithReason:reason];
+    [self disconnect];
+    [self completeOperation:operation data:nil error:error];
+    
+    [self progressOperations];
+}
+
+/**
+ Runs the operations at the heads of the queues as far as the socket allows, then waits for readiness.
+ Runs on the loop's thread.
+ */
+- (void)progressOperations
+{
+    _awaitedEvents = 0;
+    
+    if (_connectOperation) {
+        [self progressConnect];
+    }
+    
+    if (!_connectOperation) {
+        [self progressQueue:_readOperations lock:&_readLock];
+        [self progressQueue:_writeOperations lock:&_writeLock];
+    }
+    
+    [self updateWatchedEvents];
+}
+
+- (void)progressConnect
+{
+    CoSocketOperation *operation = _connectOperation;
+    
+    if (operation->_upgrading) {
+        // The executor running the upgrade finishes the operation, also when it failed
+        return;
+    }
+    
+    if (_socketFD == SOCKET_NULL) {
+        // Disconnected meanwhile
+        _connectOperation = nil;
+        errno = EBADF;
+        [self completeOperation:operation data:nil error:[self errnoError]];
+        return;
+    }
+    
+    struct pollfd pfd = { .fd = _socketFD, .events = POLLOUT, .revents = 0 };
+    
+    if (poll(&pfd, 1, 0) == 0) {
+        _awaitedEvents |= CoEventWrite;
+        return;
+    }
+    
+    _connectOperation = nil;
+    
+    int error = 0;
+    socklen_t len = sizeof(error);
+    
+    if (getsockopt(_socketFD, SOL_SOCKET, SO_ERROR, &error, &len) != 0 || error) {
+        if (error) errno = error;
+        NSError *connectError = [self cancellationError] ?: [self errnoError];
+        [self disconnect];
+        [self completeOperation:operation data:nil error:connectError];
+        return;
+    }
+    
+    if (_logDebug) _logDebug(@"Socket is connected successfully");
+    
+    [self didConnect];
+    [self finishConnectOperation:operation];
+}
+
+/**
+ Completes a connect whose TCP connection is up, after the loopback upgrade if it was asked for.
+ */
+- (void)finishConnectOperation:(CoSocketOperation *)operation
+{
+    if (!operation->_upgradeLoopback) {
+        [self completeOperation:operation data:nil error:nil];
+        return;
+    }
+    
+    // Operations queued meanwhile wait for the upgrade, which reads and writes the socket
+    operation->_upgrading = YES;
+    _connectOperation = operation;
+    
+    CoEventLoop *loop = [self reactorLoop];
+    
+    // The handshake blocks, like the lookup it ties up an executor worker instead of the loop
+    [[CoExecutor sharedExecutor] submit:^{
+        int unixFD = SOCKET_NULL;
+        NSError *error = nil;
+        BOOL negotiated = [self negotiateLoopbackUpgrade:&unixFD error:&error];
         
-        /* If something was received */
-        if (FD_ISSET(_socketFD, &writemask)) {
-            ssize_t toWrite = MIN((theData.length - index), _size);
+        [loop post:^{
+            if (self->_connectOperation != operation) {
+                // Timed out meanwhile
+                if (unixFD != SOCKET_NULL) {
+                    close(unixFD);
+                }
+                return;
+            }
             
-            ssize_t wrote = send(_socketFD, &dataBytes[index], toWrite, 0);
+            self->_connectOperation = nil;
+            NSError *upgradeError = negotiated ? nil : error;
             
-            if (wrote == 0) {
-                // socket has been closed or shutdown for send
-                if (errPtr) *errPtr = [self otherError:@"Peer has closed the socket"];
-                [self disconnect];
-                return NO;
+            if (unixFD != SOCKET_NULL && ![self switchToUpgradedSocketFD:unixFD]) {
+                errno = EBADF;
+                upgradeError = [self interruptionError] ?: [self errnoError];
+            }
+            
+            [self completeOperation:operation data:nil error:upgradeError];
+            [self progressOperations];
+        }];
+    }];
+}
+
+- (void)progressQueue:(NSMutableArray *)queue lock:(pthread_mutex_t *)lock
+{
+    while (queue.count > 0) {
+        // A blocking read or write on another thread owns this direction of the stream for now
+        if (pthread_mutex_trylock(lock) != 0) {
+            [self retryOperationsSoon];
+            return;
+        }
+        
+        CoSocketOperation *operation = queue[0];
+        NSData *data = nil;
+        NSError *error = nil;
+        BOOL done = (operation->_kind == CoSocketOperationWrite) ?
+            [self stepWriteOperation:operation error:&error] :
+            [self stepReadOperation:operation data:&data error:&error];
+        
+        pthread_mutex_unlock(lock);
+        
+        if (!done) {
+            return;
+        }
+        
+        [queue removeObjectAtIndex:0];
+        [self completeOperation:operation data:data error:error];
+    }
+}
+
+/**
+ Reads what the read-ahead buffer and the socket have without waiting. Must be called with the read lock held.
+ 
+ @return YES once the operation completed or failed, NO when it has to wait.
+ */
+- (BOOL)stepReadOperation:(CoSocketOperation *)operation data:(NSData **)dataPtr error:(NSError **)errPtr
+{
+    for (;;) {
+        if (operation->_kind == CoSocketOperationReadBuffer) {
+            if (_bufferLength > 0) {
+                [self lendBufferToReader:operation->_reader];
+                return YES;
+            }
+        } else if (operation->_kind == CoSocketOperationReadToData) {
+            if ((*dataPtr = [self takeBufferedDataToData:operation->_data scanned:&operation->_scanned])) {
+                return YES;
             }
             
-            if (wrote < 0) {
-                if (errPtr) *errPtr = [self errnoError];
+            if (_bufferLength >= _size) {
+                *errPtr = [self otherError:@"The separator could not be found in socket stream"];
                 [self disconnect];
-                return NO;
+                return YES;
             }
+        } else if (operation->_received) {
+            NSUInteger progress = operation->_progress;
+            [self takeBufferedBytesInto:operation->_received progress:&progress];
+            operation->_progress = progress;
             
-            index += wrote;
+            if (progress == operation->_length) {
+                *dataPtr = operation->_received;
+                return YES;
+            }
+        } else if ((*dataPtr = [self takeBufferedDataToLength:operation->_length])) {
+            return YES;
+        }
+        
+        NSUInteger wanted = 0;
+        if (operation->_kind == CoSocketOperationReadToLength) {
+            wanted = operation->_received ? operation->_length - operation->_progress : operation->_length - _bufferLength;
+        }
+        
+        CoEventMask interest = 0;
+        
+        if ([self tryFillBufferWanting:wanted interest:&interest error:errPtr]) {
+            continue;
+        }
+        
+        if (*errPtr) {
+            return YES;
+        }
+        
+        if (interest) {
+            _awaitedEvents |= interest;
+        } else {
+            // Over the memory budget, leave the data in the kernel for a while
+            [self retryOperationsSoon];
         }
+        
+        return NO;
     }
+}
+
+/**
+ Writes what the socket takes without waiting. Must be called with the write lock held.
+ 
+ @return YES once the operation completed or failed, NO when it has to wait.
+ */
+- (BOOL)stepWriteOperation:(CoSocketOperation *)operation error:(NSError **)errPtr
+{
+    NSUInteger progress = operation->_progress;
+    CoEventMask interest = 0;
+    BOOL done = [self trySendData:operation->_data progress:&progress interest:&interest error:errPtr];
     
-    return YES;
+    operation->_progress = progress;
+    _awaitedEvents |= interest;
+    
+    return done;
 }
 
-- (NSData *)readDataToLength:(NSUInteger)length error:(NSError *__autoreleasing *)errPtr
+/**
+ Watches the socket for whatever the head operations wait for, and nothing else,
+ since the loop's watchers are level triggered.
+ */
+- (void)updateWatchedEvents
 {
-    fd_set readmask;
+    CoEventLoop *loop = self.eventLoop;
+    int socketFD = _socketFD;
     
-    if (length == 0) {
-        if (errPtr) *errPtr = [self otherError:@"Socket read length must bigger than zero"];
-        [self disconnect];
-        return nil;
-    }
+    // Over shared memory, the ring's descriptor becomes readable for either direction
+    CoSharedRing *ring = socketFD != SOCKET_NULL ? self.sharedRing : nil;
+    int watchFD = ring ? ring.readinessFileDescriptor : socketFD;
+    CoEventMask events = ring && _awaitedEvents ? CoEventRead : _awaitedEvents;
     
-    struct timeval timeout = get_timeval(_timeout);
-    struct timeval *timeoutPtr = NULL;
-    if (_timeout>0) {
-        timeoutPtr = &timeout;
+    if (_watchedFD != SOCKET_NULL && (_watchedFD != watchFD || events == 0)) {
+        [loop unwatchFileDescriptor:_watchedFD];
+        _watchedFD = SOCKET_NULL;
     }
     
-    ssize_t hasRead = 0;
-    while (hasRead < length) {
-        /* We must set all this information on each select we do */
-        FD_ZERO(&readmask);   /* empty readmask */
-        
-        /* Then we put all the descriptors we want to wait for in a */
-        /* mask = readmask */
-        FD_SET(_socketFD, &readmask);
-        
-        /* The first parameter is the biggest descriptor+1. The first one
-         was 0, so every other descriptor will be bigger.*/
-        /* readfds = &readmask */
-        /* writefds = we are not waiting for writefds */
-        /* exceptfds = we are not waiting for exception fds */
-        int select_result = select(_socketFD+1, &readmask, NULL, NULL, timeoutPtr);
-        if (select_result==-1) {    // On error
-            if (errPtr) *errPtr = [self errnoError];
-            [self disconnect];
-            return nil;
-        }
-        
-        if (select_result==0) {     // Timeout
-            errno = ETIMEDOUT;
-            if (errPtr) *errPtr = [self errnoErrorWithReason:@"Socket read timed out"];
-            
-            [self disconnect];
-            return nil;
-        }
-        
-        /* If something was received */
-        if (FD_ISSET(_socketFD, &readmask)) {
-            ssize_t toRead = MIN( (length - hasRead), _size);
-            
-            ssize_t justRead = recv(_socketFD, &_buffer[hasRead], toRead, 0);
-            
-            if (justRead == 0) {
-                // socket has been closed or shutdown for send
-                if (errPtr) *errPtr = [self otherError:@"Peer has closed the socket"];
-                [self disconnect];
-                return nil;
-            }
-            
-            if (justRead < 0) {
-                if (errPtr) *errPtr = [self errnoError];
-                [self disconnect];
-                return nil;
-            }
-            
-            hasRead += justRead;
-        }
+    if (events == 0 || watchFD == SOCKET_NULL) {
+        return;
     }
     
-    NSData * theData = [NSData dataWithBytes:_buffer length:hasRead];
-    return theData;
+    // The watcher keeps the socket alive while operations wait on it
+    if ([loop watchFileDescriptor:watchFD events:events handler:^(CoEventMask events) {
+        [self progressOperations];
+    } error:NULL]) {
+        _watchedFD = watchFD;
+    }
 }
 
-
-- (NSData *)readDataToData:(NSData *)data error:(NSError *__autoreleasing *)errPtr
+/**
+ Tries again after a millisecond, when no readiness event will tell when to.
+ */
+- (void)retryOperationsSoon
 {
-    fd_set readmask;
-    
-    if (!data.length) {
-        if (errPtr) *errPtr = [self otherError:@"Socket passed nil or zero-length data as a separator"];
-        [self disconnect];
-        return nil;
+    if (_retryScheduled) {
+        return;
     }
     
-    ssize_t hasRead     = 0;
+    _retryScheduled = YES;
+    
+    // Like a watcher, the retry keeps the socket alive until its operations ran
+    [self.timingWheel scheduleTimerWithTimeInterval:0.001 handler:^{
+        self->_retryScheduled = NO;
+        [self progressOperations];
+    }];
+}
+
+- (void)completeOperation:(CoSocketOperation *)operation data:(NSData *)data error:(NSError *)error
+{
+    [operation->_timer cancel];
+    operation->_timer = nil;
+    
+    [self asynchronousOperationDidFinish:operation data:data error:error];
     
-    const char *separator   = (const char*)data.bytes;
-    NSUInteger cursor       = 0;
-    NSUInteger terminal     = data.length;
+    id completion = operation->_completion;
+    BOOL isRead = (operation->_kind == CoSocketOperationReadToLength || operation->_kind == CoSocketOperationReadToData);
     
-    struct timeval timeout = get_timeval(_timeout);
-    struct timeval *timeoutPtr = NULL;
-    if (_timeout>0) {
-        timeoutPtr = &timeout;
+    if (!completion) {
+        return;
     }
     
-    while (cursor < terminal) {
-        /* We must set all this information on each select we do */
-        FD_ZERO(&readmask);   /* empty readmask */
-        
-        /* Then we put all the descriptors we want to wait for in a */
-        /* mask = readmask */
-        FD_SET(_socketFD, &readmask);
-        
-        /* The first parameter is the biggest descriptor+1. The first one
-         was 0, so every other descriptor will be bigger.*/
-        /* readfds = &readmask */
-        /* writefds = we are not waiting for writefds */
-        /* exceptfds = we are not waiting for exception fds */
-        int select_result = select(_socketFD+1, &readmask, NULL, NULL, timeoutPtr);
-        if (select_result==-1) {
-            if (errPtr) *errPtr = [self errnoError];
-            [self disconnect];
-            return nil;
-        }
-        
-        if (select_result==0) {     // Timeout
-            errno = ETIMEDOUT;
-            if (errPtr) *errPtr = [self errnoErrorWithReason:@"Socket read timed out"];
-            [self disconnect];
-            return nil;
-        }
-        
-        /* If something was received */
-        if (FD_ISSET(_socketFD, &readmask)) {
-            if ( hasRead >= _size ) {
-                if (errPtr) *errPtr = [self otherError:@"The separator could not be found in socket stream"];
-                [self disconnect];
-                return nil;
-            }
-            
-            ssize_t justRead = recv(_socketFD, &_buffer[hasRead], 1, 0);
-            
-            if (justRead == 0) {
-                // socket has been closed or shutdown for send
-                if (errPtr) *errPtr = [self otherError:@"Peer has closed the socket"];
-                [self disconnect];
-                return nil;
-            }
-            
-            if (justRead < 0) {
-                if (errPtr) *errPtr = [self errnoError];
-                [self disconnect];
-                return nil;
-            }
-            
-            if ( ((const char*)_buffer)[hasRead] == separator[cursor]) {
-                cursor++;
-            } else {
-                cursor = 0;
-            }
-            
-            hasRead += justRead;
+    void (^deliver)(void) = ^{
+        if (isRead) {
+            ((CoSocketReadCompletion)completion)(data, error);
+        } else {
+            ((CoSocketCompletion)completion)(error);
         }
-    }
+    };
     
-    NSData * theData = [NSData dataWithBytes:_buffer length:hasRead];
-    return theData;
+    dispatch_queue_t queue = self.completionQueue;
+    CoEventLoop *loop = self.eventLoop;
+    
+    if (queue) {
+        dispatch_async(queue, deliver);
+    } else if (loop && !loop.isCurrent) {
+        // Never call back the caller before the method returns
+        [loop post:deliver];
+    } else {
+        deliver();
+    }
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -725,7 +4089,7 @@ static int connect_timeout(int sockfd, const struct sockaddr *address, socklen_t
     int error = 0;
     socklen_t len = sizeof (error);
     int retval = getsockopt (_socketFD, SOL_SOCKET, SO_ERROR, &error, &len );
-    return retval==0;
+    return retval==0 && !atomic_load(&_heartbeatFailed);
 }
 
 - (NSString *)connectedHost
@@ -780,6 +4144,46 @@ static int connect_timeout(int sockfd, const struct sockaddr *address, socklen_t
     return result;
 }
 
+- (BOOL)isMultipath
+{
+#if defined(__linux__) && defined(MPTCP_INFO)
+    struct mptcp_info info;
+    socklen_t len = sizeof(info);
+    
+    // A connection that fell back to TCP reports an empty MPTCP_INFO
+    if (getsockopt(_socketFD, SOL_MPTCP, MPTCP_INFO, &info, &len) == 0 && len > 0) {
+        return YES;
+    }
+#endif
+    return NO;
+}
+
+- (NSDictionary *)multipathInfo
+{
+#if defined(__linux__) && defined(MPTCP_INFO)
+    struct mptcp_info info;
+    socklen_t len = sizeof(info);
+    memset(&info, 0, sizeof(info));
+    
+    if (getsockopt(_socketFD, SOL_MPTCP, MPTCP_INFO, &info, &len) != 0 || len == 0) {
+        return nil;
+    }
+    
+    return @{
+             @"subflows"             : @(info.mptcpi_subflows),
+             @"subflowsMax"          : @(info.mptcpi_subflows_max),
+             @"addAddrSignal"        : @(info.mptcpi_add_addr_signal),
+             @"addAddrAccepted"      : @(info.mptcpi_add_addr_accepted),
+             @"localAddrUsed"        : @(info.mptcpi_local_addr_used),
+             @"localAddrMax"         : @(info.mptcpi_local_addr_max),
+             @"flags"                : @(info.mptcpi_flags),
+             @"token"                : @(info.mptcpi_token),
+             };
+#else
+    return nil;
+#endif
+}
+
 - (BOOL)isIPv4
 {
     return [self.class isIPv4Address:[self localAddress]];
@@ -837,7 +4241,9 @@ static int connect_timeout(int sockfd, const struct sockaddr *address, socklen_t
         struct sockaddr_in sockaddr4;
         memset(&sockaddr4, 0, sizeof(sockaddr4));
         
+#ifdef SIN6_LEN
         sockaddr4.sin_len         = sizeof(sockaddr4);
+#endif
         sockaddr4.sin_family      = AF_INET;
         sockaddr4.sin_port        = htons(port);
         sockaddr4.sin_addr.s_addr = htonl(INADDR_ANY);
@@ -845,7 +4251,9 @@ static int connect_timeout(int sockfd, const struct sockaddr *address, socklen_t
         struct sockaddr_in6 sockaddr6;
         memset(&sockaddr6, 0, sizeof(sockaddr6));
         
+#ifdef SIN6_LEN
         sockaddr6.sin6_len       = sizeof(sockaddr6);
+#endif
         sockaddr6.sin6_family    = AF_INET6;
         sockaddr6.sin6_port      = htons(port);
         sockaddr6.sin6_addr      = in6addr_any;
@@ -858,7 +4266,9 @@ static int connect_timeout(int sockfd, const struct sockaddr *address, socklen_t
         struct sockaddr_in sockaddr4;
         memset(&sockaddr4, 0, sizeof(sockaddr4));
         
+#ifdef SIN6_LEN
         sockaddr4.sin_len         = sizeof(sockaddr4);
+#endif
         sockaddr4.sin_family      = AF_INET;
         sockaddr4.sin_port        = htons(port);
         sockaddr4.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
@@ -866,7 +4276,9 @@ static int connect_timeout(int sockfd, const struct sockaddr *address, socklen_t
         struct sockaddr_in6 sockaddr6;
         memset(&sockaddr6, 0, sizeof(sockaddr6));
         
+#ifdef SIN6_LEN
         sockaddr6.sin6_len       = sizeof(sockaddr6);
+#endif
         sockaddr6.sin6_family    = AF_INET6;
         sockaddr6.sin6_port      = htons(port);
         sockaddr6.sin6_addr      = in6addr_loopback;
@@ -882,7 +4294,9 @@ static int connect_timeout(int sockfd, const struct sockaddr *address, socklen_t
         if ((getifaddrs(&addrs) == 0)) {
             cursor = addrs;
             while (cursor != NULL) {
-                if ((addr4 == nil) && (cursor->ifa_addr->sa_family == AF_INET)) {
+                if (cursor->ifa_addr == NULL) {
+                    // Linux lists interfaces without an address (e.g. tun devices that are down)
+                } else if ((addr4 == nil) && (cursor->ifa_addr->sa_family == AF_INET)) {
                     // IPv4
                     
                     struct sockaddr_in nativeAddr4;
@@ -957,14 +4371,18 @@ static int connect_timeout(int sockfd, const struct sockaddr *address, socklen_t
     if ([host isEqualToString:@"localhost"] || [host isEqualToString:@"loopback"]) {
         // Use LOOPBACK address
         struct sockaddr_in nativeAddr4;
+#ifdef SIN6_LEN
         nativeAddr4.sin_len         = sizeof(struct sockaddr_in);
+#endif
         nativeAddr4.sin_family      = AF_INET;
         nativeAddr4.sin_port        = htons(port);
         nativeAddr4.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
         memset(&(nativeAddr4.sin_zero), 0, sizeof(nativeAddr4.sin_zero));
         
         struct sockaddr_in6 nativeAddr6;
+#ifdef SIN6_LEN
         nativeAddr6.sin6_len        = sizeof(struct sockaddr_in6);
+#endif
         nativeAddr6.sin6_family     = AF_INET6;
         nativeAddr6.sin6_port       = htons(port);
         nativeAddr6.sin6_flowinfo   = 0;
@@ -1055,6 +4473,14 @@ static int connect_timeout(int sockfd, const struct sockaddr *address, socklen_t
         return [NSString stringWithCString:addrBuf encoding:NSASCIIStringEncoding];
     }
     
+    if (pSockaddr->sa_family == AF_UNIX) {
+        const struct sockaddr_un *pSockaddrUn = (const struct sockaddr_un *)pSockaddr;
+        
+        size_t pathLength = strnlen(pSockaddrUn->sun_path, sizeof(pSockaddrUn->sun_path));
+        
+        return [[NSString alloc] initWithBytes:pSockaddrUn->sun_path length:pathLength encoding:NSUTF8StringEncoding];
+    }
+    
     return nil;
 }
 
@@ -1119,6 +4545,37 @@ static int connect_timeout(int sockfd, const struct sockaddr *address, socklen_t
     return NO;
 }
 
++ (BOOL)isLoopbackAddress:(NSData *)address
+{
+    if ([self isIPv4Address:address] && [address length] >= sizeof(struct sockaddr_in)) {
+        const struct sockaddr_in *sockaddr4 = [address bytes];
+        
+        // The whole 127.0.0.0/8 block is loopback
+        return (ntohl(sockaddr4->sin_addr.s_addr) >> 24) == IN_LOOPBACKNET;
+    }
+    
+    if ([self isIPv6Address:address] && [address length] >= sizeof(struct sockaddr_in6)) {
+        const struct sockaddr_in6 *sockaddr6 = [address bytes];
+        
+        return IN6_IS_ADDR_LOOPBACK(&sockaddr6->sin6_addr);
+    }
+    
+    return NO;
+}
+
++ (BOOL)isUnixAddress:(NSData *)address
+{
+    if ([address length] >= sizeof(sa_family_t)) {
+        const struct sockaddr *sockaddrX = [address bytes];
+        
+        if (sockaddrX->sa_family == AF_UNIX) {
+            return YES;
+        }
+    }
+    
+    return NO;
+}
+
 + (BOOL)getHost:(NSString **)hostPtr port:(uint16_t *)portPtr fromAddress:(NSData *)address
 {
     return [self getHost:hostPtr port:portPtr family:NULL fromAddress:address];
@@ -1160,12 +4617,100 @@ static int connect_timeout(int sockfd, const struct sockaddr *address, socklen_t
 
 @end
 
-static struct timeval get_timeval(NSTimeInterval interval)
+static NSTimeInterval monotonic_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+/**
+ CPU time the calling thread has used, in user and system mode. Unlike the wall clock it stands still while blocked.
+ */
+static NSTimeInterval thread_cpu_time(void)
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) {
+        return 0;
+    }
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+/**
+ Converts a per-operation timeout into an absolute monotonic deadline.
+ A zero or negative timeout means no timeout, which is returned as a zero deadline.
+ */
+static NSTimeInterval deadline_from_timeout(NSTimeInterval timeout)
+{
+    return timeout > 0 ? monotonic_time() + timeout : 0;
+}
+
+/**
+ Creates a non-blocking, close-on-exec socket.
+ Linux and the BSDs do this in a single socket() call, Darwin needs the extra fcntl() calls.
+ */
+static int create_socket(int domain, int type, int protocol)
+{
+#if defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC)
+    return socket(domain, type | SOCK_NONBLOCK | SOCK_CLOEXEC, protocol);
+#else
+    int sockfd = socket(domain, type, protocol);
+    if (sockfd == SOCKET_NULL) {
+        return SOCKET_NULL;
+    }
+    
+    if (fcntl(sockfd, F_SETFL, O_NONBLOCK) == -1 || fcntl(sockfd, F_SETFD, FD_CLOEXEC) == -1) {
+        int error = errno;
+        close(sockfd);
+        errno = error;
+        return SOCKET_NULL;
+    }
+    
+    return sockfd;
+#endif
+}
+
+/**
+ Waits until the socket is ready for the given poll() events or the deadline passes.
+ 
+ poll() is used rather than select() because select() can't watch descriptors above FD_SETSIZE,
+ which busy servers easily go beyond.
+ 
+ @return 1 if the socket is ready, 0 on timeout, -1 on error with errno set.
+ */
+static int wait_for_socket(int sockfd, short events, NSTimeInterval deadline)
 {
-    struct timeval tval;
-    tval.tv_sec = (int)floor(interval);
-    tval.tv_usec = (int)(1e6 * (interval - tval.tv_sec));
-    return tval;
+    if (sockfd < 0) {
+        // poll() would ignore it and wait out the whole timeout
+        errno = EBADF;
+        return -1;
+    }
+    
+    struct pollfd pfd = { .fd = sockfd, .events = events, .revents = 0 };
+    
+    for (;;) {
+        int timeout_ms = -1;
+        if (deadline > 0) {
+            NSTimeInterval remaining = deadline - monotonic_time();
+            timeout_ms = remaining > 0 ? (int)ceil(remaining * 1000) : 0;
+        }
+        
+        NSTimeInterval waitStart = stats_clock();
+        int result = poll(&pfd, 1, timeout_ms);
+        record_wait(events, waitStart);
+        
+        if (result == -1 && errno == EINTR) {
+            continue;
+        }
+        
+        if (result > 0 && (pfd.revents & POLLNVAL)) {
+            // Same as select() reports for a closed descriptor
+            errno = EBADF;
+            return -1;
+        }
+        
+        return result > 0 ? 1 : result;
+    }
 }
 
 #if 0
@@ -1179,8 +4724,10 @@ static NSTimeInterval get_interval(struct timeval tv)
 /**
  This method is adapted from section 16.3 in Unix Network Programming (2003) by Richard Stevens et al.
  See http://books.google.com/books?id=ptSC4LpwGA0C&lpg=PP1&pg=PA448
+ 
+ The socket is left open on failure, the caller owns it and disconnects.
  */
-static int connect_timeout(int sockfd, const struct sockaddr *address, socklen_t address_len, struct timeval * timeout, CoSocketLogHandler logDebug)
+static int connect_timeout(int sockfd, const struct sockaddr *address, socklen_t address_len, NSTimeInterval deadline, CoSocketLogHandler logDebug)
 {
 	int error = 0;
 	
@@ -1198,41 +4745,30 @@ static int connect_timeout(int sockfd, const struct sockaddr *address, socklen_t
 		goto done;
 	}
 	
-	// Call select() to wait for the connection.
-    // NOTE: If timeout is zero, then pass NULL in order to use default timeout. Zero seconds indicates no waiting.
-    fd_set rset, wset;
-	FD_ZERO(&rset);
-	FD_SET(sockfd, &rset);
-	wset = rset;
-    
-    result = select(sockfd + 1, &rset, &wset, NULL, timeout);
+	// Wait for the connection. A zero deadline waits for as long as the system allows.
+    result = wait_for_socket(sockfd, POLLIN | POLLOUT, deadline);
     
     if (result==-1) {
-        if (logDebug) logDebug(@"Socket select() failed");
-        close(sockfd);
+        if (logDebug) logDebug(@"Socket poll() failed");
         return -1;
     }
     
 	if (result == 0) {
-		close(sockfd);
         errno = ETIMEDOUT;
         if (logDebug) logDebug(@"Socket connect timed out");
 		return -1;
 	}
 	
-	// Check whether the connection succeeded. If the socket is readable or writable, check for an error.
-	if (FD_ISSET(sockfd, &rset) || FD_ISSET(sockfd, &wset)) {
-		socklen_t len = sizeof(error);
-        if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &len) != 0) {
-            if (logDebug) logDebug(@"Failed to set socket option SO_ERROR");
-			return -1;
-		}
+	// Check whether the connection succeeded. The socket is readable or writable, check for an error.
+	socklen_t len = sizeof(error);
+    if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &len) != 0) {
+        if (logDebug) logDebug(@"Failed to set socket option SO_ERROR");
+		return -1;
 	}
 	
 done:
 	// NOTE: On some systems, getsockopt() will fail and set errno. On others, it will succeed and set the error parameter.
     if (error) {
-		close(sockfd);
 		errno = error;
 		return -1;
     }
@@ -1240,3 +4776,152 @@ done:
     if (logDebug) logDebug(@"Socket is connected successfully");
 	return 0;
 }
+
+/**
+ Returns the number of bytes written to the socket but not acknowledged by the peer yet, or -1 with errno set.
+ */
+static int unsent_bytes(int sockfd)
+{
+    int pending = 0;
+    
+#if defined(SIOCOUTQ)
+    if (ioctl(sockfd, SIOCOUTQ, &pending) != 0) {
+        return -1;
+    }
+#elif defined(SO_NWRITE)
+    socklen_t len = sizeof(pending);
+    if (getsockopt(sockfd, SOL_SOCKET, SO_NWRITE, &pending, &len) != 0) {
+        return -1;
+    }
+#else
+    errno = ENOTSUP;
+    return -1;
+#endif
+    
+    return pending;
+}
+
+/**
+ Resets a connection without sending a FIN, dropping unsent data, and wakes up threads blocked on it.
+ */
+static void abort_connection(int sockfd)
+{
+    // close() then sends a RST, leaving no TIME_WAIT entry behind
+    struct linger linger = { .l_onoff = 1, .l_linger = 0 };
+    setsockopt(sockfd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    
+#ifdef __linux__
+    // Disconnecting a TCP socket sends the RST right away, rather than once no thread is polling it any more
+    struct sockaddr unspec = { .sa_family = AF_UNSPEC };
+    if (connect(sockfd, &unspec, sizeof(unspec)) == 0) {
+        return;
+    }
+#endif
+    
+    // Wakes blocked readers, but unlike SHUT_WR doesn't queue a FIN behind unsent data
+    shutdown(sockfd, SHUT_RD);
+}
+
+/**
+ Returns the first occurrence of needle in haystack, or NULL.
+ memchr() is vectorized by every libc, so candidates are found many bytes at a time.
+ */
+static const void *find_bytes(const void *haystack, size_t length, const void *needle, size_t needleLength)
+{
+    const unsigned char *cursor = haystack;
+    const unsigned char *end = cursor + length;
+    const unsigned char first = *(const unsigned char *)needle;
+    
+    while ((size_t)(end - cursor) >= needleLength) {
+        cursor = memchr(cursor, first, (end - cursor) - needleLength + 1);
+        
+        if (cursor == NULL) {
+            return NULL;
+        }
+        
+        if (memcmp(cursor, needle, needleLength) == 0) {
+            return cursor;
+        }
+        
+        cursor++;
+    }
+    
+    return NULL;
+}
+
+/**
+ Returns the length of the leading run of ASCII bytes, checking 16 at a time with SSE2 or NEON.
+ */
+static size_t ascii_prefix_length(const unsigned char *bytes, size_t length)
+{
+    size_t i = 0;
+    
+#if defined(__SSE2__)
+    for (; i + 16 <= length; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(bytes + i));
+        
+        if (_mm_movemask_epi8(chunk) != 0) {
+            break;
+        }
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    for (; i + 16 <= length; i += 16) {
+        if (vmaxvq_u8(vld1q_u8(bytes + i)) >= 0x80) {
+            break;
+        }
+    }
+#endif
+    
+    while (i < length && bytes[i] < 0x80) {
+        i++;
+    }
+    
+    return i;
+}
+
+/**
+ Validates UTF-8 as RFC 3629 defines it: no overlong forms, no surrogates, nothing above U+10FFFF.
+ Runs of ASCII in between are skipped with ascii_prefix_length().
+ */
+static BOOL is_valid_utf8(const unsigned char *bytes, size_t length)
+{
+    size_t i = 0;
+    
+    for (;;) {
+        i += ascii_prefix_length(bytes + i, length - i);
+        
+        if (i == length) {
+            return YES;
+        }
+        
+        unsigned char lead = bytes[i];
+        unsigned char min = 0x80, max = 0xBF;  // Range of the second byte
+        size_t trailing;
+        
+        if (lead >= 0xC2 && lead <= 0xDF) {
+            trailing = 1;
+        } else if (lead >= 0xE0 && lead <= 0xEF) {
+            trailing = 2;
+            if (lead == 0xE0) min = 0xA0;   // Overlong
+            if (lead == 0xED) max = 0x9F;   // Surrogates
+        } else if (lead >= 0xF0 && lead <= 0xF4) {
+            trailing = 3;
+            if (lead == 0xF0) min = 0x90;   // Overlong
+            if (lead == 0xF4) max = 0x8F;   // Above U+10FFFF
+        } else {
+            return NO;
+        }
+        
+        if (length - i - 1 < trailing || bytes[i + 1] < min || bytes[i + 1] > max) {
+            return NO;
+        }
+        
+        for (size_t k = 2; k <= trailing; k++) {
+            if ((bytes[i + k] & 0xC0) != 0x80) {
+                return NO;
+            }
+        }
+        
+        i += trailing + 1;
+    }
+}
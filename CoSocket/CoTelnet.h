@@ -0,0 +1,122 @@
+//
+//  CoTelnet.h
+//  Copyright (c) 2014 Yang Yubo <yang@codinn.com>
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+//
+
+#import <Foundation/Foundation.h>
+#import "CoSocket.h"
+
+typedef NS_ENUM(uint8_t, CoTelnetCommand) {
+    CoTelnetSE = 240,   // End of subnegotiation
+    CoTelnetNOP = 241,
+    CoTelnetDM = 242,   // Data mark
+    CoTelnetBRK = 243,
+    CoTelnetIP = 244,   // Interrupt process
+    CoTelnetAO = 245,   // Abort output
+    CoTelnetAYT = 246,  // Are you there
+    CoTelnetEC = 247,   // Erase character
+    CoTelnetEL = 248,   // Erase line
+    CoTelnetGA = 249,   // Go ahead
+    CoTelnetSB = 250,   // Subnegotiation
+    CoTelnetWILL = 251,
+    CoTelnetWONT = 252,
+    CoTelnetDO = 253,
+    CoTelnetDONT = 254,
+    CoTelnetIAC = 255,
+};
+
+typedef void (^ CoTelnetPayloadHandler)(const void *bytes, NSUInteger length);
+typedef BOOL (^ CoTelnetOptionHandler)(CoTelnetCommand request, uint8_t option);
+typedef void (^ CoTelnetCommandHandler)(CoTelnetCommand command);
+typedef void (^ CoTelnetSubnegotiationHandler)(uint8_t option, NSData *data);
+
+/**
+ * The Telnet protocol (RFC 854) over a connected CoSocket.
+ *
+ * Received data is searched for IAC 16 bytes at a time (SSE2 or NEON), and the payload between commands
+ * is handed over straight from the socket's read buffer, so bulk output costs little more than a plain read.
+ * Commands and option negotiation are handled along the way, their replies are sent after each read.
+ * Options are refused unless optionHandler agrees to them, and agreed ones are remembered,
+ * so a peer repeating a request isn't answered twice.
+ *
+ * Unless TRANSMIT-BINARY is enabled in that direction, a CR that isn't part of CR LF travels as CR NUL:
+ * writeData:error: adds the NUL, and the reads drop it.
+ *
+ * One thread may read at a time, and one may write; the two may be different threads.
+ **/
+@interface CoTelnet : NSObject
+
+- (instancetype)initWithSocket:(CoSocket *)socket;
+
+@property (atomic, readonly) CoSocket *socket;
+
+/**
+ * Asked whether to agree to the peer's WILL or DO for an option. Nil refuses all of them.
+ **/
+@property (atomic, copy) CoTelnetOptionHandler optionHandler;
+
+/**
+ * Receives commands other than option negotiation and subnegotiation, e.g. AYT or IP.
+ **/
+@property (atomic, copy) CoTelnetCommandHandler commandHandler;
+
+/**
+ * Receives subnegotiations, e.g. of TERMINAL-TYPE or NAWS, with IAC IAC unescaped. Up to 4 KiB of data is kept.
+ **/
+@property (atomic, copy) CoTelnetSubnegotiationHandler subnegotiationHandler;
+
+#pragma mark Reading
+
+/**
+ * Waits for data like readBufferWithReader:error:, and passes every run of payload in what was received to handler,
+ * without copying it. The bytes are only valid while the handler runs.
+ *
+ * Returns YES without calling handler if only commands were received.
+ **/
+- (BOOL)readPayloadWithHandler:(CoTelnetPayloadHandler)handler error:(NSError **)errPtr;
+
+/**
+ * Like readPayloadWithHandler:error:, and returns the payload as one NSData, which may be empty.
+ **/
+- (NSData *)readPayloadWithError:(NSError **)errPtr;
+
+#pragma mark Writing
+
+/**
+ * Sends data as payload. IAC bytes are doubled and bare CRs followed by NUL while the data is copied into
+ * a pooled send chunk; data without any is sent as it is, with no copy. A CR that ends data counts as bare.
+ **/
+- (BOOL)writeData:(NSData *)data error:(NSError **)errPtr;
+
+/**
+ * Sends a command. For WILL, WONT, DO and DONT the option is sent along and remembered, otherwise it's ignored.
+ **/
+- (BOOL)sendCommand:(CoTelnetCommand)command option:(uint8_t)option error:(NSError **)errPtr;
+
+- (BOOL)sendSubnegotiation:(uint8_t)option data:(NSData *)data error:(NSError **)errPtr;
+
+/**
+ * Whether the option is enabled on our side (after DO/WILL) or the peer's (after WILL/DO).
+ **/
+- (BOOL)isLocalOptionEnabled:(uint8_t)option;
+- (BOOL)isRemoteOptionEnabled:(uint8_t)option;
+
+@end
@@ -0,0 +1,462 @@
+//
+//  CoTelnet.m
+//  Copyright (c) 2014 Yang Yubo <yang@codinn.com>
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+//
+
+#import "CoTelnet.h"
+#import "CoBufferPool.h"
+
+#if defined(__SSE2__)
+#import <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#import <arm_neon.h>
+#endif
+
+#define CoTelnetMaxSubnegotiation 4096
+#define CoTelnetBinary 0                // TRANSMIT-BINARY (RFC 856), turns off the CR NUL rule
+
+typedef NS_ENUM(NSInteger, CoTelnetState) {
+    CoTelnetStateData,
+    CoTelnetStateCommand,           // After IAC
+    CoTelnetStateOption,            // After IAC WILL/WONT/DO/DONT
+    CoTelnetStateSubnegotiationOption,  // After IAC SB
+    CoTelnetStateSubnegotiation,
+    CoTelnetStateSubnegotiationIAC, // IAC within a subnegotiation
+};
+
+static const uint8_t *find_iac(const uint8_t *bytes, size_t length);
+static const uint8_t *find_escape(const uint8_t *bytes, const uint8_t *end, BOOL text, const uint8_t **nextIAC);
+
+@implementation CoTelnet {
+    // Read side, on the reading thread only
+    CoTelnetState _state;
+    CoTelnetCommand _command;
+    uint8_t _subnegotiationOption;
+    NSMutableData *_subnegotiation;
+    NSMutableData *_replies;        // Negotiation answers, sent once the read is done
+    BOOL _afterCR;                  // The last payload byte was a CR, a NUL next is dropped
+    
+    // Under @synchronized(self)
+    BOOL _localEnabled[256];
+    BOOL _remoteEnabled[256];
+}
+
+- (instancetype)initWithSocket:(CoSocket *)socket
+{
+    if ((self = [super init])) {
+        _socket = socket;
+        _state = CoTelnetStateData;
+        _subnegotiation = [NSMutableData data];
+        _replies = [NSMutableData data];
+    }
+    return self;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Reading
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (BOOL)readPayloadWithHandler:(CoTelnetPayloadHandler)handler error:(NSError **)errPtr
+{
+    // The parser keeps its state between reads, so a command split across two recvs is fine
+    BOOL read = [_socket readBufferWithReader:^NSUInteger(const void *bytes, NSUInteger length) {
+        [self parseBytes:bytes length:length handler:handler];
+        return length;
+    } error:errPtr];
+    
+    if (!read) {
+        return NO;
+    }
+    
+    if (_replies.length == 0) {
+        return YES;
+    }
+    
+    NSData *replies = [_replies copy];
+    _replies.length = 0;
+    
+    return [_socket writeData:replies error:errPtr];
+}
+
+- (NSData *)readPayloadWithError:(NSError **)errPtr
+{
+    NSMutableData *payload = [NSMutableData data];
+    
+    BOOL read = [self readPayloadWithHandler:^(const void *bytes, NSUInteger length) {
+        [payload appendBytes:bytes length:length];
+    } error:errPtr];
+    
+    return read ? payload : nil;
+}
+
+- (void)parseBytes:(const uint8_t *)bytes length:(NSUInteger)length handler:(CoTelnetPayloadHandler)handler
+{
+    const uint8_t *cursor = bytes;
+    const uint8_t *end = bytes + length;
+    
+    while (cursor < end) {
+        switch (_state) {
+            case CoTelnetStateData: {
+                // The fast path: everything up to the next IAC is payload
+                const uint8_t *iac = find_iac(cursor, end - cursor);
+                const uint8_t *runEnd = iac ?: end;
+                
+                if (runEnd > cursor) {
+                    [self passPayload:cursor length:runEnd - cursor handler:handler];
+                }
+                
+                cursor = runEnd;
+                
+                if (iac) {
+                    _state = CoTelnetStateCommand;
+                    _afterCR = NO;
+                    cursor++;
+                }
+                break;
+            }
+            case CoTelnetStateCommand: {
+                CoTelnetCommand command = *cursor++;
+                _state = CoTelnetStateData;
+                
+                if (command == CoTelnetIAC) {
+                    handler(cursor - 1, 1);     // An escaped 0xFF data byte
+                } else if (command >= CoTelnetWILL) {
+                    _command = command;
+                    _state = CoTelnetStateOption;
+                } else if (command == CoTelnetSB) {
+                    _state = CoTelnetStateSubnegotiationOption;
+                } else {
+                    CoTelnetCommandHandler commandHandler = self.commandHandler;
+                    if (commandHandler) commandHandler(command);
+                }
+                break;
+            }
+            case CoTelnetStateOption:
+                [self negotiate:_command option:*cursor++];
+                _state = CoTelnetStateData;
+                break;
+            case CoTelnetStateSubnegotiationOption:
+                _subnegotiationOption = *cursor++;
+                _subnegotiation.length = 0;
+                _state = CoTelnetStateSubnegotiation;
+                break;
+            case CoTelnetStateSubnegotiation: {
+                const uint8_t *iac = find_iac(cursor, end - cursor);
+                const uint8_t *runEnd = iac ?: end;
+                
+                [self appendSubnegotiationBytes:cursor length:runEnd - cursor];
+                cursor = runEnd;
+                
+                if (iac) {
+                    _state = CoTelnetStateSubnegotiationIAC;
+                    cursor++;
+                }
+                break;
+            }
+            case CoTelnetStateSubnegotiationIAC: {
+                uint8_t command = *cursor++;
+                _state = CoTelnetStateSubnegotiation;
+                
+                if (command == CoTelnetIAC) {
+                    [self appendSubnegotiationBytes:cursor - 1 length:1];
+                } else if (command == CoTelnetSE) {
+                    _state = CoTelnetStateData;
+                    
+                    CoTelnetSubnegotiationHandler subnegotiationHandler = self.subnegotiationHandler;
+                    if (subnegotiationHandler) subnegotiationHandler(_subnegotiationOption, [_subnegotiation copy]);
+                }
+                // Anything else within a subnegotiation is a protocol error, and dropped
+                break;
+            }
+        }
+    }
+}
+
+/**
+ Hands a run of payload to the handler. Outside binary mode a CR is sent as CR NUL when it isn't
+ part of CR LF (RFC 854), so the NUL is dropped; the run is split around it.
+ */
+- (void)passPayload:(const uint8_t *)bytes length:(NSUInteger)length handler:(CoTelnetPayloadHandler)handler
+{
+    const uint8_t *start = bytes;
+    const uint8_t *end = bytes + length;
+    
+    if ([self isRemoteOptionEnabled:CoTelnetBinary]) {
+        _afterCR = NO;
+        handler(start, length);
+        return;
+    }
+    
+    if (_afterCR && *start == 0) {
+        start++;
+    }
+    
+    const uint8_t *cr = start;
+    
+    while ((cr = memchr(cr, '\r', end - cr)) && cr + 1 < end) {
+        if (cr[1] == 0) {
+            handler(start, cr + 1 - start);
+            start = cr + 2;
+        }
+        cr++;
+    }
+    
+    // The NUL of a CR NUL at the end may only come with the next read
+    _afterCR = (end[-1] == '\r');
+    
+    if (end > start) {
+        handler(start, end - start);
+    }
+}
+
+- (void)appendSubnegotiationBytes:(const uint8_t *)bytes length:(NSUInteger)length
+{
+    NSUInteger room = CoTelnetMaxSubnegotiation - MIN(_subnegotiation.length, CoTelnetMaxSubnegotiation);
+    [_subnegotiation appendBytes:bytes length:MIN(length, room)];
+}
+
+/**
+ Answers the peer's request, only when it changes the state of the option, so negotiation can't loop.
+ */
+- (void)negotiate:(CoTelnetCommand)request option:(uint8_t)option
+{
+    CoTelnetCommand reply = 0;
+    
+    @synchronized(self) {
+        BOOL remote = (request == CoTelnetWILL || request == CoTelnetWONT);
+        BOOL *enabled = remote ? &_remoteEnabled[option] : &_localEnabled[option];
+        BOOL wanted = (request == CoTelnetWILL || request == CoTelnetDO);
+        
+        if (wanted && !*enabled) {
+            CoTelnetOptionHandler optionHandler = self.optionHandler;
+            *enabled = optionHandler && optionHandler(request, option);
+            
+            if (remote) {
+                reply = *enabled ? CoTelnetDO : CoTelnetDONT;
+            } else {
+                reply = *enabled ? CoTelnetWILL : CoTelnetWONT;
+            }
+        } else if (!wanted && *enabled) {
+            *enabled = NO;
+            reply = remote ? CoTelnetDONT : CoTelnetWONT;
+        }
+    }
+    
+    if (reply) {
+        uint8_t bytes[3] = { CoTelnetIAC, reply, option };
+        [_replies appendBytes:bytes length:sizeof(bytes)];
+    }
+}
+
+- (BOOL)isLocalOptionEnabled:(uint8_t)option
+{
+    @synchronized(self) {
+        return _localEnabled[option];
+    }
+}
+
+- (BOOL)isRemoteOptionEnabled:(uint8_t)option
+{
+    @synchronized(self) {
+        return _remoteEnabled[option];
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Writing
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (BOOL)writeData:(NSData *)data error:(NSError **)errPtr
+{
+    BOOL text = ![self isLocalOptionEnabled:CoTelnetBinary];
+    const uint8_t *cursor = data.bytes;
+    const uint8_t *end = cursor + data.length;
+    const uint8_t *nextIAC = NULL;
+    const uint8_t *special = find_escape(cursor, end, text, &nextIAC);
+    
+    if (!special) {
+        return [_socket writeData:data error:errPtr];
+    }
+    
+    CoBufferPool *pool = [CoBufferPool sharedPool];
+    uint8_t *chunk = [pool allocateBuffer];
+    
+    if (!chunk) {
+        // Over the memory budget, escape into a buffer of its own
+        NSMutableData *escaped = [NSMutableData dataWithCapacity:data.length * 2];
+        
+        while (special) {
+            uint8_t second = (*special == CoTelnetIAC) ? CoTelnetIAC : 0;
+            [escaped appendBytes:cursor length:special - cursor + 1];
+            [escaped appendBytes:&second length:1];
+            cursor = special + 1;
+            special = find_escape(cursor, end, text, &nextIAC);
+        }
+        
+        [escaped appendBytes:cursor length:end - cursor];
+        return [_socket writeData:escaped error:errPtr];
+    }
+    
+    size_t capacity = pool.bufferSize;
+    size_t used = 0;
+    BOOL sent = YES;
+    
+    while (sent && cursor < end) {
+        // Copy up to the next IAC or bare CR, then IAC IAC or CR NUL, in one pass over the data
+        const uint8_t *runEnd = special ?: end;
+        size_t run = MIN((size_t)(runEnd - cursor), capacity - used);
+        
+        memcpy(chunk + used, cursor, run);
+        used += run;
+        cursor += run;
+        
+        if (cursor == special && capacity - used >= 2) {
+            chunk[used++] = *special;
+            chunk[used++] = (*special == CoTelnetIAC) ? CoTelnetIAC : 0;
+            cursor++;
+            special = find_escape(cursor, end, text, &nextIAC);
+        }
+        
+        if (used > 0 && (capacity - used < 2 || cursor == end)) {
+            sent = [_socket writeData:[NSData dataWithBytesNoCopy:chunk length:used freeWhenDone:NO] error:errPtr];
+            used = 0;
+        }
+    }
+    
+    [pool releaseBuffer:chunk];
+    return sent;
+}
+
+- (BOOL)sendCommand:(CoTelnetCommand)command option:(uint8_t)option error:(NSError **)errPtr
+{
+    BOOL negotiation = (command >= CoTelnetWILL && command <= CoTelnetDONT);
+    
+    if (negotiation) {
+        // Remembered up front, the peer's confirmation then changes nothing and isn't answered
+        @synchronized(self) {
+            BOOL wanted = (command == CoTelnetWILL || command == CoTelnetDO);
+            
+            if (command == CoTelnetWILL || command == CoTelnetWONT) {
+                _localEnabled[option] = wanted;
+            } else {
+                _remoteEnabled[option] = wanted;
+            }
+        }
+    }
+    
+    uint8_t bytes[3] = { CoTelnetIAC, command, option };
+    
+    return [_socket writeData:[NSData dataWithBytes:bytes length:negotiation ? 3 : 2] error:errPtr];
+}
+
+- (BOOL)sendSubnegotiation:(uint8_t)option data:(NSData *)data error:(NSError **)errPtr
+{
+    NSMutableData *message = [NSMutableData dataWithCapacity:data.length + 5];
+    uint8_t header[3] = { CoTelnetIAC, CoTelnetSB, option };
+    uint8_t trailer[2] = { CoTelnetIAC, CoTelnetSE };
+    
+    [message appendBytes:header length:sizeof(header)];
+    
+    const uint8_t *cursor = data.bytes;
+    const uint8_t *end = cursor + data.length;
+    const uint8_t *iac;
+    
+    while ((iac = find_iac(cursor, end - cursor))) {
+        [message appendBytes:cursor length:iac - cursor + 1];
+        [message appendBytes:iac length:1];
+        cursor = iac + 1;
+    }
+    
+    [message appendBytes:cursor length:end - cursor];
+    [message appendBytes:trailer length:sizeof(trailer)];
+    
+    return [_socket writeData:message error:errPtr];
+}
+
+@end
+
+/**
+ Returns the first byte writeData: has to escape, or NULL: an IAC, or in text mode a CR that isn't
+ followed by LF. A CR at the very end counts as bare, the LF of a later write can't be seen.
+ 
+ nextIAC caches the first IAC at or after bytes (end if there is none) across calls, start it at NULL.
+ It is only looked for again once bytes has passed it, so many bare CRs don't rescan the data each.
+ */
+static const uint8_t *find_escape(const uint8_t *bytes, const uint8_t *end, BOOL text, const uint8_t **nextIAC)
+{
+    if (!*nextIAC || *nextIAC < bytes) {
+        *nextIAC = find_iac(bytes, end - bytes) ?: end;
+    }
+    
+    const uint8_t *iac = (*nextIAC < end) ? *nextIAC : NULL;
+    
+    if (!text) {
+        return iac;
+    }
+    
+    const uint8_t *limit = iac ?: end;
+    const uint8_t *cr = bytes;
+    
+    while ((cr = memchr(cr, '\r', limit - cr))) {
+        if (cr + 1 == end || cr[1] != '\n') {
+            return cr;
+        }
+        cr += 2;
+    }
+    
+    return iac;
+}
+
+/**
+ Returns the first IAC (0xFF) byte, checking 16 bytes at a time with SSE2 or NEON, or NULL.
+ */
+static const uint8_t *find_iac(const uint8_t *bytes, size_t length)
+{
+    size_t i = 0;
+    
+#if defined(__SSE2__)
+    const __m128i iac = _mm_set1_epi8((char)CoTelnetIAC);
+    
+    for (; i + 16 <= length; i += 16) {
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(bytes + i)), iac));
+        
+        if (mask != 0) {
+            return bytes + i + __builtin_ctz(mask);
+        }
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const uint8x16_t iac = vdupq_n_u8(CoTelnetIAC);
+    
+    for (; i + 16 <= length; i += 16) {
+        if (vmaxvq_u8(vceqq_u8(vld1q_u8(bytes + i), iac)) != 0) {
+            break;  // The scalar loop below finds it within the 16 bytes
+        }
+    }
+#endif
+    
+    for (; i < length; i++) {
+        if (bytes[i] == CoTelnetIAC) {
+            return bytes + i;
+        }
+    }
+    
+    return NULL;
+}
@@ -0,0 +1,111 @@
+//
+//  CoTimingWheel.h
+//  Copyright (c) 2014 Yang Yubo <yang@codinn.com>
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+//
+
+#import <Foundation/Foundation.h>
+
+typedef void (^ CoTimerHandler)(void);
+
+/**
+ * A timer scheduled on a CoTimingWheel.
+ **/
+@interface CoTimer : NSObject
+
+/**
+ * Cancels the timer in O(1). Cancelling a timer that has fired or was already cancelled does nothing.
+ **/
+- (void)cancel;
+
+@property (atomic, readonly, getter=isPending) BOOL pending;
+
+@end
+
+/**
+ * A hierarchical timing wheel, for keeping per-socket deadlines on many connections at once.
+ *
+ * Scheduling and cancelling are O(1), no matter how many timers are pending: a timer is linked into
+ * the slot of its expiry tick, and timers far in the future sit in coarser wheels that are cascaded
+ * into the finer ones as time goes by. There is no heap to rebalance on every I/O.
+ *
+ * Four wheels of 64 slots cover 2^24 ticks, which is close to two days at a 10ms resolution.
+ * Timers further out are clamped to that horizon and rescheduled when they reach it.
+ *
+ * The wheel doesn't own a thread. Whoever drives it calls advanceToTime: whenever nextTimeout says so,
+ * for example by passing nextTimeout as the timeout of epoll_wait() or poll().
+ * The sharedWheel is driven by a background thread of its own.
+ *
+ * All methods are thread safe. Handlers run on the thread calling advanceToTime:, outside the wheel's lock,
+ * so they may schedule and cancel timers.
+ **/
+@interface CoTimingWheel : NSObject
+
+/**
+ * Returns a wheel with a 10ms resolution, driven by a background thread.
+ *
+ * CoSocket schedules its idle timeouts here.
+ **/
++ (CoTimingWheel *)sharedWheel;
+
+/**
+ * The monotonic clock the wheels run on, in seconds.
+ **/
++ (NSTimeInterval)now;
+
+/**
+ * Creates a wheel that starts at the current time.
+ *
+ * @param resolution The length of a tick in seconds. Timers fire no earlier than scheduled and at most one tick late.
+ **/
+- (instancetype)initWithResolution:(NSTimeInterval)resolution;
+
+@property (atomic, readonly) NSTimeInterval resolution;
+
+/**
+ * Called on the scheduling thread after a timer is scheduled, so that a driver sleeping
+ * in epoll_wait() or poll() can be woken up to recompute nextTimeout.
+ **/
+@property (atomic, copy) CoTimerHandler wakeupHandler;
+
+/**
+ * Returns the number of timers waiting to fire.
+ **/
+@property (atomic, readonly) NSUInteger count;
+
+/**
+ * Schedules the handler to run once, after the given interval.
+ **/
+- (CoTimer *)scheduleTimerWithTimeInterval:(NSTimeInterval)interval handler:(CoTimerHandler)handler;
+
+/**
+ * Moves the wheel forward to the given time (see now) and runs the handlers of all timers that expired.
+ *
+ * @return The number of handlers run.
+ **/
+- (NSUInteger)advanceToTime:(NSTimeInterval)time;
+
+/**
+ * Returns how long the driver may wait before it must call advanceToTime:, or a negative
+ * interval if no timer is pending and the driver may wait indefinitely.
+ **/
+- (NSTimeInterval)nextTimeout;
+
+@end
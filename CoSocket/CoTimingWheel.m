@@ -0,0 +1,387 @@
+//
+//  CoTimingWheel.m
+//  Copyright (c) 2014 Yang Yubo <yang@codinn.com>
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+//
+
+//
+//  The wheel follows the cascading timer wheel of the classic Linux kernel timers,
+//  see "Hashed and Hierarchical Timing Wheels" by Varghese and Lauck (1987).
+//
+
+#import "CoTimingWheel.h"
+#import <time.h>
+
+#define CoWheelBits     6
+#define CoWheelSize     (1 << CoWheelBits)  // 64 slots per wheel
+#define CoWheelMask     (CoWheelSize - 1)
+#define CoWheelLevels   4
+#define CoWheelHorizon  ((uint64_t)1 << (CoWheelBits * CoWheelLevels))
+
+#define CoSharedWheelResolution 0.01 // 10ms
+
+@interface CoTimingWheel ()
+- (void)cancelTimer:(CoTimer *)timer;
+- (BOOL)isTimerPending:(CoTimer *)timer;
+@end
+
+@interface CoTimer () {
+@public
+    CoTimer *_next;                         // Slot lists own their timers
+    __unsafe_unretained CoTimer *_prev;
+    uint64_t _expires;                      // Tick of the slot the timer is linked in
+    uint64_t _target;                       // Tick the timer is due, beyond the horizon for very long timers
+    int _level;                             // -1 when not linked
+    int _slot;
+    CoTimerHandler _handler;
+    __weak CoTimingWheel *_wheel;
+}
+@end
+
+@implementation CoTimer
+
+- (instancetype)init
+{
+    if ((self = [super init])) {
+        _level = -1;
+    }
+    return self;
+}
+
+- (void)cancel
+{
+    [_wheel cancelTimer:self];
+}
+
+- (BOOL)isPending
+{
+    return [_wheel isTimerPending:self];
+}
+
+@end
+
+
+@implementation CoTimingWheel {
+    NSCondition *_lock;
+    CoTimer *_slots[CoWheelLevels][CoWheelSize];
+    uint64_t _currentTick;                  // The next tick to process
+    NSTimeInterval _startTime;
+    NSUInteger _count;
+}
+
++ (CoTimingWheel *)sharedWheel
+{
+    static CoTimingWheel *sharedWheel = nil;
+    
+    @synchronized(self) {
+        if (!sharedWheel) {
+            sharedWheel = [[CoTimingWheel alloc] initWithResolution:CoSharedWheelResolution];
+            
+            NSThread *thread = [[NSThread alloc] initWithTarget:sharedWheel selector:@selector(drive) object:nil];
+            thread.name = @"com.codinn.CoSocket.timer";
+            [thread start];
+        }
+    }
+    
+    return sharedWheel;
+}
+
++ (NSTimeInterval)now
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+- (instancetype)init
+{
+    return [self initWithResolution:CoSharedWheelResolution];
+}
+
+- (instancetype)initWithResolution:(NSTimeInterval)resolution
+{
+    if ((self = [super init])) {
+        _resolution = resolution > 0 ? resolution : CoSharedWheelResolution;
+        _startTime = [self.class now];
+        _currentTick = 0;
+        _lock = [[NSCondition alloc] init];
+    }
+    return self;
+}
+
+- (NSUInteger)count
+{
+    [_lock lock];
+    NSUInteger count = _count;
+    [_lock unlock];
+    
+    return count;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Scheduling
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (CoTimer *)scheduleTimerWithTimeInterval:(NSTimeInterval)interval handler:(CoTimerHandler)handler
+{
+    CoTimer *timer = [[CoTimer alloc] init];
+    timer->_handler = [handler copy];
+    timer->_wheel = self;
+    
+    NSTimeInterval due = [self.class now] + MAX(interval, 0) - _startTime;
+    
+    [_lock lock];
+    
+    // Round up, a timer must never fire early
+    uint64_t target = (uint64_t)ceil(due / _resolution);
+    timer->_target = MAX(target, _currentTick);
+    
+    [self linkTimer:timer];
+    _count++;
+    
+    // The driver may be sleeping past the new timer's expiry
+    [_lock signal];
+    [_lock unlock];
+    
+    CoTimerHandler wakeup = self.wakeupHandler;
+    if (wakeup) wakeup();
+    
+    return timer;
+}
+
+- (void)cancelTimer:(CoTimer *)timer
+{
+    [_lock lock];
+    
+    if (timer->_level >= 0) {
+        [self unlinkTimer:timer];
+        timer->_handler = nil;
+        _count--;
+    }
+    
+    [_lock unlock];
+}
+
+- (BOOL)isTimerPending:(CoTimer *)timer
+{
+    [_lock lock];
+    BOOL pending = timer->_level >= 0;
+    [_lock unlock];
+    
+    return pending;
+}
+
+/**
+ Links the timer into the slot its target falls in. Must be called with the lock held.
+ */
+- (void)linkTimer:(CoTimer *)timer
+{
+    uint64_t delta = timer->_target - _currentTick;
+    
+    // Beyond the horizon, park the timer in the farthest slot and relink it from there
+    timer->_expires = delta < CoWheelHorizon ? timer->_target : _currentTick + CoWheelHorizon - 1;
+    delta = timer->_expires - _currentTick;
+    
+    int level = 0;
+    while (level < CoWheelLevels - 1 && delta >= ((uint64_t)1 << (CoWheelBits * (level + 1)))) {
+        level++;
+    }
+    
+    int slot = (int)((timer->_expires >> (CoWheelBits * level)) & CoWheelMask);
+    
+    CoTimer *head = _slots[level][slot];
+    timer->_next = head;
+    timer->_prev = nil;
+    if (head) head->_prev = timer;
+    _slots[level][slot] = timer;
+    
+    timer->_level = level;
+    timer->_slot = slot;
+}
+
+/**
+ Unlinks the timer from its slot. Must be called with the lock held.
+ */
+- (void)unlinkTimer:(CoTimer *)timer
+{
+    CoTimer *next = timer->_next;
+    
+    if (next) next->_prev = timer->_prev;
+    
+    if (timer->_prev) {
+        timer->_prev->_next = next;
+    } else {
+        _slots[timer->_level][timer->_slot] = next;
+    }
+    
+    timer->_next = nil;
+    timer->_prev = nil;
+    timer->_level = -1;
+}
+
+/**
+ Detaches and returns the whole list of a slot. Must be called with the lock held.
+ */
+- (CoTimer *)takeSlot:(int)slot level:(int)level
+{
+    CoTimer *list = _slots[level][slot];
+    _slots[level][slot] = nil;
+    
+    return list;
+}
+
+/**
+ Moves all timers of a slot in a coarse wheel down to the finer wheels.
+ Returns the slot index, which is zero when the next coarser wheel has to cascade as well.
+ */
+- (int)cascadeLevel:(int)level
+{
+    int slot = (int)((_currentTick >> (CoWheelBits * level)) & CoWheelMask);
+    
+    CoTimer *timer = [self takeSlot:slot level:level];
+    
+    while (timer) {
+        CoTimer *next = timer->_next;
+        timer->_next = nil;
+        timer->_prev = nil;
+        [self linkTimer:timer];
+        timer = next;
+    }
+    
+    return slot;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Driving
+///////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (NSUInteger)advanceToTime:(NSTimeInterval)time
+{
+    NSMutableArray *expired = nil;
+    
+    [_lock lock];
+    
+    NSTimeInterval elapsed = time - _startTime;
+    uint64_t lastTick = elapsed > 0 ? (uint64_t)floor(elapsed / _resolution) : 0;
+    
+    while (_count > 0 && _currentTick <= lastTick) {
+        int index = (int)(_currentTick & CoWheelMask);
+        
+        if (index == 0) {
+            for (int level = 1; level < CoWheelLevels; level++) {
+                if ([self cascadeLevel:level] != 0) break;
+            }
+        }
+        
+        CoTimer *timer = [self takeSlot:index level:0];
+        
+        while (timer) {
+            CoTimer *next = timer->_next;
+            timer->_next = nil;
+            timer->_prev = nil;
+            timer->_level = -1;
+            
+            if (timer->_target > _currentTick) {
+                // Came back from beyond the horizon, not due yet
+                [self linkTimer:timer];
+            } else {
+                if (!expired) expired = [NSMutableArray array];
+                [expired addObject:timer];
+                _count--;
+            }
+            
+            timer = next;
+        }
+        
+        _currentTick++;
+    }
+    
+    // Nothing pending, so no slot can be skipped by jumping ahead
+    if (_count == 0 && _currentTick <= lastTick) {
+        _currentTick = lastTick + 1;
+    }
+    
+    [_lock unlock];
+    
+    for (CoTimer *timer in expired) {
+        CoTimerHandler handler = timer->_handler;
+        timer->_handler = nil;
+        if (handler) handler();
+    }
+    
+    return expired.count;
+}
+
+- (NSTimeInterval)nextTimeout
+{
+    [_lock lock];
+    NSTimeInterval timeout = [self nextTimeoutLocked];
+    [_lock unlock];
+    
+    return timeout;
+}
+
+- (NSTimeInterval)nextTimeoutLocked
+{
+    if (_count == 0) {
+        return -1;
+    }
+    
+    // The earliest busy slot before the wheel wraps, or else the wrap, where the coarser wheels cascade
+    int index = (int)(_currentTick & CoWheelMask);
+    uint64_t tick = _currentTick + (CoWheelSize - index);
+    
+    for (int slot = index; slot < CoWheelSize; slot++) {
+        if (_slots[0][slot]) {
+            tick = _currentTick + (slot - index);
+            break;
+        }
+    }
+    
+    NSTimeInterval timeout = _startTime + tick * _resolution - [self.class now];
+    
+    return MAX(timeout, 0);
+}
+
+/**
+ Run loop of the shared wheel's thread.
+ */
+- (void)drive
+{
+    for (;;) {
+        @autoreleasepool {
+            [_lock lock];
+            
+            NSTimeInterval timeout = [self nextTimeoutLocked];
+            
+            if (timeout < 0) {
+                [_lock wait];
+            } else if (timeout > 0) {
+                [_lock waitUntilDate:[NSDate dateWithTimeIntervalSinceNow:timeout]];
+            }
+            
+            [_lock unlock];
+            
+            [self advanceToTime:[self.class now]];
+        }
+    }
+}
+
+@end
@@ -0,0 +1,88 @@
+//
+//  CoTraceRecorder.h
+//  Copyright (c) 2014 Yang Yubo <yang@codinn.com>
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+//
+
+#import <Foundation/Foundation.h>
+
+/**
+ * Records what sockets do, to be loaded into chrome://tracing or https://ui.perfetto.dev as Chrome trace JSON.
+ *
+ * Set it as the traceRecorder of the sockets to watch. Each connect, read and write becomes a span, with the
+ * host name lookup, the handshake, every wait for the socket and every recv() and send() (with its size)
+ * nested in it. Timeouts and disconnects are marked as instants.
+ * Every event shows up twice: on the track of the thread that made the call, and on the track of the socket,
+ * so one can follow either a worker thread or a connection through a slow session.
+ *
+ * The recorder keeps the most recent events in a ring of fixed capacity, and the oldest make room.
+ * Recording is thread safe and costs one lock and no allocation per event; building the JSON is not cheap,
+ * do it after the capture.
+ **/
+@interface CoTraceRecorder : NSObject
+
+/**
+ * A recorder keeping the last 100,000 events.
+ **/
+- (instancetype)init;
+
+- (instancetype)initWithCapacity:(NSUInteger)capacity;
+
+@property (atomic, readonly) NSUInteger capacity;
+
+/**
+ * Events overwritten since the recorder was created or last cleared.
+ **/
+@property (atomic, readonly) NSUInteger droppedEventCount;
+
+/**
+ * Records a span on the calling thread's track and on the given track.
+ *
+ * @param name Must outlive the recorder, normally a string literal.
+ * @param start, end On the [CoTimingWheel now] clock.
+ * @param argument Name of value in the span's arguments, e.g. "bytes", or NULL for none.
+ **/
+- (void)recordSpan:(const char *)name
+             track:(uint64_t)track
+             start:(NSTimeInterval)start
+               end:(NSTimeInterval)end
+          argument:(const char *)argument
+             value:(int64_t)value;
+
+/**
+ * Records an instant on the calling thread's track and on the given track, now.
+ **/
+- (void)recordInstant:(const char *)name track:(uint64_t)track argument:(const char *)argument value:(int64_t)value;
+
+/**
+ * Names a socket's track, e.g. after the peer it connected to.
+ **/
+- (void)setName:(NSString *)name ofTrack:(uint64_t)track;
+
+/**
+ * The events recorded so far, as a Chrome trace JSON object.
+ **/
+- (NSData *)JSONData;
+
+- (BOOL)writeJSONToFile:(NSString *)path error:(NSError **)errPtr;
+
+- (void)removeAllEvents;
+
+@end
@@ -0,0 +1,284 @@
+//
+//  CoTraceRecorder.m
+//  Copyright (c) 2014 Yang Yubo <yang@codinn.com>
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+//
+
+#import "CoTraceRecorder.h"
+#import "CoTimingWheel.h"
+#import <pthread.h>
+#import <unistd.h>
+
+#if defined(__APPLE__)
+#import <mach/mach.h>
+#elif defined(__linux__)
+#import <sys/syscall.h>
+#endif
+
+#define CoTraceDefaultCapacity  100000
+#define CoTraceSocketTrackBase  0x40000000  // Socket tracks are shown as threads numbered above any real one
+
+typedef struct {
+    const char *name;
+    const char *argument;
+    int64_t value;
+    uint64_t track;
+    uint32_t thread;
+    NSTimeInterval start;
+    NSTimeInterval duration;    // Negative for an instant
+} CoTraceEvent;
+
+static __thread uint32_t cached_thread_id;
+static __thread void *thread_named_by;  // The last recorder that learned the calling thread's name
+
+static uint32_t current_thread_id(void)
+{
+    if (!cached_thread_id) {
+#if defined(__APPLE__)
+        cached_thread_id = pthread_mach_thread_np(pthread_self());
+#elif defined(__linux__)
+        cached_thread_id = (uint32_t)syscall(SYS_gettid);
+#else
+        cached_thread_id = (uint32_t)(uintptr_t)pthread_self();
+#endif
+    }
+    
+    return cached_thread_id;
+}
+
+@implementation CoTraceRecorder {
+    pthread_mutex_t _lock;
+    CoTraceEvent *_events;
+    NSUInteger _count;
+    NSUInteger _next;
+    NSUInteger _dropped;
+    NSTimeInterval _origin;
+    NSMutableDictionary *_threadNames;
+    NSMutableDictionary *_trackNames;
+}
+
+- (instancetype)init
+{
+    return [self initWithCapacity:CoTraceDefaultCapacity];
+}
+
+- (instancetype)initWithCapacity:(NSUInteger)capacity
+{
+    if ((self = [super init])) {
+        pthread_mutex_init(&_lock, NULL);
+        _capacity = MAX(capacity, 1);
+        _events = calloc(_capacity, sizeof(CoTraceEvent));
+        
+        if (!_events) {
+            return nil;
+        }
+        
+        _origin = [CoTimingWheel now];
+        _threadNames = [NSMutableDictionary dictionary];
+        _trackNames = [NSMutableDictionary dictionary];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    pthread_mutex_destroy(&_lock);
+    free(_events);
+}
+
+- (NSUInteger)droppedEventCount
+{
+    pthread_mutex_lock(&_lock);
+    NSUInteger dropped = _dropped;
+    pthread_mutex_unlock(&_lock);
+    
+    return dropped;
+}
+
+- (void)addEvent:(CoTraceEvent)event
+{
+    event.thread = current_thread_id();
+    
+    // Looked up once per thread, not per event
+    NSString *threadName = nil;
+    if (thread_named_by != (__bridge void *)self) {
+        thread_named_by = (__bridge void *)self;
+        threadName = [NSThread isMainThread] ? @"main" : [NSThread currentThread].name;
+    }
+    
+    pthread_mutex_lock(&_lock);
+    
+    if (threadName.length) {
+        _threadNames[@(event.thread)] = threadName;
+    }
+    
+    if (_count == _capacity) {
+        _dropped++;
+    } else {
+        _count++;
+    }
+    
+    _events[_next] = event;
+    _next = (_next + 1) % _capacity;
+    
+    pthread_mutex_unlock(&_lock);
+}
+
+- (void)recordSpan:(const char *)name
+             track:(uint64_t)track
+             start:(NSTimeInterval)start
+               end:(NSTimeInterval)end
+          argument:(const char *)argument
+             value:(int64_t)value
+{
+    CoTraceEvent event = {
+        .name = name, .argument = argument, .value = value, .track = track,
+        .start = start, .duration = MAX(end - start, 0),
+    };
+    [self addEvent:event];
+}
+
+- (void)recordInstant:(const char *)name track:(uint64_t)track argument:(const char *)argument value:(int64_t)value
+{
+    CoTraceEvent event = {
+        .name = name, .argument = argument, .value = value, .track = track,
+        .start = [CoTimingWheel now], .duration = -1,
+    };
+    [self addEvent:event];
+}
+
+- (void)setName:(NSString *)name ofTrack:(uint64_t)track
+{
+    name = [name copy];
+    
+    pthread_mutex_lock(&_lock);
+    _trackNames[@(track)] = name;
+    pthread_mutex_unlock(&_lock);
+}
+
+- (void)removeAllEvents
+{
+    pthread_mutex_lock(&_lock);
+    _count = 0;
+    _next = 0;
+    _dropped = 0;
+    pthread_mutex_unlock(&_lock);
+}
+
+/**
+ The trace event of event on the track of a thread or of a socket. Timestamps are microseconds since the recorder started.
+ */
+- (NSDictionary *)traceEventOf:(const CoTraceEvent *)event pid:(int)pid tid:(uint64_t)tid
+{
+    NSMutableDictionary *traceEvent = [NSMutableDictionary dictionaryWithCapacity:8];
+    
+    traceEvent[@"name"] = @(event->name);
+    traceEvent[@"cat"] = @"CoSocket";
+    traceEvent[@"pid"] = @(pid);
+    traceEvent[@"tid"] = @(tid);
+    traceEvent[@"ts"] = @((event->start - _origin) * 1e6);
+    
+    if (event->duration < 0) {
+        traceEvent[@"ph"] = @"i";
+        traceEvent[@"s"] = @"t";
+    } else {
+        traceEvent[@"ph"] = @"X";
+        traceEvent[@"dur"] = @(event->duration * 1e6);
+    }
+    
+    if (event->argument) {
+        traceEvent[@"args"] = @{ @(event->argument) : @(event->value) };
+    }
+    
+    return traceEvent;
+}
+
+- (NSDictionary *)metadataNamed:(NSString *)name pid:(int)pid tid:(uint64_t)tid arguments:(NSDictionary *)arguments
+{
+    return @{ @"name" : name, @"ph" : @"M", @"pid" : @(pid), @"tid" : @(tid), @"args" : arguments };
+}
+
+- (NSData *)JSONData
+{
+    // Copy the ring out, so recording isn't held up while the JSON is built
+    pthread_mutex_lock(&_lock);
+    
+    NSUInteger count = _count;
+    NSUInteger first = (_next + _capacity - count) % _capacity;
+    CoTraceEvent *events = malloc(MAX(count, 1) * sizeof(CoTraceEvent));
+    
+    for (NSUInteger i = 0; i < count && events; i++) {
+        events[i] = _events[(first + i) % _capacity];
+    }
+    
+    NSDictionary *threadNames = [_threadNames copy];
+    NSDictionary *trackNames = [_trackNames copy];
+    
+    pthread_mutex_unlock(&_lock);
+    
+    if (!events) {
+        return nil;
+    }
+    
+    int pid = getpid();
+    NSMutableArray *traceEvents = [NSMutableArray arrayWithCapacity:count * 2 + threadNames.count + trackNames.count + 1];
+    NSMutableSet *tracks = [NSMutableSet set];
+    
+    [traceEvents addObject:[self metadataNamed:@"process_name" pid:pid tid:0 arguments:@{ @"name" : [NSProcessInfo processInfo].processName }]];
+    
+    for (NSUInteger i = 0; i < count; i++) {
+        [traceEvents addObject:[self traceEventOf:&events[i] pid:pid tid:events[i].thread]];
+        [traceEvents addObject:[self traceEventOf:&events[i] pid:pid tid:CoTraceSocketTrackBase + events[i].track]];
+        [tracks addObject:@(events[i].track)];
+    }
+    
+    free(events);
+    
+    [threadNames enumerateKeysAndObjectsUsingBlock:^(NSNumber *thread, NSString *name, BOOL *stop) {
+        [traceEvents addObject:[self metadataNamed:@"thread_name" pid:pid tid:thread.unsignedLongLongValue arguments:@{ @"name" : name }]];
+    }];
+    
+    for (NSNumber *track in tracks) {
+        uint64_t tid = CoTraceSocketTrackBase + track.unsignedLongLongValue;
+        NSString *name = trackNames[track] ?: [NSString stringWithFormat:@"socket %@", track];
+        
+        [traceEvents addObject:[self metadataNamed:@"thread_name" pid:pid tid:tid arguments:@{ @"name" : name }]];
+        // Below the threads, in the order the sockets were created
+        [traceEvents addObject:[self metadataNamed:@"thread_sort_index" pid:pid tid:tid arguments:@{ @"sort_index" : @(CoTraceSocketTrackBase + track.intValue) }]];
+    }
+    
+    NSDictionary *trace = @{ @"traceEvents" : traceEvents, @"displayTimeUnit" : @"ms" };
+    
+    return [NSJSONSerialization dataWithJSONObject:trace options:0 error:NULL];
+}
+
+- (BOOL)writeJSONToFile:(NSString *)path error:(NSError **)errPtr
+{
+    NSData *data = [self JSONData];
+    
+    if (!data) {
+        if (errPtr) *errPtr = [NSError errorWithDomain:NSPOSIXErrorDomain code:ENOMEM userInfo:nil];
+        return NO;
+    }
+    
+    return [data writeToFile:path options:NSDataWritingAtomic error:errPtr];
+}
+
+@end
@@ -3,3 +3,13 @@
 //
 
 #import <CoSocket/CoSocket.h>
+#import <CoSocket/CoTimingWheel.h>
+#import <CoSocket/CoEventLoop.h>
+#import <CoSocket/CoRuntime.h>
+#import <CoSocket/CoBufferPool.h>
+#import <CoSocket/CoExecutor.h>
+#import <CoSocket/CoOperationContext.h>
+#import <CoSocket/CoPattern.h>
+#import <CoSocket/CoTelnet.h>
+#import <CoSocket/CoSlowOperationLog.h>
+#import <CoSocket/CoTraceRecorder.h>
@@ -7,12 +7,17 @@
 //
 
 import XCTest
+#if os(Linux)
+import Glibc
+#else
 import Darwin
+#endif
 
 class SocketTests: XCTestCase {
     var expectation: XCTestExpectation?
 
     let echoPort : UInt16 = 5007
+    let echoUnixPath = "/tmp/cosocket_echo_5007.sock"
     let echoTask = NSTask()
     
     // for artificially create a connection timeout error
@@ -27,7 +32,7 @@ class SocketTests: XCTestCase {
     func startEchoServer() {
         let echoServer = NSBundle(forClass: self.dynamicType).pathForResource("echo_server.py", ofType: "");
         echoTask.launchPath = echoServer
-        echoTask.arguments = ["-p", "\(echoPort)"]
+        echoTask.arguments = ["-p", "\(echoPort)", "-u", echoUnixPath, "-n", "\(echoPort + 1)"]
         
         let pipe = NSPipe()
         echoTask.standardOutput = pipe
@@ -146,6 +151,79 @@ class SocketTests: XCTestCase {
         XCTFail("Connection should fail")
     }
     
+    func testConnectToUnixSocket() {
+        let socket = CoSocket()
+        
+        do {
+            try socket.connectToUnixSocketAtPath(echoUnixPath, withTimeout: 1)
+            XCTAssertTrue(socket.isConnected)
+            XCTAssertEqual(socket.connectedHost, echoUnixPath)
+            try readWriteVerifyOnSocket(socket)
+        } catch let error as NSError {
+            XCTFail(error.description)
+        }
+    }
+    
+    func testConnectToMissingUnixSocket() {
+        let socket = CoSocket()
+        
+        do {
+            try socket.connectToUnixSocketAtPath(echoUnixPath + ".missing", withTimeout: 1)
+        } catch let error as NSError {
+            XCTAssertEqual(error.code, Int(ENOENT), error.description)
+            return
+        }
+        
+        XCTFail("Connection should fail")
+    }
+    
+    func testConnectWithLoopbackUpgrade() {
+        let socket = CoSocket()
+        socket.loopbackUpgradeEnabled = true
+        
+        do {
+            try socket.connectToHost(targetHost, onPort: self.echoPort, withTimeout: 1)
+            XCTAssertEqual(socket.connectedHost, echoUnixPath)
+            try readWriteVerifyOnSocket(socket)
+        } catch let error as NSError {
+            XCTFail(error.description)
+        }
+    }
+    
+    func testConnectWithLoopbackUpgradeDeclined() {
+        let socket = CoSocket()
+        socket.loopbackUpgradeEnabled = true
+        
+        do {
+            // This port of the echo server has no unix socket to advertise
+            try socket.connectToHost(ipv4Address, onPort: self.echoPort + 1, withTimeout: 1)
+            XCTAssertEqual(socket.connectedHost, ipv4Address)
+            try readWriteVerifyOnSocket(socket)
+        } catch let error as NSError {
+            XCTFail(error.description)
+        }
+    }
+    
+    func testAsyncConnectWithLoopbackUpgrade() {
+        let socket = CoSocket()
+        let done = expectationWithDescription("connected over the unix socket")
+        socket.loopbackUpgradeEnabled = true
+        
+        socket.connect(toHost: targetHost, port: self.echoPort, timeout: 1) { error in
+            XCTAssertNil(error)
+            XCTAssertEqual(socket.connectedHost, self.echoUnixPath)
+            done.fulfill()
+        }
+        
+        waitForExpectationsWithTimeout(5, handler: nil)
+        
+        do {
+            try readWriteVerifyOnSocket(socket)
+        } catch let error as NSError {
+            XCTFail(error.description)
+        }
+    }
+    
     // MARK: - Disconnect
     
     func testDisconnect() {
@@ -163,6 +241,96 @@ class SocketTests: XCTestCase {
         }
     }
     
+    func testShutdownWrite() {
+        let socket = CoSocket()
+        let echoData = "Hello world!".dataUsingEncoding(NSUTF8StringEncoding)
+        
+        do {
+            try socket.connectToHost(targetHost, onPort: self.echoPort, withTimeout: 10)
+            try socket.writeData(echoData)
+            try socket.shutdownWrite()
+            
+            // The peer still answers after our side is closed
+            let echoBackData = try socket.readDataToData(echoData)
+            XCTAssertEqual(echoData, echoBackData)
+        } catch let error as NSError {
+            XCTFail(error.description)
+        }
+    }
+    
+    func testCloseGracefully() {
+        let socket = CoSocket()
+        let echoData = "Hello world!".dataUsingEncoding(NSUTF8StringEncoding)
+        
+        do {
+            try socket.connectToHost(targetHost, onPort: self.echoPort, withTimeout: 0)
+            try socket.writeData(echoData)
+            try socket.closeGracefullyWithTimeout(5)
+            XCTAssertFalse(socket.isConnected)
+        } catch let error as NSError {
+            XCTFail(error.description)
+        }
+    }
+    
+#if os(Linux)
+    func testCloseGracefullyWaitsForUnsentData() {
+        var fds: [Int32] = [-1, -1]
+        XCTAssertEqual(socketpair(AF_UNIX, Int32(SOCK_STREAM.rawValue), 0, &fds), 0)
+        
+        let socket = CoSocket()
+        let payload = NSMutableData(length: 32 * 1024)!
+        var received = 0
+        let drained = dispatch_semaphore_create(0)
+        
+        do {
+            try socket.adoptConnectedSocketFD(fds[0])
+            try socket.writeData(payload)
+            
+            // The peer only starts reading after the close began, so the data is still queued then
+            dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0)) {
+                NSThread.sleepForTimeInterval(0.2)
+                var chunk = [UInt8](count: 4096, repeatedValue: 0)
+                while true {
+                    let count = read(fds[1], &chunk, chunk.count)
+                    if count <= 0 {
+                        break
+                    }
+                    received += count
+                }
+                close(fds[1])
+                dispatch_semaphore_signal(drained)
+            }
+            
+            let start = NSDate()
+            try socket.closeGracefullyWithTimeout(5)
+            XCTAssertGreaterThanOrEqual(NSDate().timeIntervalSinceDate(start), 0.2)
+            XCTAssertFalse(socket.isConnected)
+        } catch let error as NSError {
+            XCTFail(error.description)
+        }
+        
+        dispatch_semaphore_wait(drained, dispatch_time(DISPATCH_TIME_NOW, Int64(5 * NSEC_PER_SEC)))
+        XCTAssertEqual(received, payload.length)
+    }
+#endif
+    
+    func testAbort() {
+        let socket = CoSocket()
+        let echoData = "Hello world!".dataUsingEncoding(NSUTF8StringEncoding)
+        
+        do {
+            try socket.connectToHost(targetHost, onPort: self.echoPort, withTimeout: 0)
+            socket.abort()
+            XCTAssertFalse(socket.isConnected)
+            try socket.writeData(echoData)
+        } catch let error as NSError {
+            XCTAssertEqual(error.code, Int(EBADF), error.description)
+            return
+        }
+        
+        XCTFail("Write operation should fail after abort")
+    }
+    
     // MARK: - Write
     
     func testWriteData() {
@@ -179,6 +347,29 @@ class SocketTests: XCTestCase {
         XCTAssertTrue(socket.isConnected)
     }
     
+    func testWriteString() {
+        let socket = CoSocket()
+        let text = "EHLO münchen.example\r\n"
+        
+        do {
+            try socket.connectToHost(targetHost, onPort: self.echoPort, withTimeout: 2)
+            try socket.writeString(text, encoding: NSUTF8StringEncoding)
+            
+            let echoBackData = try socket.readDataToData(CoSocket.CRLFData())
+            XCTAssertEqual(echoBackData, text.dataUsingEncoding(NSUTF8StringEncoding))
+            
+            do {
+                try socket.writeString(text, encoding: NSASCIIStringEncoding)
+                XCTFail("Non-ASCII text should not be encodable as ASCII")
+            } catch let error as NSError {
+                XCTAssertEqual(error.code, Int(EILSEQ), error.description)
+                XCTAssertTrue(socket.isConnected)
+            }
+        } catch let error as NSError {
+            XCTFail(error.description)
+        }
+    }
+    
     func testWriteEmptyData() {
         let socket = CoSocket()
         let echoData = NSData()
@@ -248,6 +439,74 @@ class SocketTests: XCTestCase {
         XCTFail("Read operation should timed out")
     }
     
+    func testReadExpectingData() {
+        let socket = CoSocket()
+        let banner = "SSH-2.0-OpenSSH_7.2\r\n".dataUsingEncoding(NSUTF8StringEncoding)!
+        
+        do {
+            try socket.connectToHost(targetHost, onPort: self.echoPort, withTimeout: 2)
+            try socket.writeData(banner)
+            
+            try socket.readExpectingData("SSH-".dataUsingEncoding(NSUTF8StringEncoding))
+            
+            do {
+                try socket.readExpectingData("1.99".dataUsingEncoding(NSUTF8StringEncoding))
+                XCTFail("Mismatching data should be rejected")
+            } catch let error as NSError {
+                XCTAssertEqual(error.code, Int(EPROTO), error.description)
+            }
+            
+            // The mismatching bytes were left for the next read
+            let rest = try socket.readDataToData(CoSocket.CRLFData(), maxLength: 255)
+            XCTAssertEqual(rest, banner.subdataWithRange(NSMakeRange(4, banner.length - 4)))
+        } catch let error as NSError {
+            XCTFail(error.description)
+        }
+    }
+    
+    func testReadToDataBeyondMaxLength() {
+        let socket = CoSocket()
+        let echoData = "a line that is too long\r\n".dataUsingEncoding(NSUTF8StringEncoding)
+        
+        do {
+            try socket.connectToHost(targetHost, onPort: self.echoPort, withTimeout: 2)
+            try socket.writeData(echoData)
+            try socket.readDataToData(CoSocket.CRLFData(), maxLength: 8)
+        } catch let error as NSError {
+            XCTAssertFalse(socket.isConnected, error.description)
+            return
+        }
+        
+        XCTFail("Read operation should fail beyond maxLength")
+    }
+    
+    func testReadToPrompt() {
+        let socket = CoSocket()
+        // Only the final prompt can match, wherever the output is split on its way back
+        let output = "ls -l\r\n-rw-r--r-- 1 user staff 42 notes.txt\r\nuser@host:~$ "
+        
+        do {
+            let prompt = try CoPattern(string: "~\\$ $|~# $")
+            
+            try socket.connectToHost(targetHost, onPort: self.echoPort, withTimeout: 2)
+            try socket.writeData(output.dataUsingEncoding(NSUTF8StringEncoding))
+            
+            let echoBackData = try socket.readDataToPattern(prompt, maxLength: 0)
+            XCTAssertEqual(echoBackData, output.dataUsingEncoding(NSUTF8StringEncoding))
+        } catch let error as NSError {
+            XCTFail(error.description)
+        }
+    }
+    
+    func testPatternSyntaxError() {
+        do {
+            try CoPattern(string: "(a|b")
+            XCTFail("Unbalanced group should not compile")
+        } catch let error as NSError {
+            XCTAssertEqual(error.code, Int(EINVAL), error.description)
+        }
+    }
+    
     func testReadToLength() {
         let socket = CoSocket()
         let echoData = "Hello world!".dataUsingEncoding(NSUTF8StringEncoding)
@@ -300,6 +559,351 @@ class SocketTests: XCTestCase {
         XCTFail("Read operation should fail")
     }
     
+    // MARK: - Messages
+    
+#if os(Linux)
+    func testSeqPacketKeepsMessageBoundaries() {
+        var fds: [Int32] = [-1, -1]
+        XCTAssertEqual(socketpair(AF_UNIX, Int32(SOCK_SEQPACKET.rawValue), 0, &fds), 0)
+        
+        let sender = CoSocket()
+        let receiver = CoSocket()
+        let messages = ["a", "bc", "def"].map { $0.dataUsingEncoding(NSUTF8StringEncoding)! }
+        
+        do {
+            try sender.adoptConnectedSocketFD(fds[0])
+            try receiver.adoptConnectedSocketFD(fds[1])
+            
+            // All sent before the first is received, a stream would hand them back as one
+            for message in messages {
+                try sender.sendMessage(message)
+            }
+            
+            for message in messages {
+                XCTAssertEqual(try receiver.receiveMessage(), message)
+            }
+        } catch let error as NSError {
+            XCTFail("\(error)")
+        }
+    }
+#endif
+    
+    // MARK: - Shared Memory
+    
+#if os(Linux)
+    func testSharedMemoryTransport() {
+        var fds: [Int32] = [-1, -1]
+        XCTAssertEqual(socketpair(AF_UNIX, Int32(SOCK_STREAM.rawValue), 0, &fds), 0)
+        
+        let offering = CoSocket()
+        let accepting = CoSocket()
+        let accepted = dispatch_semaphore_create(0)
+        
+        // Bigger than the ring, so both sides have to wait for each other
+        let payload = NSMutableData(length: 48 * 1024)!
+        let bytes = UnsafeMutablePointer<UInt8>(payload.mutableBytes)
+        for i in 0..<payload.length {
+            bytes[i] = UInt8(i % 251)
+        }
+        
+        do {
+            try offering.adoptConnectedSocketFD(fds[0])
+            try accepting.adoptConnectedSocketFD(fds[1])
+            
+            dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0)) {
+                do {
+                    try accepting.acceptSharedMemory()
+                    try accepting.writeData(payload)
+                } catch let error as NSError {
+                    XCTFail("\(error)")
+                }
+                dispatch_semaphore_signal(accepted)
+            }
+            
+            try offering.offerSharedMemoryWithCapacity(4096)
+            XCTAssertTrue(offering.isSharedMemory)
+            
+            XCTAssertEqual(try offering.readDataToLength(UInt(payload.length)), payload)
+            dispatch_semaphore_wait(accepted, dispatch_time(DISPATCH_TIME_NOW, Int64(5 * NSEC_PER_SEC)))
+            XCTAssertTrue(accepting.isSharedMemory)
+            
+            let echoData = "Hello world!".dataUsingEncoding(NSUTF8StringEncoding)!
+            try offering.writeData(echoData)
+            XCTAssertEqual(try accepting.readDataToLength(UInt(echoData.length)), echoData)
+            
+            // Closing one side ends the stream of the other
+            offering.disconnect()
+            try accepting.readDataToLength(1)
+            XCTFail("Read should fail after the peer disconnected")
+        } catch let error as NSError {
+            XCTAssertFalse(accepting.isConnected, error.description)
+        }
+    }
+#endif
+    
+    // MARK: - Batch Reads
+    
+    func testReadAvailableLines() {
+        let socket = CoSocket()
+        let lines = ["first\r\n", "second\r\n", "third\r\n"]
+        let echoData = lines.joinWithSeparator("").dataUsingEncoding(NSUTF8StringEncoding)
+        
+        do {
+            try socket.connectToHost(targetHost, onPort: self.echoPort, withTimeout: 2)
+            try socket.writeData(echoData)
+            
+            var received = [String]()
+            while received.count < lines.count {
+                for line in try socket.readAvailableLinesWithSeparator(CoSocket.CRLFData(), max: 0) {
+                    received.append(String(data: line as! NSData, encoding: NSUTF8StringEncoding)!)
+                }
+            }
+            XCTAssertEqual(received, lines)
+        } catch let error as NSError {
+            XCTFail(error.description)
+        }
+    }
+    
+    func testReadAvailableFramesRejectsOversizedHeader() {
+        let socket = CoSocket()
+        // Declares a 1 MiB payload, the read buffer is 64 KiB
+        let frame = NSData(bytes: [0x00, 0x10, 0x00, 0x00, 0x61] as [UInt8], length: 5)
+        let start = NSDate()
+        
+        do {
+            try socket.connectToHost(targetHost, onPort: self.echoPort, withTimeout: 5)
+            try socket.writeData(frame)
+            try socket.readAvailableFramesWithHeaderLength(4, max: 0)
+        } catch let error as NSError {
+            // Refused from the header, not after waiting for the rest
+            XCTAssertNotEqual(error.code, Int(ETIMEDOUT), error.description)
+            XCTAssertLessThan(NSDate().timeIntervalSinceDate(start), 2)
+            XCTAssertFalse(socket.isConnected)
+            return
+        }
+        
+        XCTFail("A frame larger than the read buffer should be refused")
+    }
+    
+    func testReadLineAsString() {
+        let socket = CoSocket()
+        let text = "Grüße aus Köln\r\n"
+        let invalid = NSData(bytes: [0x6F, 0xC0, 0xAF, 0x0D, 0x0A] as [UInt8], length: 5)
+        
+        do {
+            try socket.connectToHost(targetHost, onPort: self.echoPort, withTimeout: 2)
+            try socket.writeData(text.dataUsingEncoding(NSUTF8StringEncoding))
+            try socket.writeData(invalid)
+            try socket.writeData("220 ready\r\n".dataUsingEncoding(NSUTF8StringEncoding))
+            
+            let line = try socket.readLineAsStringWithSeparator(CoSocket.CRLFData(), encoding: NSUTF8StringEncoding)
+            XCTAssertEqual(line, "Grüße aus Köln")
+            
+            do {
+                // Overlong encoding of "/"
+                try socket.readLineAsStringWithSeparator(CoSocket.CRLFData(), encoding: NSUTF8StringEncoding)
+                XCTFail("Invalid UTF-8 should be rejected")
+            } catch let error as NSError {
+                XCTAssertEqual(error.code, Int(EILSEQ), error.description)
+            }
+            
+            let banner = try socket.readLineAsStringWithSeparator(CoSocket.CRLFData(), encoding: NSASCIIStringEncoding)
+            XCTAssertEqual(banner, "220 ready")
+        } catch let error as NSError {
+            XCTFail(error.description)
+        }
+    }
+    
+    // MARK: - Telnet
+    
+    func testTelnetEscapesIACAndRefusesOptions() {
+        let socket = CoSocket()
+        let telnet = CoTelnet(socket: socket)
+        let payload = NSData(bytes: [0x41, 0xFF, 0x42] as [UInt8], length: 3)
+        let doTerminalType = NSData(bytes: [0xFF, 0xFD, 0x18] as [UInt8], length: 3)
+        
+        do {
+            try socket.connectToHost(targetHost, onPort: self.echoPort, withTimeout: 2)
+            
+            // Echoed back as 41 FF FF 42, which decodes to the payload again
+            try telnet.writeData(payload)
+            let received = NSMutableData()
+            while received.length < payload.length {
+                received.appendData(try telnet.readPayload())
+            }
+            XCTAssertEqual(received, payload)
+            
+            // The echoed DO is refused with WONT, whose echo needs no answer
+            try socket.writeData(doTerminalType)
+            XCTAssertEqual(try telnet.readPayload().length, 0)
+            XCTAssertFalse(telnet.isLocalOptionEnabled(0x18))
+        } catch let error as NSError {
+            XCTFail(error.description)
+        }
+    }
+    
+    func testTelnetBareCarriageReturn() {
+        let socket = CoSocket()
+        let telnet = CoTelnet(socket: socket)
+        let text = "a\rb\r\n".dataUsingEncoding(NSUTF8StringEncoding)!
+        
+        do {
+            try socket.connectToHost(targetHost, onPort: self.echoPort, withTimeout: 2)
+            
+            // A CR without LF goes out as CR NUL, CR LF as it is
+            try telnet.writeData(text)
+            let wire = try socket.readDataToLength(6)
+            XCTAssertEqual(wire, NSData(bytes: [0x61, 0x0D, 0x00, 0x62, 0x0D, 0x0A] as [UInt8], length: 6))
+            
+            // And the NUL is dropped again on the way in
+            try socket.writeData(wire)
+            let received = NSMutableData()
+            while received.length < text.length {
+                received.appendData(try telnet.readPayload())
+            }
+            XCTAssertEqual(received, text)
+        } catch let error as NSError {
+            XCTFail(error.description)
+        }
+    }
+    
+    // MARK: - Operation Context
+    
+    func testContextBoundsWholeRequest() {
+        let socket = CoSocket()
+        let echoData = "Hello world!".dataUsingEncoding(NSUTF8StringEncoding)
+        
+        // Each call may take 2 seconds, the whole request only 0.5
+        socket.context = CoOperationContext(timeout: 0.5, traceTag: "request-1")
+        
+        do {
+            try socket.connectToHost(targetHost, onPort: self.echoPort, withTimeout: 2)
+            try socket.writeData(echoData)
+            try socket.readDataToLength(echoData!.length)
+            try socket.readDataToLength(1)
+        } catch let error as NSError {
+            XCTAssertEqual(error.code, Int(ETIMEDOUT), error.description)
+            XCTAssertEqual(error.userInfo[CoOperationTraceTagKey] as? String, "request-1")
+            return
+        }
+        
+        XCTFail("Read operation should time out with the context")
+    }
+    
+    func testContextCancelWakesBlockedRead() {
+        let socket = CoSocket()
+        let context = CoOperationContext(timeout: -1)
+        
+        do {
+            try socket.connectToHost(targetHost, onPort: self.echoPort, withTimeout: 0)
+            socket.context = context
+            
+            dispatch_after(dispatch_time(DISPATCH_TIME_NOW, Int64(0.2 * Double(NSEC_PER_SEC))), dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0)) {
+                context.cancel()
+            }
+            
+            try socket.readDataToLength(1)
+        } catch let error as NSError {
+            XCTAssertEqual(error.code, Int(ECANCELED), error.description)
+            XCTAssertFalse(socket.isConnected)
+            return
+        }
+        
+        XCTFail("Read operation should fail once the context is cancelled")
+    }
+    
+    // MARK: - Slow Operation Log
+    
+    func testSlowOperationLog() {
+        let socket = CoSocket()
+        let log = CoSlowOperationLog(capacity: 4)
+        let echoData = "Hello world!".dataUsingEncoding(NSUTF8StringEncoding)
+        
+        socket.slowOperationThreshold = 0.1
+        socket.slowOperationLog = log
+        
+        do {
+            try socket.connectToHost(targetHost, onPort: self.echoPort, withTimeout: 0.3)
+            try socket.writeData(echoData)
+            try socket.readDataToLength(echoData!.length)
+            try socket.readDataToLength(1)
+        } catch let error as NSError {
+            XCTAssertEqual(error.code, Int(ETIMEDOUT), error.description)
+            
+            let entry = log.operations.last as! CoSlowOperation
+            XCTAssertTrue(entry.operation.containsString("readDataToLength"), entry.description)
+            XCTAssertEqual(entry.error?.code, Int(ETIMEDOUT))
+            XCTAssertEqual(entry.remotePort, self.echoPort)
+            XCTAssertGreaterThanOrEqual(entry.waitTime, 0.2)
+            XCTAssertEqual(entry.bytes, 0)
+            return
+        }
+        
+        XCTFail("Read operation should time out")
+    }
+    
+    // MARK: - Operation Times
+    
+    func testOperationTimes() {
+        let socket = CoSocket()
+        let echoData = "Hello world!".dataUsingEncoding(NSUTF8StringEncoding)
+        
+        socket.CPUTimeAccountingEnabled = true
+        
+        do {
+            try socket.connectToHost(targetHost, onPort: self.echoPort, withTimeout: 2)
+            try socket.writeData(echoData)
+            try socket.readDataToLength(echoData!.length)
+        } catch let error as NSError {
+            XCTFail("\(error)")
+        }
+        
+        let times = socket.operationTimes["-[CoSocket readDataToLength:error:]"] as! NSDictionary
+        let wallTime = times["wallTime"] as! Double
+        
+        XCTAssertEqual(times["count"] as? Int, 1)
+        XCTAssertLessThanOrEqual(times["cpuTime"] as! Double, wallTime)
+        XCTAssertLessThanOrEqual(times["blockedTime"] as! Double, wallTime)
+        XCTAssertNotNil(socket.operationTimes["-[CoSocket writeData:error:]"])
+        
+        socket.resetOperationTimes()
+        XCTAssertEqual(socket.operationTimes.count, 0)
+    }
+    
+    // MARK: - Trace Recorder
+    
+    func testTraceRecorderExportsChromeTrace() {
+        let socket = CoSocket()
+        let recorder = CoTraceRecorder()
+        let echoData = "Hello world!".dataUsingEncoding(NSUTF8StringEncoding)
+        
+        socket.traceRecorder = recorder
+        
+        do {
+            try socket.connectToHost(targetHost, onPort: self.echoPort, withTimeout: 2)
+            try socket.writeData(echoData)
+            try socket.readDataToLength(echoData!.length)
+            socket.disconnect()
+            
+            let trace = try NSJSONSerialization.JSONObjectWithData(recorder.JSONData(), options: []) as! NSDictionary
+            let events = trace["traceEvents"] as! [NSDictionary]
+            let names = Set(events.map { $0["name"] as! String })
+            
+            XCTAssertTrue(names.contains("handshake"))
+            XCTAssertTrue(names.contains("send"))
+            XCTAssertTrue(names.contains("disconnect"))
+            
+            let received = events.filter { $0["name"] as? String == "recv" && $0["ph"] as? String == "X" }
+            let bytes = received.reduce(0) { $0 + max(($1["args"] as! NSDictionary)["bytes"] as! Int, 0) }
+            
+            // Each on the thread's track and on the socket's
+            XCTAssertEqual(bytes, 2 * echoData!.length)
+            XCTAssertEqual(recorder.droppedEventCount, 0)
+        } catch let error as NSError {
+            XCTFail("\(error)")
+        }
+    }
+    
     // MARK: - IPv4 / IPv6
     
     func testConnectToIPv4WithIPv4Enabled() {
@@ -379,6 +983,358 @@ class SocketTests: XCTestCase {
         XCTFail("Connect should fail")
     }
     
+    // MARK: - Idle Timeout
+    
+    func testIdleTimeout() {
+        let socket = CoSocket()
+        socket.idleTimeout = 0.5
+        let echoData = "Hello world!".dataUsingEncoding(NSUTF8StringEncoding)
+        
+        do {
+            try socket.connectToHost(targetHost, onPort: self.echoPort, withTimeout: 0)
+            try readWriteVerifyOnSocket(socket)
+            NSThread.sleepForTimeInterval(1.0)
+            try socket.writeData(echoData)
+        } catch let error as NSError {
+            XCTAssertEqual(error.code, Int(EPIPE), error.description)
+            return
+        }
+        
+        XCTFail("Write operation should fail on an idle connection")
+    }
+    
+    // MARK: - Heartbeat
+    
+    func testHeartbeatRoundTrip() {
+        let socket = CoSocket()
+        // Messages are a type byte and a length byte before the payload, the echo server answers every ping with itself
+        let ping = "P\0".dataUsingEncoding(NSUTF8StringEncoding)!
+        let framer: CoSocketMessageFramer = { bytes, length, isPong in
+            if length < 2 {
+                return 0
+            }
+            let header = UnsafePointer<UInt8>(bytes)
+            isPong.memory = ObjCBool(header[0] == UInt8(ascii: "P"))
+            return 2 + UInt(header[1])
+        }
+        
+        do {
+            try socket.connectToHost(targetHost, onPort: self.echoPort, withTimeout: 0)
+            socket.startHeartbeatWithInterval(0.1, ping: ping, framer: framer, maxMissed: 3)
+            NSThread.sleepForTimeInterval(0.5)
+            
+            XCTAssertGreaterThan(socket.heartbeatRoundTripTime, 0)
+            XCTAssertEqual(socket.missedHeartbeats, 0)
+            
+            // Pongs don't leak into the data read, not even when the payload looks like one
+            let message = "D\u{4}P\0P\0".dataUsingEncoding(NSUTF8StringEncoding)!
+            for _ in 0..<10 {
+                try socket.writeData(message)
+                NSThread.sleepForTimeInterval(0.05)
+                let echoed = try socket.readDataToLength(UInt(message.length))
+                XCTAssertEqual(echoed, message)
+            }
+            socket.stopHeartbeat()
+        } catch let error as NSError {
+            XCTFail(error.description)
+        }
+        
+        socket.disconnect()
+    }
+    
+    // MARK: - Timing Wheel
+    
+    func testTimingWheelFiresInOrder() {
+        let wheel = CoTimingWheel(resolution: 0.01)
+        let start = CoTimingWheel.now()
+        var fired = [Int]()
+        
+        wheel.scheduleTimerWithTimeInterval(0.5) { fired.append(3) }
+        wheel.scheduleTimerWithTimeInterval(0.02) { fired.append(1) }
+        wheel.scheduleTimerWithTimeInterval(0.1) { fired.append(2) }
+        XCTAssertEqual(wheel.count, 3)
+        
+        XCTAssertEqual(wheel.advanceToTime(start), 0)
+        XCTAssertEqual(wheel.advanceToTime(start + 0.2), 2)
+        XCTAssertEqual(fired, [1, 2])
+        XCTAssertEqual(wheel.advanceToTime(start + 1.0), 1)
+        XCTAssertEqual(fired, [1, 2, 3])
+        XCTAssertEqual(wheel.count, 0)
+        XCTAssertLessThan(wheel.nextTimeout(), 0)
+    }
+    
+    func testTimingWheelCancel() {
+        let wheel = CoTimingWheel(resolution: 0.01)
+        let start = CoTimingWheel.now()
+        var fired = false
+        
+        // Far enough out to sit in a coarser wheel and be cascaded
+        let timer = wheel.scheduleTimerWithTimeInterval(2.0) { fired = true }
+        XCTAssertTrue(timer.pending)
+        timer.cancel()
+        XCTAssertFalse(timer.pending)
+        
+        XCTAssertEqual(wheel.advanceToTime(start + 3.0), 0)
+        XCTAssertFalse(fired)
+    }
+    
+    // MARK: - Non-blocking
+    
+    func testTryReadWouldBlock() {
+        let socket = CoSocket()
+        let echoData = "Hello world!".dataUsingEncoding(NSUTF8StringEncoding)!
+        var interest: CoEventMask = []
+        
+        do {
+            try socket.connectToHost(targetHost, onPort: self.echoPort, withTimeout: 10)
+            
+            // Nothing sent yet, so nothing to read
+            let early = socket.tryReadDataToData(echoData, interest: &interest, error: nil)
+            XCTAssertNil(early)
+            XCTAssertEqual(interest, CoEventMask.Read)
+            
+            XCTAssertEqual(socket.tryWriteData(echoData, interest: &interest, error: nil), echoData.length)
+            XCTAssertEqual(interest, [])
+            
+            var pfd = pollfd(fd: socket.readinessFileDescriptor, events: Int16(POLLIN), revents: 0)
+            XCTAssertEqual(poll(&pfd, 1, 5000), 1)
+            
+            let echoBackData = socket.tryReadDataToData(echoData, interest: &interest, error: nil)
+            XCTAssertEqual(echoData, echoBackData)
+        } catch let error as NSError {
+            XCTFail(error.description)
+        }
+    }
+    
+    // MARK: - Asynchronous
+    
+    func testAsyncConnectWriteRead() {
+        let socket = CoSocket()
+        let echoData = "Hello world!".dataUsingEncoding(NSUTF8StringEncoding)!
+        let done = expectationWithDescription("echo read back")
+        
+        socket.connect(toHost: targetHost, port: self.echoPort, timeout: 10) { error in
+            XCTAssertNil(error)
+            
+            socket.write(echoData) { error in
+                XCTAssertNil(error)
+            }
+            socket.read(until: echoData) { data, error in
+                XCTAssertNil(error)
+                XCTAssertEqual(echoData, data)
+                done.fulfill()
+            }
+        }
+        
+        waitForExpectationsWithTimeout(10, handler: nil)
+        
+        // The blocking methods keep working on the same stream
+        do {
+            try readWriteVerifyOnSocket(socket)
+        } catch let error as NSError {
+            XCTFail(error.description)
+        }
+    }
+    
+    func testAsyncReadTimeout() {
+        let socket = CoSocket()
+        let done = expectationWithDescription("read timed out")
+        
+        do {
+            try socket.connectToHost(targetHost, onPort: self.echoPort, withTimeout: 0.5)
+        } catch let error as NSError {
+            XCTFail(error.description)
+        }
+        
+        socket.read(exactly: 1) { data, error in
+            XCTAssertNil(data)
+            XCTAssertEqual(error?.code, Int(ETIMEDOUT))
+            done.fulfill()
+        }
+        
+        waitForExpectationsWithTimeout(5, handler: nil)
+    }
+    
+    func testAsyncInvalidArgumentCompletesLater() {
+        let socket = CoSocket()
+        let done = expectationWithDescription("write failed")
+        var returned = false
+        
+        // Fails right away, but still never before the method returned
+        socket.write(NSData()) { error in
+            XCTAssertNotNil(error)
+            XCTAssertTrue(returned)
+            done.fulfill()
+        }
+        returned = true
+        
+        waitForExpectationsWithTimeout(5, handler: nil)
+    }
+    
+    func testUnsafeReadBuffer() {
+        let socket = CoSocket()
+        let echoData = "Hello world!".dataUsingEncoding(NSUTF8StringEncoding)!
+        var borrowed = 0
+        
+        do {
+            try socket.connectToHost(targetHost, onPort: self.echoPort, withTimeout: 10)
+            try socket.writeData(echoData)
+            
+            // Take the first byte only, without copying the buffer
+            try socket.withUnsafeReadBuffer { bytes, length in
+                borrowed = length
+                XCTAssertEqual(UnsafePointer<UInt8>(bytes)[0], UInt8(ascii: "H"))
+                return 1
+            }
+            XCTAssertGreaterThan(borrowed, 0)
+            
+            let rest = try socket.readDataToLength(echoData.length - 1)
+            XCTAssertEqual(rest, echoData.subdataWithRange(NSMakeRange(1, echoData.length - 1)))
+        } catch let error as NSError {
+            XCTFail(error.description)
+        }
+    }
+    
+    // MARK: - Buffer Pool
+    
+    func testBufferPoolReusesBuffersOnNode() {
+        let pool = CoBufferPool(bufferSize: 4096, maxFreeCount: 1)
+        let node = CoBufferPool.currentNode()
+        
+        let first = pool.allocateBuffer()
+        let second = pool.allocateBuffer()
+        XCTAssertTrue(first != nil && second != nil)
+        
+        pool.releaseBuffer(first)
+        pool.releaseBuffer(second)
+        // Only one is kept, the other is unmapped
+        XCTAssertEqual(pool.freeCountOnNode(node), 1)
+        
+        let reused = pool.allocateBuffer()
+        XCTAssertTrue(reused == first)
+        XCTAssertEqual(pool.freeCountOnNode(node), 0)
+        pool.releaseBuffer(reused)
+    }
+    
+    func testBufferPoolMemoryLimit() {
+        let pool = CoBufferPool(bufferSize: 4096, maxFreeCount: 4)
+        let node = CoBufferPool.currentNode()
+        
+        // Room for two buffers and their headers on top of what's mapped already
+        CoBufferPool.setMemoryLimit(CoBufferPool.memoryInUse() + 2 * (4096 + 64))
+        defer { CoBufferPool.setMemoryLimit(0) }
+        
+        let first = pool.allocateBuffer()
+        let second = pool.allocateBuffer()
+        XCTAssertTrue(first != nil && second != nil)
+        
+        XCTAssertTrue(pool.allocateBuffer() == nil)
+        XCTAssertEqual(errno, ENOBUFS)
+        XCTAssertTrue(CoBufferPool.isMemoryUnderPressure())
+        
+        // Under pressure released buffers are unmapped, making room again
+        pool.releaseBuffer(first)
+        XCTAssertEqual(pool.freeCountOnNode(node), 0)
+        let third = pool.allocateBuffer()
+        XCTAssertTrue(third != nil)
+        
+        pool.releaseBuffer(second)
+        pool.releaseBuffer(third)
+    }
+    
+    // MARK: - Event Loop
+    
+    func testEventLoopRunsPostedBlocksAndTimers() {
+        let loop = CoEventLoop(name: "test.loop", cpu: -1)
+        let posted = expectationWithDescription("posted block runs on the loop")
+        let timer = expectationWithDescription("timer fires on the loop")
+        
+        loop.start()
+        loop.post {
+            XCTAssertTrue(loop.current)
+            posted.fulfill()
+        }
+        loop.timingWheel.scheduleTimerWithTimeInterval(0.05) {
+            XCTAssertTrue(CoEventLoop.currentLoop() === loop)
+            timer.fulfill()
+        }
+        
+        waitForExpectationsWithTimeout(5, handler: nil)
+        loop.stop()
+    }
+    
+    func testRuntimeAdoptsSocket() {
+        let runtime = CoRuntime(loopCount: 2, pinned: true)
+        let socket = CoSocket()
+        let loop = runtime.nextLoop()
+        let added = expectationWithDescription("socket added on its loop")
+        
+        XCTAssertEqual(runtime.loops.count, 2)
+        
+        do {
+            try socket.connectToHost(targetHost, onPort: self.echoPort, withTimeout: 0)
+            loop.addSocket(socket)
+            loop.post {
+                XCTAssertTrue(loop.sockets.contains(socket))
+                XCTAssertTrue(socket.eventLoop === loop)
+                added.fulfill()
+            }
+            waitForExpectationsWithTimeout(5, handler: nil)
+            
+            try readWriteVerifyOnSocket(socket)
+        } catch let error as NSError {
+            XCTFail(error.description)
+        }
+        
+        runtime.stop()
+    }
+    
+    // MARK: - Executor
+    
+    func testExecutorSpreadsBurstByStealing() {
+        let executor = CoExecutor(workerCount: 4)
+        let lock = NSLock()
+        let done = expectationWithDescription("all tasks ran")
+        let taskCount = 200
+        var ran = 0
+        
+        // A burst submitted by one worker lands on its own deque, the idle workers have to steal it
+        executor.submit {
+            for _ in 0..<taskCount {
+                executor.submit {
+                    NSThread.sleepForTimeInterval(0.001)
+                    lock.lock()
+                    ran += 1
+                    if ran == taskCount { done.fulfill() }
+                    lock.unlock()
+                }
+            }
+        }
+        
+        waitForExpectationsWithTimeout(10, handler: nil)
+        XCTAssertGreaterThan(executor.stolenCount, 0)
+        executor.stop()
+    }
+    
+    // MARK: - Multipath TCP
+    
+    func testConnectWithMultipathEnabled() {
+        let socket = CoSocket()
+        socket.multipathEnabled = true
+        
+        do {
+            // Falls back to TCP wherever MPTCP isn't available
+            try socket.connectToHost(ipv4Address, onPort: self.echoPort, withTimeout: 0)
+            try readWriteVerifyOnSocket(socket)
+        } catch let error as NSError {
+            XCTFail(error.description)
+        }
+        
+        if !socket.isMultipath {
+            XCTAssertNil(socket.multipathInfo)
+        }
+    }
+    
     // MARK: - Connected Host / Port
     
     func testConnectedHostPort() {
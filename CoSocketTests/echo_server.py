@@ -11,12 +11,24 @@ Implemented with Python standard module SocketServer.
 """
 
 import SocketServer
-from SocketServer import TCPServer, ThreadingMixIn, StreamRequestHandler
+from SocketServer import TCPServer, UnixStreamServer, ThreadingMixIn, StreamRequestHandler
 import optparse
+import os
 import sys
+import threading
 import time
 import re
 import socket
+import struct
+
+# Loopback upgrade handshake of CoSocket, see loopbackUpgradeEnabled in CoSocket.h
+UPGRADE_REQUEST = "COUNIX?1"
+UPGRADE_REPLY = "COUNIX!1"
+UPGRADE_HELLO = "COUNIX=1"
+UPGRADE_TOKEN_LENGTH = 16
+
+upgrade_tokens = set()
+upgrade_lock = threading.Lock()
 
 def current_time():
     return time.strftime("%Y-%m-%d %H:%M:%S", time.localtime(time.time()))
@@ -25,6 +37,8 @@ def current_time():
 # We mix with ThreadingMixIn to allow several simultaneous
 # clients. Otherwise, a slow client may block everyone.
 class ThreadingTCPServer(ThreadingMixIn, TCPServer):
+    upgrade_path = None  # Unix socket advertised to clients asking for a loopback upgrade
+
     def server_activate(self):
         SocketServer.TCPServer.server_activate(self)
         sys.stdout.write("Server listening on %s\n" % (self.server_address,) )
@@ -37,6 +51,10 @@ class ThreadingTCPServer(ThreadingMixIn, TCPServer):
         SocketServer.TCPServer.server_bind(self)
 
 
+class ThreadingUnixServer(ThreadingMixIn, UnixStreamServer):
+    pass
+
+
 # StreamRequestHandler provides us with the rfile and wfile attributes
 class EchoHandler(StreamRequestHandler):
     def log(self, peer, size):
@@ -46,6 +64,35 @@ class EchoHandler(StreamRequestHandler):
         sys.stdout.write("%s - %s - %i bytes\n" % (current_time(),
                                                    peer, size))
 
+    def answer_upgrade(self):
+        """ Answers CoSocket's loopback upgrade handshake if the connection starts
+        with it, returns the bytes read otherwise, to be echoed """
+        if isinstance(self.client_address, tuple):
+            magic = UPGRADE_REQUEST
+        else:
+            magic = UPGRADE_HELLO
+        prefix = ""
+        while len(prefix) < len(magic):
+            byte = self.rfile.read(1)
+            prefix = prefix + byte
+            if byte == "" or not magic.startswith(prefix):
+                return prefix
+        if magic == UPGRADE_HELLO:
+            # The session moved over from TCP, echo on this connection from now on
+            token = self.rfile.read(UPGRADE_TOKEN_LENGTH)
+            with upgrade_lock:
+                upgrade_tokens.discard(token)
+            return ""
+        path = self.server.upgrade_path or ""
+        reply = UPGRADE_REPLY + struct.pack("!H", len(path))
+        if path:
+            token = os.urandom(UPGRADE_TOKEN_LENGTH)
+            with upgrade_lock:
+                upgrade_tokens.add(token)
+            reply = reply + path + token
+        self.wfile.write(reply)
+        return ""
+
     def handle(self):
         """ Echoes (sends back) whatever it reads """
         # Warning, the Python read() is not the same as the C
@@ -64,7 +111,14 @@ class EchoHandler(StreamRequestHandler):
         #
         data = "DUMMY"
         size = 0
-        peer = self.client_address[0]
+        if isinstance(self.client_address, tuple):
+            peer = self.client_address[0]
+        else:
+            peer = "unix"  # Unix domain clients are unnamed
+        prefix = self.answer_upgrade()
+        if prefix:
+            self.wfile.write(prefix)
+            size = len(prefix)
         while data != "":
             data = self.rfile.read(1)
             try:
@@ -81,9 +135,27 @@ if __name__ == '__main__':
                       type="int",
                       default="2200", # Standard port is 7 but, on Unix, you need to be root to use it
                       )
+    parser.add_option('-u', '--unix',
+                      help="also listen on a unix domain socket at this path",
+                      default=None,
+                      )
+    parser.add_option('-n', '--no-upgrade-port',
+                      help="also listen on this port, declining loopback upgrades",
+                      type="int",
+                      default=None,
+                      )
                       
     options, args = parser.parse_args()
 
+    # Listen on the unix socket before the TCP server reports it is ready
+    if options.unix:
+        if os.path.exists(options.unix):
+            os.unlink(options.unix)
+        unix_server = ThreadingUnixServer(options.unix, EchoHandler)
+        unix_thread = threading.Thread(target=unix_server.serve_forever)
+        unix_thread.daemon = True
+        unix_thread.start()
+
     ThreadingTCPServer.allow_reuse_address = True
     # SocketServer should transparently accept IPv6 connections. But
     # it does not. So, we tell it. Note that using socket.AF_INET6
@@ -94,5 +166,11 @@ if __name__ == '__main__':
     # See the very detailed study
     # <https://edms.cern.ch/document/971407>
     ThreadingTCPServer.address_family = socket.AF_INET6
+    if options.no_upgrade_port:
+        plain_server = ThreadingTCPServer(("", options.no_upgrade_port), EchoHandler)
+        plain_thread = threading.Thread(target=plain_server.serve_forever)
+        plain_thread.daemon = True
+        plain_thread.start()
     server = ThreadingTCPServer(("", options.port), EchoHandler)
+    server.upgrade_path = options.unix
     server.serve_forever()